@@ -18,11 +18,23 @@ using boost::shared_ptr;
 
 using namespace Convolver;
 
+static const Float64 kCrossfadeSeconds = 0.05;
+
 AUConvolver::AUConvolver(AUEffectBase &au, shared_ptr<BlockPattern> blockPattern) 
 	: Convolver(blockPattern, true), au(au)
 {
 	//au.GetMaxFramesPerSlice()
 	
+	// We're being played live, a late partition is better left out than waited for
+	setSampleRate(au.GetSampleRate());
+	setSkipLateWork(true);
+	setLatePolicy(Kernel::LATE_MIX_LATE);
+	// Picking another IR mid-song shouldn't click
+	setCrossfadeLength((uint32_t)(au.GetSampleRate() * kCrossfadeSeconds));
+	
+	// We only do mono and stereo, so this is all convolve() ever needs
+	in.reserve(2);
+	out.reserve(2);
 }
 
 void AUConvolver::setFilters(Filters &filters, float stereoSeparation)
@@ -52,13 +64,13 @@ void AUConvolver::convolve(const AudioBufferList & inBuffer,
 	assert(sizeof(AudioSampleType) == sizeof(TimeSample));
 	
 	uint32_t size = inBuffer.mNumberBuffers;
-	std::vector<const TimeSample *> in(size);
+	in.resize(size);
 	for (uint32_t i=0; i < size; i++) {
 		in[i] = (const TimeSample *)inBuffer.mBuffers[i].mData;
 	}
 	
 	size = outBuffer.mNumberBuffers;
-	std::vector<TimeSample *> out(size);
+	out.resize(size);
 	for (uint32_t i=0; i < size; i++) {
 		#if DEBUG_CONVOLVE
 		cout << "AUConvolver::convolve() out channel: " << i << " pointer(" << (uint32_t)outBuffer.mBuffers[i].mData << ")" << endl;
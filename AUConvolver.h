@@ -29,6 +29,10 @@ namespace Convolver {
 							  float wetGain);
 	protected:
 		AUEffectBase &au;
+		
+		// Reused every callback so the render thread doesn't allocate
+		std::vector<const TimeSample *> in;
+		std::vector<TimeSample *> out;
 
 	};
 }
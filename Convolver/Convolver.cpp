@@ -13,9 +13,15 @@
 namespace Convolver {
 
 	Convolver::Convolver(shared_ptr<BlockPattern> blockPattern, bool useBackgroundThreads)
-		: convolver(blockPattern), blockPattern(blockPattern), channelStates(), setup(), newSetup(), useBackgroundThreads(useBackgroundThreads)
+		: convolver(blockPattern), blockPattern(blockPattern), channelStates(), wetBlock(blockPattern->minimumBlockSize()), setup(), newSetup(), hasNewSetup(false), useBackgroundThreads(useBackgroundThreads), ringOutThreshold(-96.0f),
+		  fadingSetup(), fadingStates(), crossfadeLength(0), crossfadePosition(0), crossfadeMicroseconds(0)
 	{
 		pthread_mutex_init(&newSetupMutex, NULL);
+		// Same goes for the thread old setups get released on
+		Releaser::get();
+		unreleased.reserve(kMaxUnreleased);
+		// Get the workers going now, rather than on the audio thread the first time we need them
+		if (useBackgroundThreads) WorkerPool::get().reserveTiers(convolver.getPartitionSizes().size());
 		#if DEBUG
 		cout << "Convolver::Convolver(): created with " << blockPattern->toString() << endl;
 		#endif
@@ -28,53 +34,115 @@ namespace Convolver {
 	
 
 
-	void Convolver::setupOutputs(Outputs &outputs, std::vector<TimeSample *> & out) {
-		assert(outputs.size() == out.size());
-		assert(sizeof(AudioSampleType) == sizeof(float));
+	bool Convolver::swapInNewSetup(uint32_t numOutputs) {
+		if (!hasNewSetup) return false;
 		
-		uint32_t size = out.size();
+		shared_ptr<Setup> oldSetup;
+		pthread_mutex_lock(&this->newSetupMutex); {
+			oldSetup.swap(this->setup);
+			this->setup.swap(this->newSetup);
+			hasNewSetup = false;
+		} pthread_mutex_unlock(&this->newSetupMutex);
+		
+		// Never more than two setups running at once
+		if (fadingSetup != NULL) finishCrossfade();
+		
+		// After setBlockPattern() the old setup's filters are partitioned for a pattern the
+		// kernel's not running any more, so it can't fade out, it's cut off
+		bool oldSetupFits = oldSetup != NULL;
+		if (oldSetup != NULL) {
+			foreach(ConvolutionOp &convolutionOp, oldSetup->convolutionOps) {
+				if (convolutionOp.get<1>()->getBlockPattern() != blockPattern) oldSetupFits = false;
+			}
+		}
 		
-		for(uint32_t i=0; i < size; i++) {
-			outputs[i] = boost::make_tuple(out[i], false);
+		// Everything's swapped rather than copied, so nothing gets allocated or freed here
+		vector<shared_ptr<State> > &newStates = setup->channelStates;
+		if (crossfadeLength > 0 && oldSetupFits && numOutputs <= setup->numStates) {
+			#if DEBUG
+			cout << "Convolver::swapInNewSetup(): fading out the old setup over " << crossfadeLength << " samples" << endl;
+			#endif
+			fadingStates.swap(channelStates);
+			channelStates.swap(newStates);
+			fadingSetup.swap(oldSetup);
+			crossfadePosition = 0;
+		} else {
+			// The states we've got keep ringing on with the old IR's tail, any extra come from
+			// the new setup, and any we don't need any more go with it
+			#if DEBUG
+			cout << "Convolver::swapInNewSetup(): new setup has " << setup->numStates << " channels";
+			cout << ", we currently have " << channelStates.size() << " channels" << endl;
+			#endif
+			channelStates.swap(newStates);
+			uint32_t numKept = std::min(channelStates.size(), newStates.size());
+			for (uint32_t i=0; i < numKept; i++) {
+				channelStates[i].swap(newStates[i]);
+				// The new setup's ops may reach further ahead than the old ones did
+				channelStates[i]->takeOverAccumulators(*newStates[i]);
+			}
 		}
+		
+		if (oldSetup != NULL) release(oldSetup);
+		return true;
 	}
 	
-	bool Convolver::swapInNewSetup() {
-		if (this->newSetup != NULL) {		
-			
-			pthread_mutex_lock(&this->newSetupMutex); {
-				this->setup = newSetup;
-				this->newSetup = shared_ptr<Setup>();
-			} pthread_mutex_unlock(&this->newSetupMutex);
-			
-			uint32_t numChannelStates = channelStates.size();
-			if (setup->numStates > numChannelStates) {
-				uint32_t numToAdd = setup->numStates - numChannelStates;
-				#if DEBUG
-				cout << "Convolver::swapInNewSetup(): new setup has " << setup->numStates << " channels";
-				cout << ", we currently have " << numChannelStates << " channels" << endl;
-				cout << "Convolver::swapInNewSetup(): FIXME: stupid appending " << numToAdd << " channel states" << endl;				
-				#endif
-				channelStates.reserve(setup->numStates);
-				for (uint32_t i=0; i < numToAdd; i++) {
-					shared_ptr<State> newState(new State(convolver, blockPattern));
-					channelStates.push_back(newState);
-				}
-			} else if (setup->numStates < numChannelStates) {
-				uint32_t numToDrop = numChannelStates - setup->numStates;
-				#if DEBUG
-				cout << "Convolver::swapInNewSetup(): new setup has " << setup->numStates << " channels";
-				cout << ", we currently have " << numChannelStates << " channels" << endl;
-				cout << "Convolver::swapInNewSetup(): FIXME: cold dropping " << numToDrop << " channel states" << endl;
-				#endif
-				vector<shared_ptr<State> >::iterator end = channelStates.end();
-				channelStates.erase(end - numToDrop, end);
+	template <class T> void Convolver::release(shared_ptr<T> &object) {
+		if (Releaser::get().release(object)) return;
+		
+		if (unreleased.size() < unreleased.capacity()) {
+			unreleased.push_back(object);
+			object.reset();
+			return;
+		}
+		cerr << "Convolver::release(): the Releaser's full and so are we, freeing on the audio thread" << endl;
+		object.reset();
+	}
+	
+	void Convolver::retryReleases() {
+		// Oldest first, so it's the order they'd have gone in
+		uint32_t numReleased = 0;
+		while (numReleased < unreleased.size() && Releaser::get().release(unreleased[numReleased])) numReleased++;
+		if (numReleased > 0) unreleased.erase(unreleased.begin(), unreleased.begin() + numReleased);
+	}
+	
+	void Convolver::crossfade(std::vector<const TimeSample *> & in,
+							  std::vector<TimeSample *> &		out,
+							  uint32_t							blockSize,
+							  float								dryGain,
+							  float								wetGain)
+	{
+		uint64_t start = WorkerPool::now();
+		
+		// The old setup mixes in the dry signal just the same, so a linear fade leaves it be
+		vector<TimeSample *> &fadeOut = setup->fadeOut;
+		fadeOut.resize(out.size());
+		for (uint32_t i=0; i < out.size(); i++) fadeOut[i] = &setup->fadeBlock[i * blockSize];
+		Convolver::convolve(convolver, fadingSetup->inputMixMap, fadingSetup->convolutionOps, fadingStates,
+							in, fadeOut, blockSize, dryGain, wetGain, useBackgroundThreads, wetBlock);
+		
+		float step = 1.0f / crossfadeLength;
+		for (uint32_t i=0; i < out.size(); i++) {
+			TimeSample *output = out[i];
+			const TimeSample *faded = fadeOut[i];
+			for (uint32_t j=0; j < blockSize; j++) {
+				float gain = std::min((crossfadePosition + j + 1) * step, 1.0f);
+				output[j] = output[j] * gain + faded[j] * (1.0f - gain);
 			}
-			
-			return true;
-		} else {
-			return false;
-		}		
+		}
+		
+		crossfadePosition += blockSize;
+		crossfadeMicroseconds = WorkerPool::now() - start;
+		if (crossfadePosition >= crossfadeLength) finishCrossfade();
+	}
+	
+	void Convolver::finishCrossfade() {
+		// Their destructors wait on whatever jobs they've still got out
+		foreach(shared_ptr<State> &state, fadingStates) {
+			release(state);
+		}
+		fadingStates.clear();
+		release(fadingSetup);
+		crossfadePosition = 0;
 	}
 	
 	void Convolver::convolve(std::vector<const TimeSample *> & in,
@@ -83,7 +151,8 @@ namespace Convolver {
 							 float								dryGain,
 							 float								wetGain)
 	{
-		bool newSetup = swapInNewSetup();
+		if (!unreleased.empty()) retryReleases();
+		bool newSetup = swapInNewSetup(out.size());
 		#if DEBUG
 		if (newSetup) {
 			cout << "Convolver::convolve(): swapped in new setup" << endl;
@@ -97,24 +166,93 @@ namespace Convolver {
 		list<ConvolutionOp> &convolutionOps = setup->convolutionOps;
 		
 		Convolver::convolve(convolver, inputMixMap, convolutionOps, channelStates,
-							in, out, blockSize, dryGain, wetGain, useBackgroundThreads);		
+							in, out, blockSize, dryGain, wetGain, useBackgroundThreads, wetBlock);
+		
+		if (fadingSetup != NULL) crossfade(in, out, blockSize, dryGain, wetGain);
 	}
 	
 	
+	bool Convolver::isRingingOut() {
+		// A setup we haven't swapped in yet may ring longer than this one. The fading one's
+		// only ever changed by whoever calls convolve(), same as us.
+		if (hasNewSetup || fadingSetup != NULL) return true;
+		if (setup == NULL) return false;
+		
+		// Input frame N is heard up to ringOutSamples - 1 after its last sample, so it can
+		// reach the frame ringOutFrames after it, and the next frame we'll pop is one on
+		uint32_t frameSize = blockPattern->minimumBlockSize();
+		FrameNum ringOutFrames = (setup->ringOutSamples + frameSize - 1) / frameSize;
+		foreach(shared_ptr<State> &state, channelStates) {
+			FrameNum nextFrame = state->getCurrentFrameNum() + 1;
+			FrameNum firstHeard = nextFrame > ringOutFrames ? nextFrame - ringOutFrames : 0;
+			if (!state->frameBuffer->silentSince(firstHeard)) return true;
+		}
+		return false;
+	}
+	
 	void Convolver::queueNewSetup(InputMixMap &inputMixMap,
 								  uint32_t numOutputs,
 								  std::list<ConvolutionOp> &convolutionOps)
 	{
-		shared_ptr<Setup> newSetupPtr(new Setup(inputMixMap, numOutputs, convolutionOps));
+		// We need a state for every input an op reads, as well as every output
+		uint32_t numStates = numOutputs;
+		foreach(ConvolutionOp &convolutionOp, convolutionOps) {
+			numStates = std::max(numStates, convolutionOp.get<0>() + 1);
+		}
+		
+		// Measured here rather than on the audio thread
+		uint32_t ringOutSamples = 0;
+		foreach(ConvolutionOp &convolutionOp, convolutionOps) {
+			ringOutSamples = std::max(ringOutSamples, convolutionOp.get<1>()->getRingOutSamples(ringOutThreshold));
+		}
+		
+		shared_ptr<BlockPattern> statesPattern;
+		shared_ptr<Setup> liveSetup;
+		State::AccumulatorNeeds liveNeeds;
+		pthread_mutex_lock(&this->newSetupMutex); {
+			statesPattern = blockPattern;
+			liveSetup = setup;
+			if (liveSetup != NULL) liveNeeds = liveSetup->accumulatorNeeds;
+		} pthread_mutex_unlock(&this->newSetupMutex);
+		
+		shared_ptr<Setup> newSetupPtr(new Setup(inputMixMap, numStates, convolutionOps, ringOutSamples, statesPattern->minimumBlockSize()));
+		foreach(ConvolutionOp &convolutionOp, convolutionOps) {
+			State::addAccumulatorNeeds(newSetupPtr->accumulatorNeeds, *statesPattern, *convolutionOp.get<1>());
+		}
+		newSetupPtr->channelStates.reserve(numStates);
+		for (uint32_t i=0; i < numStates; i++) {
+			newSetupPtr->channelStates.push_back(shared_ptr<State>(new State(convolver, statesPattern)));
+		}
 		
 		#if DEBUG
 		cout << "Convolver::queueNewSetup()" << endl;
 		newSetupPtr->print();
 		#endif
 		
-		pthread_mutex_lock(&this->newSetupMutex); {
-			this->newSetup = newSetupPtr;
-		} pthread_mutex_unlock(&this->newSetupMutex);		
+		// The audio thread never grows accumulators, so they're all made here, big enough
+		// for whatever the live setup leaves in the states that keep on into ours
+		for (;;) {
+			State::addAccumulatorNeeds(newSetupPtr->accumulatorNeeds, liveNeeds);
+			foreach(shared_ptr<State> &state, newSetupPtr->channelStates) {
+				state->reserveAccumulators(newSetupPtr->accumulatorNeeds);
+			}
+			
+			bool queued = false;
+			pthread_mutex_lock(&this->newSetupMutex); {
+				if (setup == liveSetup) {
+					// setBlockPattern() got in while we were making the states
+					if (blockPattern != statesPattern) setBlockPattern(*newSetupPtr);
+					this->newSetup = newSetupPtr;
+					hasNewSetup = true;
+					queued = true;
+				} else {
+					// Another setup went live meanwhile, we'll be keeping on from that one
+					liveSetup = setup;
+					if (liveSetup != NULL) liveNeeds = liveSetup->accumulatorNeeds;
+				}
+			} pthread_mutex_unlock(&this->newSetupMutex);
+			if (queued) break;
+		}
 	}
 	
 	void Convolver::setupMonoIn(Filters &filters, bool &changeOutChannels, uint32_t &numOutChannels, InputMixMap *mixMap) {
@@ -258,12 +396,60 @@ namespace Convolver {
 	}
 	
 	void Convolver::setBlockPattern(boost::shared_ptr<BlockPattern> &blockPattern) {
-		this->blockPattern = blockPattern;
+		// The old setup's states are about to stop matching anything
+		if (fadingSetup != NULL) finishCrossfade();
+		
+		wetBlock.resize(blockPattern->minimumBlockSize());
 		
 		getKernel().setBlockPattern(blockPattern);
+		if (useBackgroundThreads) WorkerPool::get().reserveTiers(getKernel().getPartitionSizes().size());
 		foreach(shared_ptr<State> &state, channelStates) {
 			state->setBlockPattern(blockPattern);
 		}
+		
+		// Including the states made for a setup we haven't swapped in yet
+		pthread_mutex_lock(&this->newSetupMutex); {
+			this->blockPattern = blockPattern;
+			if (setup != NULL) {
+				addAccumulatorNeeds(*setup);
+				foreach(shared_ptr<State> &state, channelStates) {
+					state->reserveAccumulators(setup->accumulatorNeeds);
+				}
+				setup->fadeBlock.resize(setup->numStates * blockPattern->minimumBlockSize());
+			}
+			if (newSetup != NULL) setBlockPattern(*newSetup);
+		} pthread_mutex_unlock(&this->newSetupMutex);
+	}
+	
+	void Convolver::setBlockPattern(Setup &setup) {
+		foreach(shared_ptr<State> &state, setup.channelStates) {
+			state->setBlockPattern(blockPattern);
+		}
+		addAccumulatorNeeds(setup);
+		// It'll keep on from whichever setup is live now
+		if (this->setup != NULL) State::addAccumulatorNeeds(setup.accumulatorNeeds, this->setup->accumulatorNeeds);
+		foreach(shared_ptr<State> &state, setup.channelStates) {
+			state->reserveAccumulators(setup.accumulatorNeeds);
+		}
+		setup.fadeBlock.resize(setup.numStates * blockPattern->minimumBlockSize());
+	}
+	
+	void Convolver::addAccumulatorNeeds(Setup &setup) {
+		// What was owed in the old frame size went when the states changed over to the new one
+		uint32_t frameSize = blockPattern->minimumBlockSize();
+		if (setup.fadeBlock.size() != setup.numStates * frameSize) setup.accumulatorNeeds.clear();
+		
+		foreach(ConvolutionOp &convolutionOp, setup.convolutionOps) {
+			State::addAccumulatorNeeds(setup.accumulatorNeeds, *blockPattern, *convolutionOp.get<1>());
+		}
+	}
+
+	void Convolver::setScheduler(Kernel::Scheduler scheduler) {
+		if (fadingSetup != NULL) finishCrossfade();
+		getKernel().setScheduler(scheduler);
+		foreach(shared_ptr<State> &state, channelStates) {
+			state->reset();
+		}
 	}
 
 	void Convolver::convolve(Kernel &							convolver,
@@ -275,22 +461,25 @@ namespace Convolver {
 							 uint32_t							blockSize,
 							 float								dryGain,
 							 float								wetGain,
-							 bool								useBackgroundThreads)
+							 bool								useBackgroundThreads,
+							 TimeBlock &						wetBlock)
 	{
 		#if DEBUG_CONVOLVE
 		cout << endl << "Convolver::convolve() {" << endl;
 		#endif
 		
-		// Push the new input blocks to each channel state
-		assert(channelStates.size() == in.size());
+		// Push the new input blocks to each channel state. States past the last input
+		// only collect output, but they hear silence so their frames stay in step.
 		uint32_t numChannels = channelStates.size();
+		assert(numChannels >= out.size());
 		for(uint32_t i=0; i < numChannels; i++) {
-			const TimeSample *data = in[i];
 			State &channel = *channelStates[i];
-			shared_ptr<TimeBlock> timeBlock(new TimeBlock(data, data+blockSize));
-			channel.push(timeBlock);
+			channel.push(i < in.size() ? in[i] : NULL, blockSize);
 		}		
 		
+		// Nothing here waits on the workers: they only add into the accumulators they're
+		// handed, and count themselves out atomically
+		
 		#if DEBUG_CONVOLVE
 		cout << "\tconvolving:" << endl;
 		#endif		
@@ -307,46 +496,45 @@ namespace Convolver {
 			assert(inputNum < channelStates.size());
 			assert(stateNum < channelStates.size());
 			
-			State &state = *channelStates[stateNum];
-			//boost::shared_ptr<TimeBlock> signal = inputs[inputNum];
+			State &input = *channelStates[inputNum];
+			State &output = *channelStates[stateNum];
 			Filter &filter = *filterPtr;
 			
-			convolver.schedule_convolution(filter, state);
+			convolver.schedule_convolution(filter, input, output);
 		}
 		
+		// Every input has to be processed before any output is complete
+		foreach(shared_ptr<State> &state, channelStates) {
+			convolver.process_convolutions(*state, useBackgroundThreads);
+		}
 		
-		
-		Outputs outputs(out.size());
-		setupOutputs(outputs, out);
-		assert(outputs.size() == channelStates.size());
-		uint32_t size = outputs.size();
+		assert(sizeof(AudioSampleType) == sizeof(float));
+		assert(wetBlock.size() == blockSize);
+		uint32_t size = out.size();
+		bool fullyWet = dryGain == 0.0f && wetGain > 0.999 && wetGain < 1.001;
 		
 		#if DEBUG_CONVOLVE
 		cout << "\toutputing:" << endl;
 		#endif
-		for(uint32_t i=0; i < size; i++) {
-			TimeSample *output = outputs[i].get<0>();
-			bool &outputInitialized = outputs[i].get<1>();
+		for(uint32_t i=0; i < numChannels; i++) {
+			State &state = *channelStates[i];
+			TimeSample *output = i < size ? out[i] : NULL;
+			
+			// Straight to the host's buffer if there's nothing to mix in
+			state.pop(output && fullyWet ? output : wetBlock.cArray(), blockSize);
 			
-			// FIXME: we don't currently use the "outputInitialized" bool, should we?
-			assert(outputInitialized == false);
+			// Nobody's listening to this one
+			if (output == NULL || fullyWet) continue;
 
 			#if DEBUG_CONVOLVE
 			cout << "\t\tcopying to channel: " << i << " pointer(" << (uint32_t)output << ")" << endl;
 			#endif			
 			
-			State &state = *channelStates[i];
-			convolver.process_convolutions(state, useBackgroundThreads);
-			shared_ptr<TimeBlock> blockPtr = state.pop(blockSize);
-			TimeBlock &block = *blockPtr;
+			TimeBlock &block = wetBlock;
 
 			if (dryGain == 0.0f) {
-				if (wetGain > 0.999 && wetGain < 1.001) {
-					std::copy(block.begin(), block.end(), output);
-				} else {
-					for (uint32_t j=0; j < blockSize; j++){
-						output[j] = block[j] * wetGain;
-					}					
+				for (uint32_t j=0; j < blockSize; j++){
+					output[j] = block[j] * wetGain;
 				}
 			} else if (in.size() == out.size()) {
 				const TimeSample *dry = in[i];
@@ -364,7 +552,7 @@ namespace Convolver {
 				#if DEBUG
 				cerr << "Convolver::convolve(): error applying dry gain where numOut != numIn, and numIn != 1" << endl;
 				#endif
-				for (uint32_t j=0; i < blockSize; i++){
+				for (uint32_t j=0; j < blockSize; j++){
 					output[j] = block[j] * wetGain;
 				}					
 			}
@@ -34,7 +34,6 @@ namespace Convolver {
 typedef std::vector<std::list<std::pair<uint32_t, float> > > InputMixMap;
 typedef boost::tuple<uint32_t, boost::shared_ptr<Convolver::Filter>, uint32_t> ConvolutionOp;
 typedef std::vector<boost::shared_ptr<Convolver::Signal> > Inputs;
-typedef std::vector<boost::tuple<Convolver::TimeSample *, bool> > Outputs;
 typedef std::vector<boost::shared_ptr<Convolver::Filter> > Filters;
 #endif
 
@@ -48,12 +47,37 @@ namespace Convolver {
 		typedef std::vector<std::list<std::pair<uint32_t, float> > > InputMixMap;
 		typedef boost::tuple<uint32_t, boost::shared_ptr<Filter>, uint32_t> ConvolutionOp;
 		typedef std::vector<boost::shared_ptr<TimeBlock> > Inputs;
-		typedef std::vector<boost::tuple<TimeSample *, bool> > Outputs;
 		typedef std::vector<boost::shared_ptr<Filter> > Filters;
 		
 		Kernel &getKernel() { return convolver; }
 		boost::shared_ptr<BlockPattern> getBlockPattern() { return blockPattern; }
 		void setBlockPattern(boost::shared_ptr<BlockPattern> &blockPattern);
+		// Not thread-safe, and drops whatever's ringing out in the channel states
+		void setScheduler(Kernel::Scheduler scheduler);
+		// See Kernel, only matter with useBackgroundThreads
+		void setSampleRate(float sampleRate) { convolver.setSampleRate(sampleRate); }
+		void setSkipLateWork(bool skipLateWork) { convolver.setSkipLateWork(skipLateWork); }
+		void setLatePolicy(Kernel::LatePolicy latePolicy) { convolver.setLatePolicy(latePolicy); }
+		// Only matters without useBackgroundThreads
+		void setSpreadLargePartitions(bool spreadLargePartitions) { convolver.setSpreadLargePartitions(spreadLargePartitions); }
+		
+		// Silent input costs next to nothing, but convolve() still has to be called until the
+		// tail's rung out. isRingingOut() says whether the output could still be louder than
+		// thresholdDecibels (relative to each filter's energy) next callback, if the input stays
+		// silent; once it's false a host can stop calling us until the input comes back.
+		// The threshold takes effect from the next setup.
+		void setRingOutThreshold(float thresholdDecibels) { ringOutThreshold = thresholdDecibels; }
+		bool isRingingOut();
+		
+		// How long a new setup takes to fade in over the old one, in samples. With 0 (the
+		// default) it takes over at once and picks up the old IR's tails where they were.
+		// Otherwise the new setup starts from silence while the old one keeps running in its
+		// own states until it's faded out, so a callback costs up to twice as much for that
+		// long, and never more: a setup arriving mid-fade cuts the oldest one off.
+		// getCrossfadeMicroseconds() is what running the old one cost last callback.
+		void setCrossfadeLength(uint32_t numSamples) { crossfadeLength = numSamples; }
+		bool isCrossfading() { return fadingSetup != NULL; }
+		uint64_t getCrossfadeMicroseconds() { return crossfadeMicroseconds; }
 		
 		// Thread-safe
 		virtual void setupMonoIn(Filters &filters, bool &changeOutChannels, uint32_t &numOutChannels, InputMixMap *mixMap = NULL);
@@ -70,11 +94,22 @@ namespace Convolver {
 	protected:
 		class Setup {
 		public:
-			Setup(InputMixMap &inputMixMap, uint32_t numStates, std::list<ConvolutionOp> &convolutionOps)
-				: inputMixMap(inputMixMap), numStates(numStates), convolutionOps(convolutionOps) {};
+			Setup(InputMixMap &inputMixMap, uint32_t numStates, std::list<ConvolutionOp> &convolutionOps, uint32_t ringOutSamples, uint32_t frameSize)
+				: inputMixMap(inputMixMap), numStates(numStates), convolutionOps(convolutionOps), ringOutSamples(ringOutSamples), fadeBlock(numStates * frameSize) { fadeOut.reserve(numStates); };
 			InputMixMap inputMixMap;
 			uint32_t numStates;
 			std::list<ConvolutionOp> convolutionOps;
+			// The longest any op's filter rings on after its input goes quiet
+			uint32_t ringOutSamples;
+			// Made when the setup's queued so the audio thread doesn't have to. Whatever
+			// states it doesn't take stay here till the setup's released.
+			std::vector<boost::shared_ptr<State> > channelStates;
+			// What they've been reserved for: our ops', and whatever the setup that was live
+			// when we were queued left in the states we may keep on from it
+			State::AccumulatorNeeds accumulatorNeeds;
+			// Where the setup before this one goes while it fades out, a frame per state
+			TimeBlock fadeBlock;
+			std::vector<TimeSample *> fadeOut;
 			
 			void print();
 			static std::string toString(ConvolutionOp &convolutionOp, InputMixMap *inputMixMap=NULL);
@@ -84,7 +119,17 @@ namespace Convolver {
 		
 
 			
-		bool swapInNewSetup();
+		bool swapInNewSetup(uint32_t numOutputs);
+		void crossfade(std::vector<const TimeSample *> & in,
+					   std::vector<TimeSample *> &		out,
+					   uint32_t							blockSize,
+					   float							dryGain,
+					   float							wetGain);
+		void finishCrossfade();
+		// Hands object to the Releaser, or when it's got no room keeps it in unreleased
+		// to try again next callback. Either way object's left empty.
+		template <class T> void release(boost::shared_ptr<T> &object);
+		void retryReleases();
 		
 		static void convolve(Kernel &							convolver,
 							 InputMixMap &						inputMixMap,
@@ -95,22 +140,41 @@ namespace Convolver {
 							 uint32_t							blockSize,
 							 float								dryGain,
 							 float								wetGain,
-							 bool								useBackgroundThreads);
-				
-		static void setupOutputs(Outputs &outputs, std::vector<TimeSample *> & out);
+							 bool								useBackgroundThreads,
+							 TimeBlock &						wetBlock);
 		
 	private:
 		static std::list<std::pair<uint32_t, float> > stereoMixer(uint32_t channelNum1, uint32_t channelNum2, float stereoSeparation);		
+		// With newSetupMutex held
+		void setBlockPattern(Setup &setup);
+		void addAccumulatorNeeds(Setup &setup);
 		
 		boost::shared_ptr<BlockPattern> blockPattern;
 		Kernel convolver;
 		std::vector<boost::shared_ptr<State> > channelStates;
+		// Where each state pops its frame when it can't go straight to the output
+		TimeBlock wetBlock;
 
 		boost::shared_ptr<Setup> setup;
 		boost::shared_ptr<Setup> newSetup;
 		pthread_mutex_t newSetupMutex;
+		// Set under newSetupMutex, so the audio thread can see there's a setup waiting
+		// without taking it
+		volatile bool hasNewSetup;
 		
 		bool useBackgroundThreads;
+		float ringOutThreshold;
+		
+		// The setup we're fading out, and the states it's still running in
+		boost::shared_ptr<Setup> fadingSetup;
+		std::vector<boost::shared_ptr<State> > fadingStates;
+		uint32_t crossfadeLength;
+		uint32_t crossfadePosition;
+		uint64_t crossfadeMicroseconds;
+		
+		// Reserved up front, so holding on to something never allocates
+		static const uint32_t kMaxUnreleased = 64;
+		std::vector<boost::shared_ptr<void> > unreleased;
 	};
 }
 
@@ -0,0 +1,61 @@
+/*
+ *  ConvolverAlignedAllocator.h
+ *  Convolvotron
+ *
+ *  Created by Seth Nickell on 10/17/09.
+ *  Copyright 2009 Meatscience. All rights reserved.
+ *
+ */
+
+#ifndef _ConvolverAlignedAllocator_h__
+#define _ConvolverAlignedAllocator_h__
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <new>
+
+namespace Convolver {
+	// Cache line alignment, also enough for the widest vector loads we do (AVX-512)
+	static const size_t kVectorAlignment = 64;
+
+	// std::allocator that hands out memory aligned to Alignment bytes, so the
+	// vector units never straddle a cache line at the start of a block
+	template <class T, size_t Alignment = kVectorAlignment>
+	class AlignedAllocator {
+	public:
+		typedef T value_type;
+		typedef T *pointer;
+		typedef const T *const_pointer;
+		typedef T &reference;
+		typedef const T &const_reference;
+		typedef size_t size_type;
+		typedef ptrdiff_t difference_type;
+
+		template <class U> struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+
+		AlignedAllocator() {}
+		AlignedAllocator(const AlignedAllocator &) {}
+		template <class U> AlignedAllocator(const AlignedAllocator<U, Alignment> &) {}
+
+		pointer address(reference x) const { return &x; }
+		const_pointer address(const_reference x) const { return &x; }
+		size_type max_size() const { return size_t(-1) / sizeof(T); }
+
+		pointer allocate(size_type n, const void * = 0) {
+			void *memory = NULL;
+			if (posix_memalign(&memory, Alignment, n * sizeof(T) > 0 ? n * sizeof(T) : Alignment) != 0) {
+				throw std::bad_alloc();
+			}
+			return (pointer)memory;
+		}
+		void deallocate(pointer p, size_type) { free(p); }
+
+		void construct(pointer p, const T &value) { new((void *)p) T(value); }
+		void destroy(pointer p) { p->~T(); }
+
+		bool operator==(const AlignedAllocator &) const { return true; }
+		bool operator!=(const AlignedAllocator &) const { return false; }
+	};
+};
+
+#endif
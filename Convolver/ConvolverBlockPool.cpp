@@ -0,0 +1,120 @@
+/*
+ *  ConvolverBlockPool.cpp
+ *  Convolvotron
+ *
+ *  Created by Seth Nickell on 10/18/09.
+ *  Copyright 2009 Meatscience. All rights reserved.
+ *
+ */
+
+#include "ConvolverBlockPool.h"
+#include "ConvolverAlignedAllocator.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <new>
+
+namespace Convolver {
+	static const int kMinSizeClass = 6;	// 64 bytes
+	static const int kMaxSizeClass = 24;	// 16MB
+	static const int kNumSizeClasses = kMaxSizeClass - kMinSizeClass + 1;
+
+	// The top of each stack is a pointer with a counter packed above it, bumped on every
+	// push and pop so a compare-and-swap can't be fooled by a chunk that was popped and
+	// pushed back while we weren't looking (ABA). User space pointers fit in 48 bits on
+	// every 64-bit machine we run on, so the counter gets the top 16.
+	typedef uint64_t TaggedPointer;
+	static const int kTagShift = sizeof(void *) == 8 ? 48 : 32;
+	static const uint64_t kPointerMask = (1ULL << kTagShift) - 1;
+
+	static inline void *pointerOf(TaggedPointer tagged) {
+		return (void *)(uintptr_t)(tagged & kPointerMask);
+	}
+
+	static inline TaggedPointer tag(void *pointer, TaggedPointer previous) {
+		uint64_t counter = (previous >> kTagShift) + 1;
+		return (counter << kTagShift) | ((uint64_t)(uintptr_t)pointer & kPointerMask);
+	}
+
+	// On their own cache lines so the audio and worker threads don't fight over
+	// neighbouring size classes
+	typedef struct FreeList {
+		volatile TaggedPointer top;
+		char padding[kVectorAlignment - sizeof(TaggedPointer)];
+	} FreeList;
+
+	static FreeList freeLists[kNumSizeClasses] __attribute__((aligned(64)));
+	static volatile uint64_t numSystemAllocations = 0;
+
+	// A free chunk's first bytes point at the next free chunk
+	static void push(FreeList &list, void *chunk) {
+		TaggedPointer oldTop, newTop;
+		do {
+			oldTop = list.top;
+			*(void **)chunk = pointerOf(oldTop);
+			newTop = tag(chunk, oldTop);
+		} while (!__sync_bool_compare_and_swap(&list.top, oldTop, newTop));
+	}
+
+	static void *pop(FreeList &list) {
+		TaggedPointer oldTop, newTop;
+		void *chunk;
+		do {
+			oldTop = list.top;
+			chunk = pointerOf(oldTop);
+			if (chunk == NULL) return NULL;
+			// Someone may have popped this chunk and scribbled on it since we read top,
+			// but then the tag will have moved on and the swap below fails
+			newTop = tag(*(void **)chunk, oldTop);
+		} while (!__sync_bool_compare_and_swap(&list.top, oldTop, newTop));
+		return chunk;
+	}
+
+	static void *systemAllocate(size_t numBytes) {
+		void *memory = NULL;
+		if (posix_memalign(&memory, kVectorAlignment, numBytes) != 0) {
+			throw std::bad_alloc();
+		}
+		__sync_fetch_and_add(&numSystemAllocations, 1);
+		return memory;
+	}
+
+	int BlockPool::sizeClassFor(size_t numBytes) {
+		int sizeClass = kMinSizeClass;
+		while (((size_t)1 << sizeClass) < numBytes) sizeClass++;
+		return sizeClass;
+	}
+
+	void *BlockPool::allocate(size_t numBytes) {
+		if (numBytes > kMaxPooledBytes) return systemAllocate(numBytes);
+
+		int sizeClass = sizeClassFor(numBytes);
+		void *chunk = pop(freeLists[sizeClass - kMinSizeClass]);
+		if (chunk == NULL) chunk = systemAllocate((size_t)1 << sizeClass);
+		return chunk;
+	}
+
+	void BlockPool::deallocate(void *memory, size_t numBytes) {
+		if (memory == NULL) return;
+		if (numBytes > kMaxPooledBytes) {
+			free(memory);
+			return;
+		}
+
+		int sizeClass = sizeClassFor(numBytes);
+		push(freeLists[sizeClass - kMinSizeClass], memory);
+	}
+
+	void BlockPool::reserve(size_t numBytes, uint32_t count) {
+		if (numBytes > kMaxPooledBytes) return;
+
+		int sizeClass = sizeClassFor(numBytes);
+		for (uint32_t i=0; i < count; i++) {
+			push(freeLists[sizeClass - kMinSizeClass], systemAllocate((size_t)1 << sizeClass));
+		}
+	}
+
+	uint64_t BlockPool::getNumSystemAllocations() {
+		return numSystemAllocations;
+	}
+}
@@ -0,0 +1,79 @@
+/*
+ *  ConvolverBlockPool.h
+ *  Convolvotron
+ *
+ *  Created by Seth Nickell on 10/18/09.
+ *  Copyright 2009 Meatscience. All rights reserved.
+ *
+ */
+
+#ifndef _ConvolverBlockPool_h__
+#define _ConvolverBlockPool_h__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <new>
+
+namespace Convolver {
+	// Where TimeBlocks, FreqBlocks and their samples come from. Sizes are rounded up to a
+	// power of two (at least a cache line), and each size class keeps a lock-free stack of
+	// chunks that were given back, so a block freed on a worker thread can be reused by the
+	// audio thread without either of them taking a lock or calling malloc.
+	//
+	// Chunks are never returned to the system: the pools grow to the peak working set and
+	// stay there. Anything bigger than kMaxPooledBytes goes straight to the system.
+	class BlockPool {
+	public:
+		static const size_t kMinPooledBytes = 64;
+		static const size_t kMaxPooledBytes = 16 * 1024 * 1024;
+
+		// Always kVectorAlignment aligned
+		static void *allocate(size_t numBytes);
+		// numBytes must be what it was allocated with
+		static void deallocate(void *memory, size_t numBytes);
+
+		// Put count chunks big enough for numBytes in the pool ahead of time, e.g. at setup,
+		// so the first few frames don't have to go to the system either
+		static void reserve(size_t numBytes, uint32_t count);
+
+		// How many times we had to go to the system, handy for spotting a pool that isn't warm
+		static uint64_t getNumSystemAllocations();
+
+	private:
+		static int sizeClassFor(size_t numBytes);
+	};
+
+	// std::allocator that draws from the BlockPool, for the sample storage inside blocks
+	template <class T>
+	class PoolAllocator {
+	public:
+		typedef T value_type;
+		typedef T *pointer;
+		typedef const T *const_pointer;
+		typedef T &reference;
+		typedef const T &const_reference;
+		typedef size_t size_type;
+		typedef ptrdiff_t difference_type;
+
+		template <class U> struct rebind { typedef PoolAllocator<U> other; };
+
+		PoolAllocator() {}
+		PoolAllocator(const PoolAllocator &) {}
+		template <class U> PoolAllocator(const PoolAllocator<U> &) {}
+
+		pointer address(reference x) const { return &x; }
+		const_pointer address(const_reference x) const { return &x; }
+		size_type max_size() const { return size_t(-1) / sizeof(T); }
+
+		pointer allocate(size_type n, const void * = 0) { return (pointer)BlockPool::allocate(n * sizeof(T)); }
+		void deallocate(pointer p, size_type n) { BlockPool::deallocate(p, n * sizeof(T)); }
+
+		void construct(pointer p, const T &value) { new((void *)p) T(value); }
+		void destroy(pointer p) { p->~T(); }
+
+		bool operator==(const PoolAllocator &) const { return true; }
+		bool operator!=(const PoolAllocator &) const { return false; }
+	};
+};
+
+#endif
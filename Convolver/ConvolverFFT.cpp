@@ -10,6 +10,8 @@
 #include "ConvolverFFT.h"
 #include "ConvolverInternal.h"
 #include <math.h>
+#include <stdlib.h>
+#include <pthread.h>
 
 using std::vector;
 using std::cout;
@@ -28,7 +30,7 @@ static void printComplex(Convolver::FreqSample *buffer, int size, float scale) {
 
 
 Convolver::FFT::FFT(uint32_t size) 
-: timeDomainSize(size), freqDomainSize(getFreqDomainSize(size)), scalar(1.0f / sqrt(timeDomainSize))
+: timeDomainSize(size), freqDomainSize(getFreqDomainSize(size)), scalar(1.0f / sqrt(timeDomainSize)), padded(size)
 {
 	bool isPowerOfTwo = (size & (size - 1)) == 0;
 	if (!isPowerOfTwo) {
@@ -55,8 +57,9 @@ namespace Convolver {
 		assert(sizeof(TimeSample) == sizeof(float));
 		
 		DSPSplitComplex *input = new DSPSplitComplex;
-		input->realp = new float[numComplexSamples];
-		input->imagp = new float[numComplexSamples];
+		// Freed by ~FreqBlock, which gives them back to the pool
+		input->realp = (float *)BlockPool::allocate(numComplexSamples * sizeof(float));
+		input->imagp = (float *)BlockPool::allocate(numComplexSamples * sizeof(float));
 		
 		// FIXME: is this cast to const DSPComplex * valid ??? Is that really how it expects input data?
 		/* Split the complex (interleaved) data into two arrays */
@@ -129,6 +132,27 @@ shared_ptr<Convolver::TimeBlock> Convolver::FFT::fftri(FreqBlock &inBlock) {
 	return outBlock;
 }
 
+void Convolver::FFT::fftr(TimeBlock &inBlock, FreqBlock &outBlock) {
+	assert(inBlock.size() == timeDomainSize);
+	assert(outBlock.size() == freqDomainSize);
+	
+	DSPSplitComplex *splitComplex = outBlock.dspSplitComplex();
+	vDSP_ctoz((const DSPComplex *)inBlock.cArray(), 2, splitComplex, 1, timeDomainSize / 2);
+	vDSP_fft_zrip(fftSetup, splitComplex, 1, sizeLog2n, FFT_FORWARD);
+}
+
+void Convolver::FFT::fftrPadded(const TimeSample *samples, FreqBlock &outBlock) {
+	std::copy(samples, samples + timeDomainSize / 2, padded.begin());
+	fftr(padded, outBlock);
+}
+
+void Convolver::FFT::fftri(FreqBlock &inBlock, TimeBlock &outBlock) {
+	assert(inBlock.size() == freqDomainSize);
+	assert(outBlock.size() == timeDomainSize);
+	
+	doFFTI(this->fftSetup, outBlock, inBlock, sizeLog2n);
+}
+
 uint32_t Convolver::FFT::getFreqDomainSize(uint32_t timeDomainSize) {
 	return timeDomainSize / 2 + 1;
 }
@@ -141,17 +165,99 @@ uint32_t Convolver::FFT::getTimeDomainSize(uint32_t freqDomainSize) {
 
 #else
 
+namespace Convolver {
+	static pthread_mutex_t backendSelectionMutex = PTHREAD_MUTEX_INITIALIZER;
+	static bool haveDefaultBackend = false;
+	static bool defaultBackendForced = false;
+	static FFTBackend::Type defaultBackend = FFTBackend::KISS;
+	static map<uint32_t, FFTBackend::Type> backendForSize;
+	
+	// Caller holds backendSelectionMutex
+	static void readBackendFromEnvironment() {
+		if (haveDefaultBackend) return;
+		haveDefaultBackend = true;
+		
+		const char *name = getenv("CONVOLVER_FFT_BACKEND");
+		if (name == NULL || *name == '\0') return;
+		
+		FFTBackend::Type type;
+		if (FFTBackend::parse(name, type)) {
+			defaultBackend = type;
+			defaultBackendForced = true;
+		} else {
+			cerr << "CONVOLVER_FFT_BACKEND=" << name << " isn't a backend we know, try kiss, simd or fftw" << endl;
+		}
+	}
+}
+
+void Convolver::FFT::setDefaultBackend(FFTBackend::Type backendType) {
+	pthread_mutex_lock(&backendSelectionMutex);
+	haveDefaultBackend = true;
+	defaultBackendForced = true;
+	defaultBackend = backendType;
+	backendForSize.clear();
+	pthread_mutex_unlock(&backendSelectionMutex);
+}
+
+Convolver::FFTBackend::Type Convolver::FFT::getDefaultBackend() {
+	pthread_mutex_lock(&backendSelectionMutex);
+	readBackendFromEnvironment();
+	FFTBackend::Type type = defaultBackend;
+	pthread_mutex_unlock(&backendSelectionMutex);
+	return type;
+}
+
+bool Convolver::FFT::isDefaultBackendForced() {
+	pthread_mutex_lock(&backendSelectionMutex);
+	readBackendFromEnvironment();
+	bool forced = defaultBackendForced;
+	pthread_mutex_unlock(&backendSelectionMutex);
+	return forced;
+}
+
+void Convolver::FFT::setBackendForSize(uint32_t timeDomainSize, FFTBackend::Type backendType) {
+	pthread_mutex_lock(&backendSelectionMutex);
+	backendForSize[timeDomainSize] = backendType;
+	pthread_mutex_unlock(&backendSelectionMutex);
+}
+
+Convolver::FFTBackend::Type Convolver::FFT::getBackendForSize(uint32_t timeDomainSize) {
+	pthread_mutex_lock(&backendSelectionMutex);
+	readBackendFromEnvironment();
+	map<uint32_t, FFTBackend::Type>::iterator found = backendForSize.find(timeDomainSize);
+	FFTBackend::Type type = found == backendForSize.end() ? defaultBackend : found->second;
+	pthread_mutex_unlock(&backendSelectionMutex);
+	return type;
+}
+
 Convolver::FFT::FFT(uint32_t size) 
-	: timeDomainSize(size), freqDomainSize(getFreqDomainSize(size)), scalar(1.0f / sqrt(timeDomainSize))
+	: timeDomainSize(size), freqDomainSize(getFreqDomainSize(size)), scalar(1.0f / sqrt(timeDomainSize)), padded(size)
 {
-	this->fftrCfg = kiss_fftr_alloc(size, 0, NULL, NULL);
-	this->fftriCfg = kiss_fftr_alloc(size, 1, NULL, NULL);
+	init(getBackendForSize(size));
+}
+
+Convolver::FFT::FFT(uint32_t size, FFTBackend::Type backendType) 
+	: timeDomainSize(size), freqDomainSize(getFreqDomainSize(size)), scalar(1.0f / sqrt(timeDomainSize)), padded(size)
+{
+	init(backendType);
+}
+
+void Convolver::FFT::init(FFTBackend::Type backendType) {
+	this->backend = FFTBackend::get(backendType, timeDomainSize);
+	this->backendType = backendType;
+	
+	if (!this->backend) {
+		cerr << "FFT backend " << FFTBackend::name(backendType) << " can't do size " << timeDomainSize << ", using kiss" << endl;
+		this->backend = FFTBackend::get(FFTBackend::KISS, timeDomainSize);
+		this->backendType = FFTBackend::KISS;
+	}
+	assert(this->backend);
+	
+	this->scratch.resize(this->backend->getScratchSize());
 }
 
 Convolver::FFT::~FFT()
 {
-	kiss_fftr_free(this->fftrCfg);
-	kiss_fftr_free(this->fftriCfg);
 }
 
 shared_ptr<Convolver::FreqBlock> Convolver::FFT::fftr(const TimeSample *samples, uint32_t numSamples) {
@@ -161,7 +267,7 @@ shared_ptr<Convolver::FreqBlock> Convolver::FFT::fftr(const TimeSample *samples,
 #endif
 	shared_ptr<FreqBlock> outBlock(new FreqBlock(freqDomainSize));
 	
-	kiss_fftr(fftrCfg, samples, outBlock->cArrayUnpacked());
+	backend->forward(samples, outBlock->cArrayUnpacked(), scratchArray());
 	
 	// FIXME: debug scaling
 	outBlock->scale(scalar*scalar);	
@@ -170,13 +276,9 @@ shared_ptr<Convolver::FreqBlock> Convolver::FFT::fftr(const TimeSample *samples,
 }
 
 shared_ptr<Convolver::FreqBlock> Convolver::FFT::fftr(TimeBlock &inBlock) {
-	assert(inBlock.size() == timeDomainSize);
-#if DEBUG_CONVOLVE
-	cout << "\t\t\tDoing FFT...size " << timeDomainSize << endl;	
-#endif
 	shared_ptr<FreqBlock> outBlock(new FreqBlock(freqDomainSize));
 
-	kiss_fftr(fftrCfg, inBlock.cArray(), outBlock->cArrayUnpacked());
+	fftr(inBlock, *outBlock);
 
 	// FIXME: debug scaling
 	//outBlock->scale(scalar);		
@@ -185,13 +287,9 @@ shared_ptr<Convolver::FreqBlock> Convolver::FFT::fftr(TimeBlock &inBlock) {
 }
 
 shared_ptr<Convolver::TimeBlock> Convolver::FFT::fftri(FreqBlock &inBlock) {
-	assert(inBlock.size() == freqDomainSize);
-#if DEBUG_CONVOLVE
-	cout << "\t\t\tDoing FFTI...size " << timeDomainSize << endl;	
-#endif	
 	shared_ptr<TimeBlock> outBlock(new TimeBlock(timeDomainSize));
 	
-	kiss_fftri(fftriCfg, inBlock.cArrayUnpacked(), outBlock->cArray());
+	fftri(inBlock, *outBlock);
 	
 	// FIXME: debug scaling
 	//outBlock->scale(scalar);		
@@ -199,6 +297,31 @@ shared_ptr<Convolver::TimeBlock> Convolver::FFT::fftri(FreqBlock &inBlock) {
 	return outBlock;
 }
 
+void Convolver::FFT::fftr(TimeBlock &inBlock, FreqBlock &outBlock) {
+	assert(inBlock.size() == timeDomainSize);
+	assert(outBlock.size() == freqDomainSize);
+#if DEBUG_CONVOLVE
+	cout << "\t\t\tDoing FFT...size " << timeDomainSize << endl;	
+#endif
+	
+	backend->forward(inBlock.cArray(), outBlock.cArrayUnpacked(), scratchArray());
+}
+
+void Convolver::FFT::fftrPadded(const TimeSample *samples, FreqBlock &outBlock) {
+	std::copy(samples, samples + timeDomainSize / 2, padded.begin());
+	fftr(padded, outBlock);
+}
+
+void Convolver::FFT::fftri(FreqBlock &inBlock, TimeBlock &outBlock) {
+	assert(inBlock.size() == freqDomainSize);
+	assert(outBlock.size() == timeDomainSize);
+#if DEBUG_CONVOLVE
+	cout << "\t\t\tDoing FFTI...size " << timeDomainSize << endl;	
+#endif	
+	
+	backend->inverse(inBlock.cArrayUnpacked(), outBlock.cArray(), scratchArray());
+}
+
 uint32_t Convolver::FFT::getFreqDomainSize(uint32_t timeDomainSize) {
 	return timeDomainSize / 2 + 1;
 }
@@ -208,3 +331,96 @@ uint32_t Convolver::FFT::getTimeDomainSize(uint32_t freqDomainSize) {
 }
 
 #endif
+
+Convolver::SplitFFT::SplitFFT(uint32_t timeDomainSize, uint32_t numPhases)
+	: timeDomainSize(timeDomainSize), numPhases(numPhases), numPasses(0), phases(timeDomainSize / 2)
+{
+#if USE_APPLE_ACCELERATE
+	// vDSP packs its spectra its own way, so no butterflies for us, just the one transform
+	this->numPhases = numPhases = 1;
+#endif
+	assert((numPhases & (numPhases - 1)) == 0);
+	assert(timeDomainSize / numPhases >= 4);
+	while ((1u << numPasses) < numPhases) numPasses++;
+	
+	if (numPhases == 1) return;
+	
+	uint32_t phaseSize = getPhaseSize();
+	uint32_t halfSpectrumSize = FFT::getFreqDomainSize(phaseSize);
+	phaseSpectra.push_back(shared_ptr<FreqBlock>(new FreqBlock(halfSpectrumSize)));
+	passes[0].resize(numPhases * halfSpectrumSize);
+	passes[1].resize(numPhases * halfSpectrumSize);
+	
+	twiddles.resize(timeDomainSize / 2 + 1);
+	for (uint32_t k=0; k < twiddles.size(); k++) {
+		double angle = -2.0 * M_PI * k / timeDomainSize;
+		twiddles[k].r = cos(angle);
+		twiddles[k].i = sin(angle);
+	}
+}
+
+void Convolver::SplitFFT::start(const TimeSample *samples) {
+	// Padded with zeros, phase p's run only has samples for its first half
+	uint32_t numSamplesPerPhase = getPhaseSize() / 2;
+	for (uint32_t p=0; p < numPhases; p++) {
+		TimeSample *phase = &phases[p * numSamplesPerPhase];
+		for (uint32_t n=0; n < numSamplesPerPhase; n++) {
+			phase[n] = samples[n * numPhases + p];
+		}
+	}
+}
+
+void Convolver::SplitFFT::step(uint32_t stepNum, FFT &phaseFFT, FreqBlock &outBlock) {
+	assert(stepNum < getNumSteps());
+	assert(phaseFFT.timeDomainSize == getPhaseSize());
+	
+	if (numPhases == 1) {
+		phaseFFT.fftrPadded(phases.cArray(), outBlock);
+		return;
+	}
+	
+#if !USE_APPLE_ACCELERATE
+	uint32_t phaseSize = getPhaseSize();
+	
+	if (stepNum < numPhases) {
+		// One phase's transform, lined up with the others for the first pass
+		FreqBlock &spectrum = *phaseSpectra[0];
+		phaseFFT.fftrPadded(&phases[stepNum * phaseSize / 2], spectrum);
+		std::copy(spectrum.cArrayUnpacked(), spectrum.cArrayUnpacked() + spectrum.size(), &passes[0][stepNum * spectrum.size()]);
+		return;
+	}
+	
+	// Run q and run q + numRuns / 2 are the even and odd samples of a run twice as long
+	uint32_t pass = stepNum - numPhases;
+	uint32_t numRuns = numPhases >> pass;
+	uint32_t runSize = phaseSize << pass;
+	uint32_t halfSpectrumSize = runSize / 2 + 1;
+	uint32_t twiddleStride = timeDomainSize / (2 * runSize);
+	
+	const FreqSample *in = &passes[pass % 2].front();
+	FreqSample *out = pass + 1 == numPasses ? outBlock.cArrayUnpacked() : &passes[(pass + 1) % 2].front();
+	if (pass + 1 == numPasses) assert(outBlock.size() == runSize + 1);
+	
+	for (uint32_t q=0; q < numRuns / 2; q++) {
+		const FreqSample *even = in + q * halfSpectrumSize;
+		const FreqSample *odd = in + (q + numRuns / 2) * halfSpectrumSize;
+		FreqSample *combined = out + q * (runSize + 1);
+		
+		for (uint32_t k=0; k <= runSize; k++) {
+			// Only half of each spectrum's stored, the rest mirrors it
+			uint32_t j = k % runSize;
+			FreqSample e, o;
+			if (j <= runSize / 2) {
+				e = even[j];
+				o = odd[j];
+			} else {
+				e.r = even[runSize - j].r; e.i = -even[runSize - j].i;
+				o.r = odd[runSize - j].r; o.i = -odd[runSize - j].i;
+			}
+			const FreqSample &w = twiddles[k * twiddleStride];
+			combined[k].r = e.r + w.r * o.r - w.i * o.i;
+			combined[k].i = e.i + w.r * o.i + w.i * o.r;
+		}
+	}
+#endif
+}
@@ -17,18 +17,32 @@ namespace Convolver {
 
 #include "ConvolverTypes.h"
 #include "ConvolverFFTType.h"
+#include "ConvolverFFTBackend.h"
+#include "ConvolverAlignedAllocator.h"
+#include <vector>
 #include <boost/shared_ptr.hpp>
 
 namespace Convolver {
 	class FFT {
 	public:
 		FFT(uint32_t size);
+#if !USE_APPLE_ACCELERATE
+		FFT(uint32_t size, FFTBackend::Type backendType);
+#endif
 		~FFT();
 		
 		boost::shared_ptr<FreqBlock> fftr(const TimeSample *samples, uint32_t numSamples);
 		boost::shared_ptr<FreqBlock> fftr(TimeBlock &block);
 		boost::shared_ptr<TimeBlock> fftri(FreqBlock &block);
 		
+		// Same as above, into blocks the caller already has (and keeps reusing), so
+		// the audio thread never allocates for a transform
+		void fftr(TimeBlock &inBlock, FreqBlock &outBlock);
+		void fftri(FreqBlock &inBlock, TimeBlock &outBlock);
+		// Transforms timeDomainSize / 2 samples followed by as many zeros, so the caller
+		// doesn't need a padded copy of its input, e.g. a run of frames in the FrameBuffer
+		void fftrPadded(const TimeSample *samples, FreqBlock &outBlock);
+		
 		static uint32_t getFreqDomainSize(uint32_t timeDomainSize);
 		static uint32_t getTimeDomainSize(uint32_t freqDomainSize);
 		
@@ -36,14 +50,68 @@ namespace Convolver {
 		uint32_t freqDomainSize;
 		float scalar;
 		uint32_t sizeLog2n;
+		
+#if !USE_APPLE_ACCELERATE
+		FFTBackend::Type getBackendType() { return backendType; }
+		
+		// Which backend new FFTs use. Starts as $CONVOLVER_FFT_BACKEND, or kiss if that isn't set.
+		// Setting it (or the environment variable) stops the Tuner from picking per size.
+		static void setDefaultBackend(FFTBackend::Type backendType);
+		static FFTBackend::Type getDefaultBackend();
+		static bool isDefaultBackendForced();
+		
+		// Override the default for one time domain size, e.g. with whatever measured fastest
+		static void setBackendForSize(uint32_t timeDomainSize, FFTBackend::Type backendType);
+		static FFTBackend::Type getBackendForSize(uint32_t timeDomainSize);
+#endif
 	private:
+		// The second half is always silent, fftrPadded() only ever writes the first
+		TimeBlock padded;
+		
 		#if USE_APPLE_ACCELERATE		
 		FFTSetup fftSetup; 		
 		#else
-		kiss_fftr_cfg fftrCfg;	
-		kiss_fftr_cfg fftriCfg;	
+		void init(FFTBackend::Type backendType);
+		inline float *scratchArray() { return scratch.empty() ? NULL : &scratch.front(); }
+		
+		// Shared with every other FFT of this size and backend, the scratch is ours
+		boost::shared_ptr<const FFTBackend> backend;
+		FFTBackend::Type backendType;
+		std::vector<float, AlignedAllocator<float> > scratch;
 		#endif
 	};
+	
+	// The same transform as FFT::fftrPadded(), a step at a time, so a big one can be spread
+	// over several callbacks. The input's dealt out into numPhases runs (every numPhases-th
+	// sample), each run gets a small transform of its own, and then log2(numPhases) passes
+	// of radix-2 butterflies put the halves back together, just like the outer stages of a
+	// decimation in time FFT. Each step costs about as much as one MAC of the whole spectrum.
+	class SplitFFT {
+	public:
+		// numPhases is a power of two, the small transforms are timeDomainSize / numPhases
+		SplitFFT(uint32_t timeDomainSize, uint32_t numPhases);
+		
+		// Copies timeDomainSize / 2 samples in, ready for step 0
+		void start(const TimeSample *samples);
+		// Steps go in order. After the last one, outBlock holds the spectrum.
+		void step(uint32_t stepNum, FFT &phaseFFT, FreqBlock &outBlock);
+		
+		inline uint32_t getNumSteps() { return numPhases + numPasses; }
+		// The size of phaseFFT
+		inline uint32_t getPhaseSize() { return timeDomainSize / numPhases; }
+		
+	private:
+		uint32_t timeDomainSize;
+		uint32_t numPhases;
+		uint32_t numPasses;
+		// Each phase's samples, timeDomainSize / numPhases / 2 of them, one after another
+		TimeBlock phases;
+		// Half spectra between passes, two so each pass can read one and write the other
+		std::vector<boost::shared_ptr<FreqBlock> > phaseSpectra;
+		std::vector<FreqSample> passes[2];
+		// e^(-2 pi i k / timeDomainSize), up to k = timeDomainSize / 2
+		std::vector<FreqSample> twiddles;
+	};
 };
 
 #endif
\ No newline at end of file
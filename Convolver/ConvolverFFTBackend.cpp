@@ -0,0 +1,357 @@
+/*
+ *  ConvolverFFTBackend.cpp
+ *  Convolvotron
+ *
+ *  Created by Seth Nickell on 10/18/09.
+ *  Copyright 2009 Meatscience. All rights reserved.
+ *
+ */
+
+#include "ConvolverFFTBackend.h"
+#include "ConvolverAlignedAllocator.h"
+#include "ConvolverInternal.h"
+
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+
+#if defined __SSE3__
+#include <pmmintrin.h>
+#endif
+
+#if USE_FFTW
+#include <fftw3.h>
+#endif
+
+#if !USE_APPLE_ACCELERATE
+
+namespace Convolver {
+
+	// The bundled kiss_fftr. It works for any even size, but kiss_fft's butterflies for
+	// radixes above 5 use a static buffer, and plans are shared with the workers, so we
+	// only offer it for powers of two.
+	class KissFFTBackend : public FFTBackend {
+	public:
+		KissFFTBackend(uint32_t size) : size(size) {
+			forwardCfg = kiss_fftr_alloc(size, 0, NULL, NULL);
+			inverseCfg = kiss_fftr_alloc(size, 1, NULL, NULL);
+		}
+
+		~KissFFTBackend() {
+			kiss_fftr_free(forwardCfg);
+			kiss_fftr_free(inverseCfg);
+		}
+
+		void forward(const TimeSample *input, FreqSample *output, float *scratch) const {
+			kiss_fftr_scratch(forwardCfg, input, output, (kiss_fft_cpx *)scratch);
+		}
+
+		void inverse(const FreqSample *input, TimeSample *output, float *scratch) const {
+			kiss_fftri_scratch(inverseCfg, input, output, (kiss_fft_cpx *)scratch);
+		}
+
+		// size/2 complex numbers
+		uint32_t getScratchSize() const { return size; }
+
+	protected:
+		uint64_t getBytes() const {
+			size_t bytes = 0;
+			kiss_fftr_alloc(size, 0, NULL, &bytes);
+			return 2 * bytes;
+		}
+
+	private:
+		uint32_t size;
+		kiss_fftr_cfg forwardCfg;
+		kiss_fftr_cfg inverseCfg;
+	};
+
+	// Radix-2 real FFT for power of two sizes. The real input is treated as a complex signal
+	// half as long (even samples real, odd samples imaginary), run through an in place complex
+	// FFT two butterflies per SSE register, then untangled into the real spectrum.
+	class SIMDFFTBackend : public FFTBackend {
+	public:
+		SIMDFFTBackend(uint32_t size);
+
+		void forward(const TimeSample *input, FreqSample *output, float *scratch) const;
+		void inverse(const FreqSample *input, TimeSample *output, float *scratch) const;
+		uint32_t getScratchSize() const { return 2 * half; }
+
+	protected:
+		uint64_t getBytes() const;
+
+	private:
+		typedef vector<float, AlignedAllocator<float> > FloatVector;
+
+		void complexFFT(float *data, const FloatVector &twiddles) const;
+
+		uint32_t half;
+		// (i, j) pairs of complex indexes swapped by the bit reversal, i < j
+		vector<uint32_t> bitReverseSwaps;
+		// Every stage's twiddles back to back, interleaved complex, one set per direction
+		FloatVector forwardTwiddles;
+		FloatVector inverseTwiddles;
+		// exp(-2 pi i k / size) for k in [0, half], used to split the half size spectrum
+		FloatVector splitTwiddles;
+	};
+
+	SIMDFFTBackend::SIMDFFTBackend(uint32_t size) : half(size / 2) {
+		assert(size >= 2 && (size & (size - 1)) == 0);
+
+		uint32_t numBits = 0;
+		while ((1U << numBits) < half) numBits++;
+		for (uint32_t i=0; i < half; i++) {
+			uint32_t j = 0;
+			for (uint32_t bit=0; bit < numBits; bit++) {
+				if (i & (1 << bit)) j |= 1 << (numBits - 1 - bit);
+			}
+			if (i < j) {
+				bitReverseSwaps.push_back(i);
+				bitReverseSwaps.push_back(j);
+			}
+		}
+
+		for (uint32_t length = 2; length <= half; length *= 2) {
+			for (uint32_t j=0; j < length / 2; j++) {
+				double angle = -2.0 * M_PI * j / length;
+				forwardTwiddles.push_back(cos(angle));
+				forwardTwiddles.push_back(sin(angle));
+				inverseTwiddles.push_back(cos(angle));
+				inverseTwiddles.push_back(-sin(angle));
+			}
+		}
+
+		for (uint32_t k=0; k <= half; k++) {
+			double angle = -2.0 * M_PI * k / size;
+			splitTwiddles.push_back(cos(angle));
+			splitTwiddles.push_back(sin(angle));
+		}
+	}
+
+	uint64_t SIMDFFTBackend::getBytes() const {
+		return bitReverseSwaps.size() * sizeof(uint32_t) + (forwardTwiddles.size() + inverseTwiddles.size() + splitTwiddles.size()) * sizeof(float);
+	}
+
+	void SIMDFFTBackend::complexFFT(float *data, const FloatVector &twiddles) const {
+		for (uint32_t s=0; s < bitReverseSwaps.size(); s += 2) {
+			float *a = &data[2 * bitReverseSwaps[s]];
+			float *b = &data[2 * bitReverseSwaps[s+1]];
+			float r = a[0], i = a[1];
+			a[0] = b[0]; a[1] = b[1];
+			b[0] = r; b[1] = i;
+		}
+
+		const float *stageTwiddles = twiddles.empty() ? NULL : &twiddles[0];
+		for (uint32_t length = 2; length <= half; length *= 2) {
+			uint32_t stride = length / 2;
+			for (uint32_t start=0; start < half; start += length) {
+				float *u = &data[2 * start];
+				float *v = &data[2 * (start + stride)];
+				uint32_t j = 0;
+#if defined __SSE3__
+				for (; j + 2 <= stride; j += 2) {
+					__m128 mm_u = _mm_loadu_ps(&u[2*j]);
+					__m128 mm_v = _mm_loadu_ps(&v[2*j]);
+					__m128 mm_w = _mm_loadu_ps(&stageTwiddles[2*j]);
+
+					// v * w, same trick as multiply_complex_SSE3
+					__m128 mm_re = _mm_mul_ps(_mm_moveldup_ps(mm_w), mm_v);
+					__m128 mm_im = _mm_mul_ps(_mm_movehdup_ps(mm_w), _mm_shuffle_ps(mm_v, mm_v, 0xB1));
+					__m128 mm_vw = _mm_addsub_ps(mm_re, mm_im);
+
+					_mm_storeu_ps(&u[2*j], _mm_add_ps(mm_u, mm_vw));
+					_mm_storeu_ps(&v[2*j], _mm_sub_ps(mm_u, mm_vw));
+				}
+#endif
+				for (; j < stride; j++) {
+					float wr = stageTwiddles[2*j], wi = stageTwiddles[2*j+1];
+					float vr = v[2*j] * wr - v[2*j+1] * wi;
+					float vi = v[2*j] * wi + v[2*j+1] * wr;
+					float ur = u[2*j], ui = u[2*j+1];
+					u[2*j] = ur + vr; u[2*j+1] = ui + vi;
+					v[2*j] = ur - vr; v[2*j+1] = ui - vi;
+				}
+			}
+			stageTwiddles += 2 * stride;
+		}
+	}
+
+	void SIMDFFTBackend::forward(const TimeSample *input, FreqSample *output, float *scratch) const {
+		float *z = scratch;
+		memcpy(z, input, 2 * half * sizeof(float));
+		complexFFT(z, forwardTwiddles);
+
+		// Z[k] holds even[k] + i odd[k], X[k] = even[k] + W^k odd[k]
+		output[0].r = z[0] + z[1];
+		output[0].i = 0.0f;
+		output[half].r = z[0] - z[1];
+		output[half].i = 0.0f;
+
+		for (uint32_t k=1; k < half; k++) {
+			float ar = z[2*k], ai = z[2*k+1];
+			float br = z[2*(half-k)], bi = -z[2*(half-k)+1];
+
+			float evenR = 0.5f * (ar + br), evenI = 0.5f * (ai + bi);
+			float oddR = 0.5f * (ai - bi), oddI = -0.5f * (ar - br);
+
+			float wr = splitTwiddles[2*k], wi = splitTwiddles[2*k+1];
+			output[k].r = evenR + oddR * wr - oddI * wi;
+			output[k].i = evenI + oddR * wi + oddI * wr;
+		}
+	}
+
+	void SIMDFFTBackend::inverse(const FreqSample *input, TimeSample *output, float *) const {
+		// Rebuild the half size spectrum straight into output, then transform in place
+		float *z = output;
+		for (uint32_t k=0; k < half; k++) {
+			float ar = input[k].r, ai = input[k].i;
+			float br = input[half-k].r, bi = -input[half-k].i;
+
+			float evenR = ar + br, evenI = ai + bi;
+			float dr = ar - br, di = ai - bi;
+
+			// odd = (a - b) * conj(W^k)
+			float wr = splitTwiddles[2*k], wi = -splitTwiddles[2*k+1];
+			float oddR = dr * wr - di * wi;
+			float oddI = dr * wi + di * wr;
+
+			z[2*k] = evenR - oddI;
+			z[2*k+1] = evenI + oddR;
+		}
+
+		complexFFT(z, inverseTwiddles);
+	}
+
+#if USE_FFTW
+	// FFTW's planner isn't thread safe, executing a plan is
+	static pthread_mutex_t fftwPlannerMutex = PTHREAD_MUTEX_INITIALIZER;
+
+	class FFTWBackend : public FFTBackend {
+	public:
+		FFTWBackend(uint32_t size) : size(size) {
+			float *timeData = (float *)fftwf_malloc(size * sizeof(float));
+			fftwf_complex *freqData = (fftwf_complex *)fftwf_malloc((size / 2 + 1) * sizeof(fftwf_complex));
+
+			// Our blocks aren't necessarily FFTW aligned, and the inverse input is an
+			// accumulator we don't want trashed
+			pthread_mutex_lock(&fftwPlannerMutex);
+			forwardPlan = fftwf_plan_dft_r2c_1d(size, timeData, freqData, FFTW_ESTIMATE | FFTW_UNALIGNED);
+			inversePlan = fftwf_plan_dft_c2r_1d(size, freqData, timeData, FFTW_ESTIMATE | FFTW_UNALIGNED | FFTW_PRESERVE_INPUT);
+			pthread_mutex_unlock(&fftwPlannerMutex);
+
+			fftwf_free(timeData);
+			fftwf_free(freqData);
+		}
+
+		~FFTWBackend() {
+			pthread_mutex_lock(&fftwPlannerMutex);
+			fftwf_destroy_plan(forwardPlan);
+			fftwf_destroy_plan(inversePlan);
+			pthread_mutex_unlock(&fftwPlannerMutex);
+		}
+
+		void forward(const TimeSample *input, FreqSample *output, float *) const {
+			fftwf_execute_dft_r2c(forwardPlan, (float *)input, (fftwf_complex *)output);
+		}
+
+		void inverse(const FreqSample *input, TimeSample *output, float *) const {
+			fftwf_execute_dft_c2r(inversePlan, (fftwf_complex *)input, output);
+		}
+
+		uint32_t getScratchSize() const { return 0; }
+
+	protected:
+		// FFTW doesn't tell us, guess at a twiddle per sample
+		uint64_t getBytes() const { return size * sizeof(fftwf_complex); }
+
+	private:
+		uint32_t size;
+		fftwf_plan forwardPlan;
+		fftwf_plan inversePlan;
+	};
+#endif
+
+	bool FFTBackend::isAvailable(Type type, uint32_t size) {
+		switch (type) {
+			case KISS:
+			case SIMD:
+				return size >= 2 && (size & (size - 1)) == 0;
+			case FFTW:
+				return USE_FFTW && size % 2 == 0;
+			default:
+				return false;
+		}
+	}
+
+	shared_ptr<const FFTBackend> FFTBackend::create(Type type, uint32_t size) {
+		switch (type) {
+			case SIMD:
+				return shared_ptr<const FFTBackend>(new SIMDFFTBackend(size));
+#if USE_FFTW
+			case FFTW:
+				return shared_ptr<const FFTBackend>(new FFTWBackend(size));
+#endif
+			default:
+				return shared_ptr<const FFTBackend>(new KissFFTBackend(size));
+		}
+	}
+
+	// Plans are never freed, there's only ever one per size and backend in use
+	typedef map<pair<FFTBackend::Type, uint32_t>, shared_ptr<const FFTBackend> > PlanMap;
+	static pthread_mutex_t plansMutex = PTHREAD_MUTEX_INITIALIZER;
+	static PlanMap plans;
+	static uint64_t planBytes = 0;
+
+	shared_ptr<const FFTBackend> FFTBackend::get(Type type, uint32_t size) {
+		if (!isAvailable(type, size)) {
+			return shared_ptr<const FFTBackend>();
+		}
+
+		pthread_mutex_lock(&plansMutex);
+		shared_ptr<const FFTBackend> &plan = plans[std::make_pair(type, size)];
+		if (!plan) {
+			plan = create(type, size);
+			planBytes += plan->getBytes();
+#if DEBUG
+			cout << "FFTBackend::get(): new " << name(type) << " plan for size " << size << ", " << plans.size() << " plans" << endl;
+#endif
+		}
+		shared_ptr<const FFTBackend> found = plan;
+		pthread_mutex_unlock(&plansMutex);
+
+		return found;
+	}
+
+	uint32_t FFTBackend::getNumPlans() {
+		pthread_mutex_lock(&plansMutex);
+		uint32_t numPlans = plans.size();
+		pthread_mutex_unlock(&plansMutex);
+		return numPlans;
+	}
+
+	uint64_t FFTBackend::getPlanBytes() {
+		pthread_mutex_lock(&plansMutex);
+		uint64_t bytes = planBytes;
+		pthread_mutex_unlock(&plansMutex);
+		return bytes;
+	}
+
+	static const char *backendNames[FFTBackend::NUM_BACKENDS] = {"kiss", "simd", "fftw"};
+
+	const char *FFTBackend::name(Type type) {
+		assert(type >= 0 && type < NUM_BACKENDS);
+		return backendNames[type];
+	}
+
+	bool FFTBackend::parse(const char *name, Type &type) {
+		for (int i=0; i < NUM_BACKENDS; i++) {
+			if (strcasecmp(name, backendNames[i]) == 0) {
+				type = (Type)i;
+				return true;
+			}
+		}
+		return false;
+	}
+}
+
+#endif
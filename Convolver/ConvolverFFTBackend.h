@@ -0,0 +1,75 @@
+/*
+ *  ConvolverFFTBackend.h
+ *  Convolvotron
+ *
+ *  Created by Seth Nickell on 10/18/09.
+ *  Copyright 2009 Meatscience. All rights reserved.
+ *
+ */
+
+#ifndef _ConvolverFFTBackend_h__
+#define _ConvolverFFTBackend_h__
+
+namespace Convolver {
+	class FFTBackend;
+}
+
+#include "ConvolverTypes.h"
+#include "ConvolverFFTType.h"
+#include <boost/shared_ptr.hpp>
+
+// Build with -DUSE_FFTW=1 and link -lfftw3f to get the FFTW backend
+#ifndef USE_FFTW
+#define USE_FFTW 0
+#endif
+
+#if !USE_APPLE_ACCELERATE
+
+namespace Convolver {
+	// One real FFT of one size. forward() writes size/2+1 bins, inverse() reads them back.
+	// Neither scales, so inverse(forward(x)) is size * x, same as kiss_fftr.
+	//
+	// Backends are plans: twiddles and tables only, never changed once built. Everything
+	// a transform writes to goes in the caller's scratch, so get() can hand one instance
+	// of each (type, size) to every Kernel on every thread.
+	class FFTBackend {
+	public:
+		typedef enum {
+			KISS = 0,
+			SIMD,
+			FFTW,
+			NUM_BACKENDS
+		} Type;
+
+		virtual ~FFTBackend() {}
+
+		// scratch holds getScratchSize() floats
+		virtual void forward(const TimeSample *input, FreqSample *output, float *scratch) const = 0;
+		virtual void inverse(const FreqSample *input, TimeSample *output, float *scratch) const = 0;
+		virtual uint32_t getScratchSize() const = 0;
+
+		// The process wide plan, built the first time anyone asks for it. NULL if type isn't
+		// available for this size (KISS and SIMD need a power of two, FFTW needs USE_FFTW).
+		static boost::shared_ptr<const FFTBackend> get(Type type, uint32_t size);
+		static bool isAvailable(Type type, uint32_t size);
+
+		// Number of plans built so far, and how many bytes of tables they hold
+		static uint32_t getNumPlans();
+		static uint64_t getPlanBytes();
+
+		static const char *name(Type type);
+		// "kiss", "simd" or "fftw", false if name is none of those
+		static bool parse(const char *name, Type &type);
+
+	protected:
+		// Approximate size of the tables, for getPlanBytes()
+		virtual uint64_t getBytes() const = 0;
+
+	private:
+		static boost::shared_ptr<const FFTBackend> create(Type type, uint32_t size);
+	};
+};
+
+#endif
+
+#endif
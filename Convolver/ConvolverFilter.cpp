@@ -30,52 +30,117 @@ using std::cerr;
 namespace Convolver {
 
 	IR::IR(Kernel &kernel, shared_ptr<BlockPattern> blockPattern, std::vector<const float *> &filterSignals, 
-		   uint32_t filterSignalLength, bool normalize, std::string description)
+		   uint32_t filterSignalLength, bool normalize, std::string description, float truncateDecibels, uint32_t preparedLength)
 	{
-		initialize(kernel, blockPattern, filterSignals, filterSignalLength, normalize, description);
+		initialize(kernel, blockPattern, filterSignals, filterSignalLength, normalize, description, truncateDecibels, preparedLength);
 	}
 		
-	void IR::setBlockPattern(Kernel &kernel, boost::shared_ptr<BlockPattern> &blockPattern) {
+	shared_ptr<IR> IR::repartitioned(Kernel &kernel, boost::shared_ptr<BlockPattern> &blockPattern) {
 #if DEBUG
-		cout << "IR::setBlockPattern(): scaling filters by " << filtersScaledBy << endl;
+		cout << "IR::repartitioned(): scaling filters by " << filtersScaledBy << endl;
 #endif		
+		shared_ptr<IR> ir(new IR());
+		ir->filtersScaledBy = filtersScaledBy;
+		ir->originalLength = originalLength;
+		ir->length = length;
+		
+		ir->filters.reserve(filters.size());
+		foreach(shared_ptr<Filter> &filter, filters) {
+			shared_ptr<Filter> filterPtr(new Filter(kernel, blockPattern, filter->getSamples(), filter->getNumSamples(), filter->description));
+			filterPtr->modify_Scale(filtersScaledBy);
+			ir->filters.push_back(filterPtr);
+		}
+		return ir;
+	}
+	
+	void IR::setTimeDomainHead(uint32_t numHeadBlocks) {
+		foreach(shared_ptr<Filter> &filter, filters) {
+			filter->setTimeDomainHead(numHeadBlocks);
+		}
+	}
+	
+	void IR::setEmptyBlockThreshold(float thresholdDecibels) {
+		foreach(shared_ptr<Filter> &filter, filters) {
+			filter->setEmptyBlockThreshold(thresholdDecibels);
+		}
+	}
+	
+	bool IR::prepareMore(Kernel &kernel, uint32_t numBlocks) {
+		uint32_t numBlocksLeft = 0;
 		foreach(shared_ptr<Filter> &filter, filters) {
-			filter->setBlockPattern(kernel, blockPattern);
-			filter->modify_Scale(filtersScaledBy);
+			numBlocksLeft += filter->prepareBlocks(kernel, numBlocks);
 		}
+		return numBlocksLeft > 0;
+	}
+	
+	bool IR::isPrepared() {
+		foreach(shared_ptr<Filter> &filter, filters) {
+			if (!filter->isPrepared()) return false;
+		}
+		return true;
 	}
 	
 	void IR::initialize(Kernel &kernel, shared_ptr<BlockPattern> blockPattern, std::vector<const TimeSample *> &filterSignals, 
-						uint32_t filterSignalLength, bool normalize, std::string description)
+						uint32_t filterSignalLength, bool normalize, std::string description, float truncateDecibels, uint32_t preparedLength)
 	{
 		#if DEBUG
 		cout << "IR::IR(): " << filterSignals.size() << " channels of " << filterSignalLength << " samples" << endl;
 		#endif
 		
-		filters.reserve(filterSignals.size());
+		originalLength = filterSignalLength;
+		length = filterSignalLength;
 		
-		float maxGain = 0.0f;
+		// Faded copies of the part we keep, the Filters copy them again
+		vector<vector<TimeSample> > truncatedSignals;
+		vector<const TimeSample *> truncatedSignalPtrs;
+		if (truncateDecibels < 0.0f) {
+			length = std::max<uint32_t>(findDecayedLength(filterSignals, filterSignalLength, truncateDecibels), 1);
+		}
+		if (length < filterSignalLength) {
+			uint32_t fadeLength = truncateFadeLength;
+			if (fadeLength > length) fadeLength = length;
+			truncatedSignals.resize(filterSignals.size());
+			for (uint32_t channelNum=0; channelNum < filterSignals.size(); channelNum++) {
+				vector<TimeSample> &truncated = truncatedSignals[channelNum];
+				truncated.assign(filterSignals[channelNum], filterSignals[channelNum] + length);
+				// Raised cosine, so the cut doesn't click
+				for (uint32_t i=0; i < fadeLength; i++) {
+					truncated[length - fadeLength + i] *= 0.5f + 0.5f * cos(M_PI * (i + 1) / fadeLength);
+				}
+				truncatedSignalPtrs.push_back(&truncated[0]);
+			}
+			
+			#if DEBUG
+			cout << "IR::IR(): truncated from " << filterSignalLength << " to " << length << " samples" << endl;
+			#endif
+		}
+		std::vector<const float *> &signals = length < filterSignalLength ? truncatedSignalPtrs : filterSignals;
 		
-		uint32_t filterSignalsSize = filterSignals.size();
+		uint32_t numBlocksToPrepare = Signal::allBlocks;
+		if (preparedLength > 0) {
+			numBlocksToPrepare = 0;
+			for (uint32_t covered=0; covered < preparedLength; numBlocksToPrepare++) {
+				covered += blockPattern->sizeForTimeBlock(numBlocksToPrepare);
+			}
+		}
+		
+		filters.reserve(filterSignals.size());
+		
+		uint32_t filterSignalsSize = signals.size();
 		for(uint32_t channelNum=0; channelNum < filterSignalsSize; channelNum++) {
-			const TimeSample *filterSignal = filterSignals[channelNum];
+			const TimeSample *filterSignal = signals[channelNum];
 
 			std::stringstream channelStringStream;
 			channelStringStream << channelNum;
 			std::string channelDescription = description + "[" + channelStringStream.str() + "]";
 			
-			shared_ptr<Filter> filterPtr(new Filter(kernel, blockPattern, filterSignal, filterSignalLength, channelDescription));
+			shared_ptr<Filter> filterPtr(new Filter(kernel, blockPattern, filterSignal, length, channelDescription, numBlocksToPrepare));
 			filters.push_back(filterPtr);
-
-			if (normalize) {
-				// Find the channel with the highest gain
-				float gain = filterPtr->measureGain();
-				if (gain > maxGain) maxGain = gain;
-			}
 		}
 
-		if (normalize) {
-			filtersScaledBy = 1.0f / maxGain;
+		float gain = normalize ? measureGain(signals, length) : 0.0f;
+		if (gain > 0.0f) {
+			filtersScaledBy = 1.0f / gain;
 		
 			#if DEBUG
 			cout << "IR::IR(): scaling filters by " << filtersScaledBy << endl;
@@ -89,6 +154,51 @@ namespace Convolver {
 		}
 	}
 
+	uint32_t IR::findDecayedLength(std::vector<const TimeSample *> &signals, uint32_t length, float thresholdDecibels) {
+		if (length == 0 || signals.empty()) return length;
+		
+		vector<double> power(length, 0.0);
+		foreach(const TimeSample *signal, signals) {
+			for (uint32_t i=0; i < length; i++) power[i] += signal[i] * signal[i];
+		}
+		
+		// If the last quarter is flat, i.e. its first and last twentieths have about the same
+		// power, it's the noise floor rather than a tail that was cut off early
+		double noise = 0.0;
+		uint32_t twentieth = length / 20;
+		if (twentieth > 0) {
+			double earlier = 0.0, later = 0.0;
+			for (uint32_t i=length - 5 * twentieth; i < length - 4 * twentieth; i++) earlier += power[i];
+			for (uint32_t i=length - twentieth; i < length; i++) later += power[i];
+			if (earlier < 1.25 * later) noise = later / twentieth;
+		}
+		
+		double totalEnergy = 0.0;
+		for (uint32_t i=0; i < length; i++) totalEnergy += power[i] - noise;
+		if (totalEnergy <= 0.0) return length;
+		double threshold = totalEnergy * pow(10.0, thresholdDecibels / 10.0);
+		
+		// Integrate backwards from the end, the curve's first crossing is the last one
+		// we come to going this way
+		double remaining = 0.0;
+		uint32_t decayedLength = length;
+		for (uint32_t i=length; i > 0; i--) {
+			remaining += power[i - 1] - noise;
+			if (remaining < threshold) decayedLength = i - 1;
+		}
+		return decayedLength;
+	}
+	
+	float IR::measureGain(std::vector<const TimeSample *> &signals, uint32_t length) {
+		double maxEnergy = 0.0;
+		foreach(const TimeSample *signal, signals) {
+			double energy = 0.0;
+			for (uint32_t i=0; i < length; i++) energy += signal[i] * signal[i];
+			maxEnergy = std::max(maxEnergy, energy);
+		}
+		return sqrt(maxEnergy);
+	}
+	
 	vector<shared_ptr<Filter> > &IR::getFilters()
 	{
 		return filters;
@@ -109,15 +219,38 @@ namespace Convolver {
 	
 	
 	
-	Filter::Filter(Kernel &kernel, boost::shared_ptr<BlockPattern> blockPattern, const float *samplesTimeDomain, uint32_t numSamples, std::string description)
-		: Signal(kernel, blockPattern, samplesTimeDomain, numSamples), description(description), numSamples(numSamples)
+	Filter::Filter(Kernel &kernel, boost::shared_ptr<BlockPattern> blockPattern, const float *samplesTimeDomain, uint32_t numSamples, std::string description,
+				   uint32_t numBlocksToPrepare)
+		: Signal(kernel, blockPattern, samplesTimeDomain, numSamples, numBlocksToPrepare), description(description), numSamples(numSamples)
 	{
 		samples = new TimeSample[numSamples];
 		std::copy(samplesTimeDomain, samplesTimeDomain + numSamples, samples);
 	}
 	
-	void Filter::setBlockPattern(Kernel &kernel, boost::shared_ptr<BlockPattern> &blockPattern) {
-		Signal::initialize(kernel, blockPattern, samples, numSamples);
+	void Filter::setTimeDomainHead(uint32_t numHeadBlocks) {
+		this->numHeadBlocks = numHeadBlocks;
+		initializeHead(samples, numSamples);
+	}
+	
+	uint32_t Filter::prepareBlocks(Kernel &kernel, uint32_t numBlocks) {
+		return Signal::prepareBlocks(kernel, samples, numSamples, numBlocks);
+	}
+	
+	uint32_t Filter::getRingOutSamples(float thresholdDecibels) {
+		double totalEnergy = 0.0;
+		for (uint32_t i=0; i < numSamples; i++) totalEnergy += samples[i] * samples[i];
+		if (totalEnergy == 0.0) return 0;
+		
+		// Walk back from the end until the tail's loud enough to hear
+		double threshold = totalEnergy * pow(10.0, thresholdDecibels / 10.0);
+		double tailEnergy = 0.0;
+		uint32_t length = numSamples;
+		while (length > 0) {
+			tailEnergy += samples[length - 1] * samples[length - 1];
+			if (tailEnergy > threshold) break;
+			length--;
+		}
+		return length;
 	}
 	
 	float Filter::measureGain() {
@@ -30,19 +30,54 @@ typedef kiss_fft_cpx *Buffer;
 namespace Convolver {	
 	class IR {
 	public:
+		// A negative truncateDecibels trims the signals at findDecayedLength() first, with a short
+		// fade out, so what's below the noise floor doesn't cost any partitions.
+		//
+		// A preparedLength only transforms the partitions covering that many samples, so the
+		// IR can go to a Convolver straight away, and prepareMore() does the rest while it's
+		// convolving. A normalized IR's gain is measured on the whole time domain signal up
+		// front (see measureGain()), so it's just as loud however much was prepared.
 		IR(Kernel &ckernel, boost::shared_ptr<BlockPattern> blockPattern, std::vector<const TimeSample *> &filterSignals, 
-		   uint32_t filterSignalLength, bool normalize, std::string description="");
+		   uint32_t filterSignalLength, bool normalize, std::string description="", float truncateDecibels=0.0f, uint32_t preparedLength=0);
 		
 		std::vector<boost::shared_ptr<Filter> > &getFilters();
-		void setBlockPattern(Kernel &kernel, boost::shared_ptr<BlockPattern> &blockPattern);
+		// A new IR with new Filters, the same signals and scale partitioned (all of them
+		// prepared) for blockPattern. A Convolver may be reading ours, so they're never
+		// re-partitioned in place.
+		boost::shared_ptr<IR> repartitioned(Kernel &kernel, boost::shared_ptr<BlockPattern> &blockPattern);
+		// Run the first numHeadBlocks partitions as a time domain FIR, 0 turns it off
+		void setTimeDomainHead(uint32_t numHeadBlocks);
+		// See Signal::setEmptyBlockThreshold()
+		void setEmptyBlockThreshold(float thresholdDecibels);
+		
+		// Prepares up to numBlocks more partitions of each filter, with kernel's FFTs (see
+		// Signal::prepareBlocks()). False once every one's done.
+		bool prepareMore(Kernel &kernel, uint32_t numBlocks);
+		bool isPrepared();
+		
+		// In samples, what we were given and what we kept after truncating
+		uint32_t getOriginalLength() { return originalLength; }
+		uint32_t getLength() { return length; }
+		
+		// Where the Schroeder energy decay curve (the energy left from each sample on, every
+		// channel together) falls thresholdDecibels (negative) below the whole IR's energy.
+		// A noise floor at the end is measured and taken out of the curve first, otherwise
+		// it'd hold the curve up for as long as it lasts.
+		static uint32_t findDecayedLength(std::vector<const TimeSample *> &signals, uint32_t length, float thresholdDecibels);
+		static const uint32_t truncateFadeLength = 256;
+		// The loudest channel's RMS gain on white noise, sqrt(sum of its samples squared).
+		// It's what the FilterLab's measurement comes to on a flat IR, without an FFT or a
+		// test signal, so it works before any partitions have been prepared.
+		static float measureGain(std::vector<const TimeSample *> &signals, uint32_t length);
 	protected:
 		IR() {};
-		void initialize(Kernel &ckernel, boost::shared_ptr<BlockPattern> blockPattern, std::vector<const float *> &filterSignals, uint32_t filterSignalLength, bool normalize, std::string description);
+		void initialize(Kernel &ckernel, boost::shared_ptr<BlockPattern> blockPattern, std::vector<const float *> &filterSignals, uint32_t filterSignalLength, 
+						bool normalize, std::string description, float truncateDecibels=0.0f, uint32_t preparedLength=0);
 	private:
-		float measureGain();
-		
 		std::vector<boost::shared_ptr<Filter> > filters;
 		float filtersScaledBy;
+		uint32_t originalLength;
+		uint32_t length;
 	};
 	
 	class UnitIR : public IR {
@@ -54,13 +89,19 @@ namespace Convolver {
 
 	class Filter : public Signal {
 	public:
-		Filter(Kernel &kernel, boost::shared_ptr<BlockPattern> blockPattern, const TimeSample *samplesTimeDomain, uint32_t numSamples, std::string description="");
+		Filter(Kernel &kernel, boost::shared_ptr<BlockPattern> blockPattern, const TimeSample *samplesTimeDomain, uint32_t numSamples, std::string description="",
+			   uint32_t numBlocksToPrepare=allBlocks);
 
 		float measureGain();
+		// How many samples in until what's left of the filter's energy is thresholdDecibels
+		// (negative) below the whole thing, after that the tail's inaudible
+		uint32_t getRingOutSamples(float thresholdDecibels);
 		
 		// FIXME: implement
 		const FrequencyResponse *getFrequencyResponse() { return NULL; };
-		void setBlockPattern(Kernel &kernel, boost::shared_ptr<BlockPattern> &blockPattern);		
+		void setTimeDomainHead(uint32_t numHeadBlocks);
+		// See Signal::prepareBlocks()
+		uint32_t prepareBlocks(Kernel &kernel, uint32_t numBlocks);
 		
 		std::string description;
 				
@@ -43,7 +43,7 @@ namespace Convolver {
 	static time_t t2;
 	uint32_t lastInputBlockSize = 0;
 	
-	uint32_t testCount[2] = {0, 0};
+	map<uint32_t, uint32_t> convolveAccumulateCounts;
 	uint32_t numUnderruns = 0;
 	
 
@@ -60,52 +60,76 @@ namespace Convolver {
 	}
 
 	void Kernel::schedule_convolution(Filter &filter, State &state) {
+		schedule_convolution(filter, state, state);
+	}
+	
+	void Kernel::schedule_convolution(Filter &filter, State &input, State &output) {
+		if (scheduler == SCHEDULER_FDL) {
+			schedule_convolution_fdl(filter, input, output);
+			return;
+		}
+		
 		vector< boost::shared_ptr<FreqBlock> > &blocks = filter.getBlocks();
 		uint32_t numBlocks = blocks.size();
 		
-		// Only do big blocks if we're at the start of a state
-		bool doSizeOneBlocks = state.count == 0;
-		uint32_t timeFrameSize = state.getFrameSize();		
-		FrameNum currentFrameNum = state.getCurrentFrameNum();
-		FrameRequests &frameRequests = *state.frameRequests;
+		FrameNum currentFrameNum = input.getCurrentFrameNum();
+		FrameRequests &frameRequests = *input.frameRequests;
 		
-		uint32_t delay = 0;
-		for(uint32_t i=0; i < numBlocks; i++) {
-			//if (useThread && !accumulatorsLocked) accumulatorsLocked = state.tryToLockAccumulators("Kernel::convolve()");
-			
-			boost::shared_ptr<FreqBlock> block = blocks[i];
-			
-			if ((block->size() == sizeOne)) {
-				if(!doSizeOneBlocks)
-					break;
-			}
-			
-			uint32_t numSamplesInBlock = FFT::getTimeDomainSize(block->size()) / 2;
+		uint32_t numHeadBlocks = filter.getNumHeadBlocks();
+		if (numHeadBlocks > 0) convolveHead(filter, input, output);
+		
+		// Each level's request ends on the frame that completes its input, so everything
+		// due now can go straight in and be processed this frame
+		const Schedule &schedule = getSchedule(numBlocks);
+		FrameNum endFrame = currentFrameNum + 1;
+		foreach(uint32_t levelNum, schedule.levelsDueOn(currentFrameNum)) {
+			const Schedule::Level &level = schedule.getLevel(levelNum);
 			
-			if ((numSamplesInBlock % timeFrameSize) > 0) {
-				cout << "Block size " << numSamplesInBlock << " is not a multiple of " << timeFrameSize << endl;
-				assert(numSamplesInBlock % timeFrameSize == 0);
-			}
+			// convolveHead() already took care of the whole level
+			if (level.partitions.back().blockNum < numHeadBlocks) continue;
 			
-			uint32_t numFrames = numSamplesInBlock / timeFrameSize;		
-			FrameNum endFrame = currentFrameNum + numFrames;
+			// Not enough input since we started (or were reset) for this one yet
+			if (endFrame < frameRequests.getFirstFrame() + level.numFrames) continue;
+			FrameNum startFrame = endFrame - level.numFrames;
 			
-			shared_ptr<FrameRequest> frameRequest(frameRequests.request(currentFrameNum, endFrame));
-			FrameNum outputConvolutionStartingAt = currentFrameNum + delay;
+			// Ops from every filter reading this input share the request, so the
+			// input only gets transformed once per partition size. A level that's all
+			// empty partitions doesn't need one at all.
+			shared_ptr<FrameRequest> *frameRequest = NULL;
 			
+			foreach(const Schedule::Partition &partition, level.partitions) {
+				if (partition.blockNum < numHeadBlocks) continue;
+				if (filter.isBlockEmpty(partition.blockNum)) continue;
+				if (frameRequest == NULL) frameRequest = &frameRequests.request(startFrame, endFrame);
+				
+				boost::shared_ptr<FreqBlock> &block = blocks[partition.blockNum];
+				assert(FFT::getTimeDomainSize(block->size()) / 2 == level.numFrames * input.getFrameSize());
+				FrameNum outputConvolutionStartingAt = startFrame + partition.delay;
+				
 #if DEBUG_CONVOLVE
-			cout << "\t\tscheduling ConvolutionOp (" /*<< (uint32_t)&(*convolutionOp)*/ << "): F" << i << " x [" << currentFrameNum << ", " << endFrame << "]"; 
-			cout << " -> " << outputConvolutionStartingAt << endl;			
+				cout << "\t\tscheduling ConvolutionOp: F" << partition.blockNum << " x [" << startFrame << ", " << endFrame << "]"; 
+				cout << " -> " << outputConvolutionStartingAt << endl;			
 #endif			
-			frameRequest->lazilyConvolveWith(block, outputConvolutionStartingAt);
-			
-			delay += numFrames;
+				(*frameRequest)->lazilyConvolveWith(block, &output, outputConvolutionStartingAt);
+			}
 		}
 	}
 	
+	const Schedule &Kernel::getSchedule(uint32_t numBlocks) {
+		map<uint32_t, shared_ptr<Schedule> >::iterator result = schedules.find(numBlocks);
+		if (result != schedules.end()) return *result->second;
+		
+		assert(blockPattern != NULL);
+		shared_ptr<Schedule> schedule(new Schedule(*blockPattern, numBlocks));
+		schedules[numBlocks] = schedule;
+		return *schedule;
+	}
+	
 	void Kernel::process_convolutions(State &state, bool useThread) {
-		bool accumulatorsLocked = false;
-		if (useThread && !accumulatorsLocked) accumulatorsLocked = state.tryToLockAccumulators("Kernel::convolve()");
+		if (scheduler == SCHEDULER_FDL) {
+			process_convolutions_fdl(state);
+			return;
+		}
 		
 		// Compute the sizes of different frame types
 		uint32_t timeFrameSize = state.getFrameSize();
@@ -116,13 +140,14 @@ namespace Convolver {
 		if (t2 - t1 >= 1) {
 			t1 = t2;
 			cout << "Frames/s = " << numTicks * timeFrameSize << endl;
-			cout << "convolveAccumulates on frame size " << sizeZero << ": " << testCount[0] << endl;
-			cout << "convolveAccumulates on frame size " << sizeOne << ": " << testCount[1] << endl;
+			typedef map<uint32_t, uint32_t>::value_type CountEntry;
+			foreach(CountEntry &entry, convolveAccumulateCounts) {
+				cout << "convolveAccumulates on frame size " << entry.first << ": " << entry.second << endl;
+			}
 			cout << "last input block size " << lastInputBlockSize << endl;
 			cout << "number of underruns " << numUnderruns << endl;
 			cout << endl;
-			testCount[0] = 0;
-			testCount[1] = 0;
+			convolveAccumulateCounts.clear();
 			numTicks = 0;
 			numUnderruns = 0;
 		}
@@ -139,22 +164,7 @@ namespace Convolver {
 		cout << "\tScheduling:" << endl;
 #endif
 		
-		bool doSizeOneBlocks = false;
-		if (state.count == 0) {
-			doSizeOneBlocks = true;
-			state.count++;
-		} else if (state.count == (sizeOne-1)/(sizeZero-1) - 1) {
-			state.count = 0;
-		} else {
-			state.count++;
-		}
-
-		list<shared_ptr<FrameRequest> >	requests = frameRequests.advanceToFrame(currentFrameNum);
-
-		if (useThread && !accumulatorsLocked) {
-			state.lockAccumulators("Kernel::convolve()");
-			accumulatorsLocked = true;
-		}
+		vector<shared_ptr<FrameRequest> > &requests = frameRequests.advanceToFrame(currentFrameNum);
 		
 		#if DEBUG_CONVOLVE
 		cout << "\tProcessing " << requests.size() << " requests for frame: " << currentFrameNum << endl;
@@ -162,33 +172,68 @@ namespace Convolver {
 		bool workForWorkerThread = false;
 		
 		// Process due frame requests
-		foreach(shared_ptr<FrameRequest> frameRequest, requests)  {
+		foreach(shared_ptr<FrameRequest> &frameRequest, requests)  {
 			#if DEBUG_CONVOLVE
 			cout << "\t\tprocessing requests for [" << frameRequest->id.first << ", " << frameRequest->id.second << "], " << endl;
 			#endif
-			bool padBuffer = true;
-			shared_ptr<TimeBlock> frames = frameBuffer.fulfill(*frameRequest, timeFrameSize, padBuffer);
-			uint32_t frameSize = frames->size();
+			// Silence convolves to silence, the accumulators already hold what the earlier input left
+			if (frameBuffer.silentSince(frameRequest->id.first)) continue;
+			
+			uint32_t numSamples;
+			const TimeSample *frames = frameBuffer.fulfill(*frameRequest, numSamples);
 
-			if(useThread && FFT::getFreqDomainSize(frameSize) == sizeOne) {
+			// Everything bigger than the smallest partition has at least a frame of slack,
+			// and goes to the workers on its level's tier
+			int level = getPartitionLevel(FFT::getFreqDomainSize(numSamples * 2));
+			shared_ptr<TimeBlock> *jobInput = useThread && level > 0 ? state.getJobInput(numSamples) : NULL;
+			if(jobInput != NULL) {
 				#if DEBUG_CONVOLVE
 					cout << "\t\t\tenqueing work item" << endl;
 				#endif
 				//cout << "Adding work item" << endl;
-				State::WorkItem *item = new State::WorkItem(frames, frameRequest, currentFrameNum);
-				bool dataAdded = state.queueFrameRequestForWorkThread(item);
-				if (!dataAdded) {
-					cerr << "QUEUE WAS FULL" << endl;
-					assert(false);
+				// The ring will have moved on by the time the worker gets to it
+				std::copy(frames, frames + numSamples, (*jobInput)->begin());
+				WorkerPool::Job job;
+				job.state = &state;
+				job.input = *jobInput;
+				job.request = frameRequest;
+				job.frameNum = currentFrameNum;
+				job.level = level;
+				job.deadline = getDeadline(*frameRequest, currentFrameNum, timeFrameSize);
+				job.skipIfLate = skipLateWork;
+				if (state.queueFrameRequestForWorkThread(job)) {
+					workForWorkerThread = true;
+				} else {
+					// The workers are swamped, it'll have to be us. It eats into our time, and
+					// anything a worker's busy adding into the same output ends up late.
+					#if DEBUG_CONVOLVE_THREADS
+					cerr << "Kernel::process_convolutions(): worker queues full, convolving on the audio thread" << endl;
+					#endif
+					bool inWorkThread = false;
+					convolve(state, frames, numSamples, frameRequest, currentFrameNum, inWorkThread);
 				}
-				workForWorkerThread = true;
+			} else if (useThread && level > 0) {
+				// Every input block that size is still out with a worker, which only happens
+				// when they're well behind already
+				#if DEBUG_CONVOLVE_THREADS
+				cerr << "Kernel::process_convolutions(): no input block free for a job, convolving on the audio thread" << endl;
+				#endif
+				bool inWorkThread = false;
+				convolve(state, frames, numSamples, frameRequest, currentFrameNum, inWorkThread);
+			} else if (spreadLargePartitions && !useThread && level > 0) {
+				spreadRequest(state, level, frameRequest, frames, numSamples);
 			} else {
-				bool lockAccumulators = false;
-				convolve(state, *frames, *frameRequest, currentFrameNum, lockAccumulators);
+				bool inWorkThread = false;
+				convolve(state, frames, numSamples, frameRequest, currentFrameNum, inWorkThread);
 			}
 		}
 		
-		FrameNum endFrame = frameRequests.getOldestFrameRequested();
+		if (state.getNumSpreadRequests() > 0) advanceSpreadRequests(state);
+		
+		// Nothing will ask for more than the biggest partition's worth of frames, and those
+		// runs all start on a multiple of its size
+		FrameNum nextFrame = currentFrameNum + 1;
+		FrameNum endFrame = std::max(nextFrame - nextFrame % maxPartitionFrames, frameRequests.getFirstFrame());
 		#if DEBUG_CONVOLVE
 		cout << "\tFlushing frames before: " << endFrame << endl;		
 		#endif
@@ -196,55 +241,244 @@ namespace Convolver {
 		#if DEBUG_CONVOLVE	
 		cout << "\tDone Convolving, returning" << endl;
 		#endif
-		state.setSignalThreadWorkAvailable(workForWorkerThread);
-		state.setReleaseAccumulatorLockOnPop(accumulatorsLocked);
+		if (workForWorkerThread) WorkerPool::get().wake();
 	}
 	
 	
 	
-	void Kernel::convolve(State &state, TimeBlock &timeBlock, FrameRequest &frameRequest, FrameNum currentFrameNum, bool inWorkThread) {
-		uint32_t frameSize = timeBlock.size();
+	// With a uniform partition there's nothing to schedule: every frame we transform the
+	// newest input once, and sweep the whole filter against the delay line right away
+	void Kernel::schedule_convolution_fdl(Filter &filter, State &input, State &output) {
+		vector< boost::shared_ptr<FreqBlock> > &blocks = filter.getBlocks();
+		uint32_t numBlocks = blocks.size();
 		
-		FFT &fft = getFFT(frameSize);
-		shared_ptr<FreqBlock> signalBlockPtr = fft.fftr(timeBlock);
-		FreqBlock &signalBlock = *signalBlockPtr;
-		uint32_t signalBlockSize = signalBlock.size();
+		uint32_t timeFrameSize = input.getFrameSize();
+		FrameNum currentFrameNum = input.getCurrentFrameNum();
+		FrequencyDelayLine &fdl = input.getFrequencyDelayLine();
+		uint32_t freqBlockSize = fdl.getFreqBlockSize();
+		
+		fdl.reserve(numBlocks);
 		
-		// Perform each ConvolutionOp
+		// Several filters can read an input, but we only need to FFT it once
+		if (!fdl.hasSpectrum(currentFrameNum)) {
+			if (input.frameBuffer->silentSince(currentFrameNum)) {
+				fdl.startSilence(currentFrameNum);
+			} else {
+				FFT &fft = getFFT(timeFrameSize * 2);
+				fft.fftrPadded(input.frameBuffer->getFrame(currentFrameNum), fdl.startSpectrum(currentFrameNum));
+			}
+		}
+		
+		UniformAccumulator &uniformAccumulator = output.getUniformAccumulator();
+		assert(uniformAccumulator.getFreqBlockSize() == freqBlockSize);
+		
+		uint32_t numHeadBlocks = filter.getNumHeadBlocks();
+		if (numHeadBlocks > 0) convolveHead(filter, input, output);
+		
+		// Once the input's been quiet as long as the filter, leaving the accumulator
+		// alone saves the output's IFFT too
+		if (fdl.silentFor(numBlocks)) return;
+		FreqBlock *accumulator = &uniformAccumulator.get();
+		
+		for (uint32_t i=numHeadBlocks; i < numBlocks; i++) {
+			FreqBlock &filterBlock = *blocks[i];
+			if (filterBlock.size() != freqBlockSize) {
+				cerr << "Kernel::schedule_convolution_fdl(): partition " << i << " has size " << filterBlock.size();
+				cerr << ", expected " << freqBlockSize << ", the FDL scheduler needs a FixedSizeBlockPattern" << endl;
+				assert(filterBlock.size() == freqBlockSize);
+			}
+			
+			// Partition i hears the input from i frames ago, silent ones have no spectrum
+			if (i > currentFrameNum) break;
+			if (filter.isBlockEmpty(i)) continue;
+			FreqBlock *spectrum = fdl.getSpectrum(currentFrameNum - i);
+			if (spectrum == NULL) continue;
+			
+			convolveAccumulate(*spectrum, filterBlock, *accumulator, freqBlockSize);
+		}
+	}
+	
+	// The first few partitions as a plain FIR, straight into this frame's output, so
+	// small frames don't pay for an FFT round trip on the part of the IR that's due now
+	void Kernel::convolveHead(Filter &filter, State &inputState, State &outputState) {
+		TimeBlock &head = filter.getHead();
+		uint32_t numTaps = head.size();
+		uint32_t timeFrameSize = inputState.getFrameSize();
+		FrameNum currentFrameNum = inputState.getCurrentFrameNum();
+		
+		// Several filters can read an input, but the history only needs one copy of each frame
+		InputHistory &history = inputState.getInputHistory();
+		history.reserve(numTaps - 1);
+		if (!history.hasFrame(currentFrameNum)) {
+			history.push(currentFrameNum, inputState.frameBuffer->getFrame(currentFrameNum));
+		}
+		
+		// Nothing but silence under the taps
+		FrameNum numHistoryFrames = (numTaps - 1 + timeFrameSize - 1) / timeFrameSize;
+		FrameNum firstFrame = currentFrameNum > numHistoryFrames ? currentFrameNum - numHistoryFrames : 0;
+		if (inputState.frameBuffer->silentSince(firstFrame)) return;
+		
+		const TimeSample *input = history.getFrame();
+		const TimeSample *taps = head.cArray();
+		TimeSample *output = outputState.getHeadAccumulator().cArray();
+		
+		uint32_t n = 0;
+#if USE_SSE3
+		n = fir_accumulate_SSE(input, taps, output, numTaps, timeFrameSize);
+#endif
+		for (; n < timeFrameSize; n++) {
+			TimeSample sum = 0.0f;
+			for (uint32_t k=0; k < numTaps; k++) {
+				sum += taps[k] * input[(int)n - (int)k];
+			}
+			output[n] += sum;
+		}
+	}
+	
+	void Kernel::spreadRequest(State &state, int level, shared_ptr<FrameRequest> &frameRequest, const TimeSample *samples, uint32_t numSamples) {
+		FrameNum currentFrameNum = state.getCurrentFrameNum();
+		SpreadRequest *spreadRequest = state.getSpreadRequest(level);
+		
+		if (spreadRequest == NULL) {
+			// Split the transform up as finely as the first output's slack is worth, so
+			// each piece costs about as much as a MAC: log2(size) / 2 phases does that
+			FrameNum firstOutput = frameRequest->getLazyConvolutions().front().outputConvolutionStartingAt;
+			foreach(ConvolutionOp &op, frameRequest->getLazyConvolutions()) firstOutput = std::min(firstOutput, op.outputConvolutionStartingAt);
+			uint32_t timeDomainSize = numSamples * 2;
+			uint32_t numPhases = 1;
+			if (firstOutput > currentFrameNum) {
+				uint32_t log2Size = 0;
+				while ((1u << log2Size) < timeDomainSize) log2Size++;
+				while (numPhases * 2 <= log2Size / 2 && timeDomainSize / (numPhases * 2) >= 64) numPhases *= 2;
+			}
+			spreadRequest = &state.makeSpreadRequest(level, numSamples / state.getFrameSize(), numPhases);
+		}
+		
+		// Should never happen, but the last one can't be left half done
+		if (spreadRequest->busy()) {
+			#if DEBUG
+			cerr << "Kernel::spreadRequest(): level " << level << " still busy, finishing it now" << endl;
+			#endif
+			while (spreadRequest->numStepsDone < spreadRequest->getNumSteps()) {
+				doSpreadStep(*spreadRequest, spreadRequest->numStepsDone++);
+			}
+			spreadRequest->finish();
+		}
+		
+		spreadRequest->start(frameRequest, samples, currentFrameNum);
+	}
+	
+	void Kernel::advanceSpreadRequests(State &state) {
+		FrameNum currentFrameNum = state.getCurrentFrameNum();
+		uint32_t numLevels = state.getNumSpreadRequests();
+		for (uint32_t level=0; level < numLevels; level++) {
+			SpreadRequest *spreadRequest = state.getSpreadRequest(level);
+			if (spreadRequest == NULL || !spreadRequest->busy()) continue;
+			
+			// Step i has to be done by its deadline, so at least (i + 1 - done) steps have to
+			// fit in the frames between now and then. Whichever step needs the fastest rate
+			// sets how many we do this time.
+			uint32_t numSteps = spreadRequest->getNumSteps();
+			uint32_t numStepsDone = spreadRequest->numStepsDone;
+			uint32_t numStepsNow = 0;
+			for (uint32_t i=numStepsDone; i < numSteps; i++) {
+				FrameNum deadline = spreadRequest->getDeadline(i);
+				uint32_t framesLeft = deadline > currentFrameNum ? deadline - currentFrameNum + 1 : 1;
+				uint32_t needed = (i + 1 - numStepsDone + framesLeft - 1) / framesLeft;
+				numStepsNow = std::max(numStepsNow, needed);
+			}
+			
+			for (uint32_t i=0; i < numStepsNow; i++) {
+				doSpreadStep(*spreadRequest, spreadRequest->numStepsDone++);
+			}
+			if (spreadRequest->numStepsDone == numSteps) spreadRequest->finish();
+		}
+	}
+	
+	void Kernel::doSpreadStep(SpreadRequest &spreadRequest, uint32_t stepNum) {
+		SplitFFT &fft = *spreadRequest.fft;
+		uint32_t numFFTSteps = fft.getNumSteps();
+		if (stepNum < numFFTSteps) {
+			fft.step(stepNum, getFFT(fft.getPhaseSize()), spreadRequest.spectrum);
+			return;
+		}
+		
+		ConvolutionOp &op = spreadRequest.request->getLazyConvolutions()[stepNum - numFFTSteps];
+		State &output = *op.output;
+		uint32_t freqBlockSize = spreadRequest.spectrum.size();
+		FreqBlock *accumulator = output.getAccumulator(op.outputConvolutionStartingAt - output.getCurrentFrameNum(), freqBlockSize);
+		assert(op.block->size() == freqBlockSize);
+		convolveAccumulate(spreadRequest.spectrum, *op.block, *accumulator, freqBlockSize);
+	}
+	
+	uint64_t Kernel::getDeadline(FrameRequest &frameRequest, FrameNum currentFrameNum, uint32_t frameSize) {
+		FrameNum dueFrame = 0;
+		bool first = true;
 		foreach(ConvolutionOp &op, frameRequest.getLazyConvolutions()) {
+			if (first || op.outputConvolutionStartingAt < dueFrame) dueFrame = op.outputConvolutionStartingAt;
+			first = false;
+		}
+		
+		// We pop currentFrameNum this callback, and another frame every frameSize samples after
+		double microsecondsPerFrame = 1000000.0 * frameSize / sampleRate;
+		uint64_t framesFromNow = dueFrame > currentFrameNum ? dueFrame - currentFrameNum : 0;
+		return WorkerPool::now() + (uint64_t)(framesFromNow * microsecondsPerFrame);
+	}
+	
+	void Kernel::multiplyAccumulate(FreqBlock &input, FreqBlock &filter, FreqBlock &accumulator) {
+		convolveAccumulate(input, filter, accumulator, input.size());
+	}
+	
+	void Kernel::process_convolutions_fdl(State &state) {
+		// The delay line holds everything we need, so we never look at old frames
+		state.frameBuffer->flushFramesBefore(state.getCurrentFrameNum());
+	}
+	
+	void Kernel::convolve(State &state, const TimeSample *samples, uint32_t numSamples, shared_ptr<FrameRequest> &frameRequest, FrameNum currentFrameNum, bool inWorkThread) {
+		FFT &fft = getFFT(numSamples * 2);
+		FreqBlock &signalBlock = getSignalSpectrum(fft.freqDomainSize);
+		fft.fftrPadded(samples, signalBlock);
+		uint32_t signalBlockSize = signalBlock.size();
+		
+		// Perform each ConvolutionOp, each one lands in the accumulators of its output
+		foreach(ConvolutionOp &op, frameRequest->getLazyConvolutions()) {
 			FreqBlock &filterBlock = *op.block;
+			State &output = *op.output;
 			
-			uint32_t outputConvolutionFramesFromNow = op.outputConvolutionStartingAt - currentFrameNum;
-			
-			if (inWorkThread) state.lockAccumulators("Kernel::convolve(thread)"); {
-				FrameNum currentFrame = state.getCurrentFrameNum();
-				if (currentFrame > op.outputConvolutionStartingAt) {
-					state.alertUnderrun();
-					if (inWorkThread) state.unlockAccumulators("Kernel::convolve(thread) underrun");
-					break;
-				}
-				
-				FreqBlock *accumulator = state.getAccumulator(outputConvolutionFramesFromNow, signalBlockSize);
+			// The accumulator we were handed outlives its slot, so even if its frame's gone
+			// out without us there's no harm adding into it. Only the workers wait on this lock.
+			if (inWorkThread) {
+				output.lockAccumulators("Kernel::convolve(thread)"); {
+					assert(filterBlock.size() == op.accumulator->block.size());
+					convolveAccumulate(signalBlock, filterBlock, op.accumulator->block, signalBlockSize);
+					output.workerDoneWith(op);
+				} output.unlockAccumulators("Kernel::convolve(thread)");
+				continue;
+			}
 			
-				#if DEBUG_CONVOLVE
-				cout << "\t\t\tdoing ConvolutionOp (" << (uint32_t)&(op) << "): outputting at frame " << op.outputConvolutionStartingAt << " from Accumulator(" << (uint32_t)&(*accumulator) << ")" << endl;				
-				#endif				
+			uint32_t outputConvolutionFramesFromNow = op.outputConvolutionStartingAt - output.getCurrentFrameNum();
+			FreqBlock *accumulator = output.getAccumulator(outputConvolutionFramesFromNow, signalBlockSize);
 			
-				assert(signalBlock.size() == filterBlock.size());
-				assert(filterBlock.size() == accumulator->size());
+			#if DEBUG_CONVOLVE
+			cout << "\t\t\tdoing ConvolutionOp (" << (uint32_t)&(op) << "): outputting at frame " << op.outputConvolutionStartingAt << " from Accumulator(" << (uint32_t)&(*accumulator) << ")" << endl;				
+			#endif				
 			
+			assert(signalBlock.size() == filterBlock.size());
+			assert(filterBlock.size() == accumulator->size());
 			
-				convolveAccumulate(signalBlock, filterBlock, *accumulator, signalBlockSize);
-
-				if (inWorkThread) {
-					int numFramesLeft = --state.workThreadFrameStatus[op.outputConvolutionStartingAt];
-					assert(numFramesLeft >= 0);
-					
-					if (currentFrame == op.outputConvolutionStartingAt && numFramesLeft == 0) {
-						state.sorryFinallydoneWithCurrentFrame();
-					}					
+			// Above the smallest partitions a worker may be adding into the same accumulator,
+			// and the audio thread never waits on one: if it's busy there, the op goes into a
+			// block of the output's own, to be added in once the worker's let go
+			bool sharedWithWorkers = getPartitionLevel(signalBlockSize) > 0;
+			if (sharedWithWorkers && !output.tryToLockAccumulators("Kernel::convolve()")) {
+				if (!output.defer(frameRequest, op, signalBlock)) {
+					cerr << "Kernel::convolve(): accumulators busy and nowhere to defer to, leaving a partition out" << endl;
+					output.addLatePartitions(1);
 				}
-			} if (inWorkThread) state.unlockAccumulators("Kernel::convolve(thread)");
+				continue;
+			}
+			convolveAccumulate(signalBlock, filterBlock, *accumulator, signalBlockSize);
+			if (sharedWithWorkers) output.unlockAccumulators("Kernel::convolve()");
 		}
 	}
 		
@@ -258,34 +492,62 @@ static void printComplex(Buffer buffer, int size, float scale) {
 	}
 }
 
-#include <typeinfo>
 
 void Convolver::Kernel::setBlockPattern(boost::shared_ptr<BlockPattern> &blockPattern) {
-	if (blockPattern != NULL) {
-		if (dynamic_cast<TwoSizeBlockPattern *>(&*blockPattern) != NULL) {
-#if DEBUG
-			cout << "Kernel::Kernel() Its a twoSizeBlockPattern" << endl;
-#endif
-			sizeZero = FFT::getFreqDomainSize(blockPattern->minimumBlockSize()*2);
-			sizeOne = FFT::getFreqDomainSize(blockPattern->maximumBlockSize()*2);
-		} else if (dynamic_cast<FixedSizeBlockPattern *> (&*blockPattern) != NULL) {
+	this->blockPattern = blockPattern;
+	partitionSizes.clear();
+	schedules.clear();
+	maxPartitionFrames = 1;
+	if (blockPattern == NULL) return;
+	
+	maxPartitionFrames = blockPattern->maximumBlockSize() / blockPattern->minimumBlockSize();
+	
+	// Walk the pattern until it settles on its biggest size, noting each new size
+	uint32_t maximumBlockSize = blockPattern->maximumBlockSize();
+	uint32_t lastBlockSize = 0;
+	uint32_t delay = 0;
+	for (uint32_t i=0; lastBlockSize != maximumBlockSize; i++) {
+		uint32_t blockSize = blockPattern->sizeForTimeBlock(i);
+		
+		if (blockSize != lastBlockSize) {
+			// We schedule partitions assuming each size divides the next one
+			if (blockSize < lastBlockSize || (lastBlockSize > 0 && blockSize % lastBlockSize != 0)) {
+				cerr << "Kernel::setBlockPattern(): " << blockPattern->toString() << " has block " << i << " of size " << blockSize;
+				cerr << " following size " << lastBlockSize << ", sizes must grow by whole multiples" << endl;
+				assert(false);
+			}
+			
+			// A partition can't owe output before all of its input has arrived
+			uint32_t numFrames = blockSize / blockPattern->minimumBlockSize();
+			if (delay + 1 < numFrames) {
+				cerr << "Kernel::setBlockPattern(): " << blockPattern->toString() << " starts size " << blockSize;
+				cerr << " after only " << delay << " frames, it needs at least " << numFrames - 1 << endl;
+				assert(false);
+			}
+			
+			partitionSizes.push_back(FFT::getFreqDomainSize(blockSize * 2));
+			lastBlockSize = blockSize;
+		}
+		
+		delay += blockSize / blockPattern->minimumBlockSize();
+	}
+	
 #if DEBUG
-			cout << "Kernel::Kernel() its a FixedSizeBlockPattern" << endl;
+	cout << "Kernel::setBlockPattern(): " << partitionSizes.size() << " partition sizes in " << blockPattern->toString() << endl;
 #endif
-			sizeZero = FFT::getFreqDomainSize(blockPattern->minimumBlockSize()*2);
-			sizeOne = 0;
-		} else {
-			// We don't support other patterns, yet.
-			assert(false);
-		}
-	} else {
-		sizeZero = 0;
-		sizeOne = 0;
-	}	
 }
 
+int Convolver::Kernel::getPartitionLevel(uint32_t freqDomainSize) {
+	uint32_t numLevels = partitionSizes.size();
+	for (uint32_t i=0; i < numLevels; i++) {
+		if (partitionSizes[i] == freqDomainSize) return i;
+	}
+	return -1;
+}
 
-Convolver::Kernel::Kernel(shared_ptr<BlockPattern> blockPattern)
+
+Convolver::Kernel::Kernel(shared_ptr<BlockPattern> blockPattern, Scheduler scheduler)
+	: sampleRate(44100.0f), skipLateWork(false), spreadLargePartitions(false), numMACs(0), latePolicy(LATE_MIX_LATE), scheduler(scheduler)
 {
 	setBlockPattern(blockPattern);
 	
@@ -296,7 +558,9 @@ Convolver::Kernel::Kernel(shared_ptr<BlockPattern> blockPattern)
 	
 #if DEBUG
 	cout << "Kernel::Kernel(): ";
-#if USE_SSE3
+#if USE_SSE3 && !USE_APPLE_ACCELERATE
+	cout << multiply_complex_name(multiply_complex_best()) << " enabled" << endl;
+#elif USE_SSE3
 	cout << "SSE3 enabled" << endl;
 #else
 	cout << "SSE3 disabled" << endl;
@@ -336,13 +600,17 @@ namespace Convolver {
 	
     typedef FreqSample * FreqSamplePtr;
     
+#if USE_SSE3
+	// Picked once from what the CPU supports: SSE3, AVX2+FMA or AVX-512
+	static MultiplyComplexFunction multiplyComplex = multiply_complex_best();
+#endif
+	
 inline static void convolveAccumulateSSE3(const FreqSample* input, const FreqSample* filter, __restrict__ FreqSamplePtr accumulator, int numSamples) {
 	int startAt;
 	
 	
 #if USE_SSE3
-	// FIXME: do we have an off-by-one error here?
-	startAt = multiply_complex_SSE3((float*)input, (float*)filter, (float*)accumulator, numSamples);
+	startAt = multiplyComplex((float*)input, (float*)filter, (float*)accumulator, numSamples);
 #else
 	startAt = 0;
 #endif
@@ -374,22 +642,42 @@ inline static void convolveAccumulateSSE3(const FreqSample* input, const FreqSam
 void Convolver::Kernel::convolveAccumulate(FreqBlock &input, FreqBlock &filter, FreqBlock &accumulator/*__restrict__ FreqSample* accumulator*/, int numSamples)
 {
 	#if DEBUG_CONVOLVE_STATS
-	if (numSamples == sizeZero) {
-			testCount[0]++;
-	} else if (numSamples == sizeOne) {
-			testCount[1]++;
-	}
+	convolveAccumulateCounts[numSamples]++;
 	#endif
 	
+	// Bins outside the filter's band don't add anything worth the multiply
+	uint32_t filterFirstBin, filterNumBins;
+	filter.getBinRange(filterFirstBin, filterNumBins);
+	int firstBin = std::min<int>(filterFirstBin, numSamples);
+	int numBins = std::min<int>(filterNumBins, numSamples - firstBin);
+	
 #if USE_APPLE_ACCELERATE
 	assert(input.splitComplexNumComplex == numSamples - 1);
-	convolveAccumulateAppleAccelerate(input.dspSplitComplex(), filter.dspSplitComplex(), accumulator.dspSplitComplex(), numSamples - 1);
+	// Packed, so the last bin's folded into the first
+	numBins = std::min(numBins, numSamples - 1 - firstBin);
+#endif
+	if (numBins > 0) numMACs += numBins;
+	
+#if USE_APPLE_ACCELERATE
+	DSPSplitComplex in = {input.dspSplitComplex()->realp + firstBin, input.dspSplitComplex()->imagp + firstBin};
+	DSPSplitComplex filt = {filter.dspSplitComplex()->realp + firstBin, filter.dspSplitComplex()->imagp + firstBin};
+	DSPSplitComplex acc = {accumulator.dspSplitComplex()->realp + firstBin, accumulator.dspSplitComplex()->imagp + firstBin};
+	convolveAccumulateAppleAccelerate(&in, &filt, &acc, numBins);
 #else
-	convolveAccumulateSSE3(input.cArrayUnpacked(), filter.cArrayUnpacked(), accumulator.cArrayUnpacked(), numSamples);	
+	convolveAccumulateSSE3(input.cArrayUnpacked() + firstBin, filter.cArrayUnpacked() + firstBin, accumulator.cArrayUnpacked() + firstBin, numBins);	
 #endif
 }
 
 
+Convolver::FreqBlock &Convolver::Kernel::getSignalSpectrum(uint32_t freqDomainSize) {
+	map<uint32_t, shared_ptr<FreqBlock> >::iterator result = signalSpectra.find(freqDomainSize);
+	if (result != signalSpectra.end()) return *result->second;
+	
+	shared_ptr<FreqBlock> spectrum(new FreqBlock(freqDomainSize));
+	signalSpectra[freqDomainSize] = spectrum;
+	return *spectrum;
+}
+
 Convolver::FFT &Convolver::Kernel::getFFT(uint32_t timeDomainSize) {
 	map<uint32_t, shared_ptr<FFT> >::iterator result = fftSizeToFFT.find(timeDomainSize);
 	
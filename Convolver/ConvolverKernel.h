@@ -12,6 +12,7 @@
 
 namespace Convolver {
 	class Kernel;
+	class SpreadRequest;
 }
 
 #include "ConvolverTypes.h"
@@ -19,6 +20,7 @@ namespace Convolver {
 #include "ConvolverFilter.h"
 #include "ConvolverSignal.h"
 #include "ConvolverFFT.h"
+#include "ConvolverSchedule.h"
 
 #include <list>
 #include <vector>
@@ -31,37 +33,123 @@ namespace Convolver {
 	
 	class Kernel {
 	public:
-		Kernel(shared_ptr<BlockPattern> blockPattern = shared_ptr<BlockPattern>());
+		// FRAME_REQUESTS handles any BlockPattern and can offload to worker threads.
+		// FDL is the classic uniformly partitioned frequency-domain delay line: one FFT
+		// and one IFFT per frame, and a single MAC sweep over the filter partitions.
+		// It needs a FixedSizeBlockPattern and always runs on the calling thread.
+		typedef enum {
+			SCHEDULER_FRAME_REQUESTS,
+			SCHEDULER_FDL
+		} Scheduler;
+		
+		Kernel(shared_ptr<BlockPattern> blockPattern = shared_ptr<BlockPattern>(), Scheduler scheduler = SCHEDULER_FRAME_REQUESTS);
 		~Kernel();
 		
 		void setBlockPattern(boost::shared_ptr<BlockPattern> &blockPattern);
+		void setScheduler(Scheduler scheduler) { this->scheduler = scheduler; }
+		Scheduler getScheduler() { return scheduler; }
+		
+		// Work we hand to the WorkerPool gets a deadline in real time, so the workers can put
+		// jobs from Convolvers with different frame sizes (or sample rates) in one order
+		void setSampleRate(float sampleRate) { this->sampleRate = sampleRate; }
+		float getSampleRate() { return sampleRate; }
+		// Playing live, a worker that wouldn't finish a partition in time skips it (leaving
+		// it out of the output) rather than keep the audio thread waiting. Rendering
+		// offline we're never really late, so leave it off.
+		void setSkipLateWork(bool skipLateWork) { this->skipLateWork = skipLateWork; }
+		
+		// Without worker threads, rather than do a big partition's transform and MACs all on
+		// the callback it comes due, do a slice of it every callback until its output's needed,
+		// so each callback costs about the same. It's only worth anything with a BlockPattern
+		// that leaves the big partitions some slack, e.g. a TwoSizeBlockPattern whose small
+		// blocks cover twice the big size.
+		void setSpreadLargePartitions(bool spreadLargePartitions) { this->spreadLargePartitions = spreadLargePartitions; }
+		// Complex bins this Kernel has multiplied into accumulators so far. Unlike the clock,
+		// the difference across a callback says exactly how much work it did. Each worker
+		// has a Kernel of its own, so it's only ever touched by the thread driving us.
+		uint64_t getNumMACs() { return numMACs; }
+		
+		// What State::pop() does about a partition the workers haven't finished in time.
+		// LATE_WAIT blocks the audio thread until it's done, which is only any good offline,
+		// where every partition has to be there and nobody's listening as it's rendered.
+		// LATE_DROP puts out whatever's been accumulated and leaves the rest out.
+		// LATE_MIX_LATE (the default) puts the partition in as soon as it's done, lined up
+		// with where it should have been, so only the frames that already went out miss it.
+		typedef enum {
+			LATE_WAIT,
+			LATE_DROP,
+			LATE_MIX_LATE
+		} LatePolicy;
+		void setLatePolicy(LatePolicy latePolicy) { this->latePolicy = latePolicy; }
+		LatePolicy getLatePolicy() { return latePolicy; }
 		
 		// Easy to use function: inFrame -> outFrame
 		shared_ptr<TimeBlock> convolve(shared_ptr<TimeBlock> &frame, Filter &filter, State &state);
 		
 		void schedule_convolution(Filter &filter, State &state);		
-		// More sophisticated function designed for manual handling of channel state
+		// Convolve input's signal with filter, adding the result into output's accumulators.
+		// Ops that read the same input share its spectra, whichever output they go to.
+		void schedule_convolution(Filter &filter, State &input, State &output);
+		// More sophisticated function designed for manual handling of channel state. Called
+		// on each input; when threaded, every output it feeds must be locked beforehand.
 		void process_convolutions(State &state, bool useThread=false);
 		
 				
 		FFT &getFFT(uint32_t timeDomainSize);
 		FFT &getFFTI(uint32_t freqDomainSize);
 		
+		// Distinct partition sizes (freq domain) in our BlockPattern, smallest first.
+		// Level 0 is always done on the audio thread, everything above it may be offloaded.
+		const std::vector<uint32_t> &getPartitionSizes() { return partitionSizes; }
+		int getPartitionLevel(uint32_t freqDomainSize);
+		
 		static float *zeroPad(const float *signal, uint32_t signalLength, uint32_t targetLength);
 		
 	protected:
-		// Thread-safe function, not for general use, for use by State threads
-		void convolve(State &state, TimeBlock &block, FrameRequest &request, FrameNum currentFrameNum, bool lockAccumulators=false);
+		// Thread-safe function, not for general use, for use by the WorkerPool
+		// samples is numSamples of unpadded input, e.g. straight out of the FrameBuffer.
+		// In a work thread, each op adds into the accumulator it was queued with.
+		void convolve(State &state, const TimeSample *samples, uint32_t numSamples, shared_ptr<FrameRequest> &request, FrameNum currentFrameNum, bool inWorkThread=false);
 		friend class State;
+		friend class WorkerPool;
+		
+		// accumulator += input * filter, for the Tuner to time
+		void multiplyAccumulate(FreqBlock &input, FreqBlock &filter, FreqBlock &accumulator);
+		friend class Tuner;
 		
 	private:
+		void schedule_convolution_fdl(Filter &filter, State &input, State &output);
+		void process_convolutions_fdl(State &state);
+		void convolveHead(Filter &filter, State &input, State &output);
+		// Compiled the first time a filter this long shows up
+		const Schedule &getSchedule(uint32_t numBlocks);
+		// Where convolve() transforms a request's input, one per size, reused every time
+		FreqBlock &getSignalSpectrum(uint32_t freqDomainSize);
+		// Without threads, frameRequest gets done a step at a time by advanceSpreadRequests()
+		void spreadRequest(State &state, int level, shared_ptr<FrameRequest> &frameRequest, const TimeSample *samples, uint32_t numSamples);
+		// Does as few steps of each of state's spread requests as keeps every one on time
+		void advanceSpreadRequests(State &state);
+		void doSpreadStep(SpreadRequest &spreadRequest, uint32_t stepNum);
+		// When the first output frameRequest feeds gets popped, on the WorkerPool's clock
+		uint64_t getDeadline(FrameRequest &frameRequest, FrameNum currentFrameNum, uint32_t frameSize);
+		
 		inline void convolveAccumulate(FreqBlock &input, FreqBlock &filter, FreqBlock &accumulator/*__restrict__ FreqSample* accumulator*/, int numSamples);
 		boost::timer timer;
 		std::map<uint32_t, boost::shared_ptr<FFT> > fftSizeToFFT;
+		std::map<uint32_t, boost::shared_ptr<FreqBlock> > signalSpectra;
+		
+		std::vector<uint32_t> partitionSizes;
+		boost::shared_ptr<BlockPattern> blockPattern;
+		std::map<uint32_t, boost::shared_ptr<Schedule> > schedules;
+		// Frames in the biggest partition
+		uint32_t maxPartitionFrames;
 		
-		// FIXME: we're hardcoded to two block sizes here, that sortof sucks
-		uint32_t sizeZero;
-		uint32_t sizeOne;
+		float sampleRate;
+		bool skipLateWork;
+		bool spreadLargePartitions;
+		uint64_t numMACs;
+		LatePolicy latePolicy;
+		Scheduler scheduler;
 	};
 };
 
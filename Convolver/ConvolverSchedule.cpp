@@ -0,0 +1,64 @@
+/*
+ *  ConvolverSchedule.cpp
+ *  Convolvotron
+ *
+ *  Created by Seth Nickell on 10/18/09.
+ *  Copyright 2009 Meatscience. All rights reserved.
+ *
+ */
+
+#include "ConvolverSchedule.h"
+#include "DebugSettings.h"
+
+#include <iostream>
+#include <assert.h>
+
+using std::cout;
+using std::cerr;
+using std::endl;
+
+Convolver::Schedule::Schedule(BlockPattern &blockPattern, uint32_t numBlocks)
+	: numBlocks(numBlocks), period(1)
+{
+	uint32_t frameSize = blockPattern.minimumBlockSize();
+
+	uint32_t delay = 0;
+	for (uint32_t i=0; i < numBlocks; i++) {
+		uint32_t blockSize = blockPattern.sizeForTimeBlock(i);
+		if (blockSize % frameSize != 0) {
+			cerr << "Schedule::Schedule(): block size " << blockSize << " is not a multiple of " << frameSize << endl;
+			assert(blockSize % frameSize == 0);
+		}
+		uint32_t numFrames = blockSize / frameSize;
+
+		// The request finishes on the last of its frames, it better not owe output before that
+		assert(delay + 1 >= numFrames);
+
+		if (levels.empty() || levels.back().numFrames != numFrames) {
+			// Each size has to tile the input in step with the ones before it
+			assert(levels.empty() || numFrames % levels.back().numFrames == 0);
+
+			Level level;
+			level.numFrames = numFrames;
+			levels.push_back(level);
+			period = numFrames;
+		}
+
+		Partition partition = {i, delay};
+		levels.back().partitions.push_back(partition);
+
+		delay += numFrames;
+	}
+
+	// Every level divides the period, so each one lands on the same slots every time round
+	table.resize(period);
+	for (uint32_t frame=0; frame < period; frame++) {
+		for (uint32_t levelNum=0; levelNum < levels.size(); levelNum++) {
+			if ((frame + 1) % levels[levelNum].numFrames == 0) table[frame].push_back(levelNum);
+		}
+	}
+
+#if DEBUG
+	cout << "Schedule::Schedule(): " << numBlocks << " partitions in " << levels.size() << " levels, repeating every " << period << " frames" << endl;
+#endif
+}
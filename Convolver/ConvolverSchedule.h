@@ -0,0 +1,63 @@
+/*
+ *  ConvolverSchedule.h
+ *  Convolvotron
+ *
+ *  Created by Seth Nickell on 10/18/09.
+ *  Copyright 2009 Meatscience. All rights reserved.
+ *
+ */
+
+#ifndef _ConvolverSchedule_h__
+#define _ConvolverSchedule_h__
+
+#include <stdint.h>
+
+namespace Convolver {
+	class Schedule;
+	typedef uint64_t FrameNum;
+}
+
+#include "ConvolverTypes.h"
+#include <vector>
+
+namespace Convolver {
+	using std::vector;
+
+	// Which partitions of a filter are due on which frame only depends on the BlockPattern
+	// and how many partitions the filter has, and it repeats every getPeriod() frames. So we
+	// work it out once, and each frame the scheduler just looks up frameNum % period.
+	//
+	// A level is every partition of one size. A level of N frames has all the input it needs
+	// on the last frame of each run of N, i.e. when (frameNum + 1) % N == 0.
+	class Schedule {
+	public:
+		Schedule(BlockPattern &blockPattern, uint32_t numBlocks);
+
+		typedef struct Partition {
+			uint32_t blockNum;
+			// Frames from the first frame of the request to the output frame it lands on
+			uint32_t delay;
+		} Partition;
+
+		typedef struct Level {
+			uint32_t numFrames;
+			// In blockNum order
+			vector<Partition> partitions;
+		} Level;
+
+		// Levels (smallest first) whose requests end on frameNum
+		inline const vector<uint32_t> &levelsDueOn(FrameNum frameNum) const { return table[frameNum % period]; }
+		inline const Level &getLevel(uint32_t levelNum) const { return levels[levelNum]; }
+		inline uint32_t getNumLevels() const { return levels.size(); }
+		inline uint32_t getNumBlocks() const { return numBlocks; }
+		inline uint32_t getPeriod() const { return period; }
+
+	private:
+		vector<Level> levels;
+		vector<vector<uint32_t> > table;
+		uint32_t numBlocks;
+		uint32_t period;
+	};
+};
+
+#endif
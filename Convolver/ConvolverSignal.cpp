@@ -11,6 +11,7 @@
 #include "ConvolverInternal.h"
 
 #include <iostream>
+#include <algorithm>
 
 using std::vector;
 using boost::shared_ptr;
@@ -23,16 +24,18 @@ using std::endl;
 namespace Convolver {
 
 	Signal::Signal(Convolver::Kernel &kernel, shared_ptr<BlockPattern> &blockPattern, 
-				   const TimeSample *samplesTimeDomain, uint32_t numSamples)
+				   const TimeSample *samplesTimeDomain, uint32_t numSamples, uint32_t numBlocksToPrepare)
+		: emptyBlockThreshold(-120.0f), bandLimitThreshold(-90.0f), numPreparedBlocks(0), numHeadBlocks(0), head(0), scaledBy(1.0f)
 	{	
-		initialize(kernel, blockPattern, samplesTimeDomain, numSamples);
+		initialize(kernel, blockPattern, samplesTimeDomain, numSamples, numBlocksToPrepare);
 	}
 	
 	void Signal::initialize(Kernel &kernel, boost::shared_ptr<BlockPattern> &blockPattern, 
-							const TimeSample *samplesTimeDomain, uint32_t numSamples)
+							const TimeSample *samplesTimeDomain, uint32_t numSamples, uint32_t numBlocksToPrepare)
 	{
 		this->blockPattern = blockPattern;
 		rawBlocks.clear();
+		blockEnergies.clear();
 		
 		// THERE'S A BUG IN HERE... what size are things supposed to be? do we want
 		// fftSize to be 2x timeSize?
@@ -42,6 +45,8 @@ namespace Convolver {
 		bool reserved = false;
 		timeSize = 0;
 		
+		// Measuring every partition first means which are empty, and how far the band limits
+		// can go, is known before any of them are transformed
 		while(samplesHandled < numSamples) {
 			uint32_t blockSize = blockPattern->sizeForTimeBlock(block);
 			timeSize += blockSize;
@@ -54,23 +59,161 @@ namespace Convolver {
 				reserved = true;
 			}
 			
-			// Zero pad the input signal (to the fftsize, but also for the last roundoff
 			uint32_t numSamplesLeft = numSamples - samplesHandled;
 			uint32_t numRealSamplesInBlock = std::min(blockSize, numSamplesLeft);
+			
+			double energy = 0.0;
+			for (uint32_t i=0; i < numRealSamplesInBlock; i++) {
+				energy += samplesTimeDomain[samplesHandled + i] * samplesTimeDomain[samplesHandled + i];
+			}
+			blockEnergies.push_back(energy);
+			
+			// Silent till prepareBlocks() gets to it
+			shared_ptr<FreqBlock> freqBlock(new FreqBlock(FFT::getFreqDomainSize(fftSize)));
+			freqBlock->setBinRange(0, 0);
+			rawBlocks.push_back(freqBlock);
+			
+			samplesHandled += blockSize;
+			block++;
+		}
+		blocks = rawBlocks;		
+		numPreparedBlocks = 0;
+		
+		scaledBy = 1.0f;
+		initializeHead(samplesTimeDomain, numSamples);
+		findEmptyBlocks();
+		prepareBlocks(kernel, samplesTimeDomain, numSamples, numBlocksToPrepare);
+	}
+	
+	uint32_t Signal::prepareBlocks(Kernel &kernel, const TimeSample *samplesTimeDomain, uint32_t numSamples, uint32_t numBlocks) {
+		uint32_t numBlocksLeft = rawBlocks.size() - numPreparedBlocks;
+		uint32_t end = numPreparedBlocks + std::min(numBlocks, numBlocksLeft);
+		double threshold = getBandLimitBudget();
+		
+		uint32_t samplesHandled = 0;
+		for (uint32_t i=0; i < numPreparedBlocks; i++) samplesHandled += blockPattern->sizeForTimeBlock(i);
+		
+		for (uint32_t blockNum=numPreparedBlocks; blockNum < end; blockNum++) {
+			uint32_t blockSize = blockPattern->sizeForTimeBlock(blockNum);
+			uint32_t fftSize = blockSize * 2;
+			
+			// Zero pad the input signal (to the fftsize, but also for the last roundoff
+			uint32_t numRealSamplesInBlock = std::min(blockSize, numSamples - samplesHandled);
 			float *inputTimeDomainPadded = Convolver::Kernel::zeroPad(&samplesTimeDomain[samplesHandled], numRealSamplesInBlock, fftSize);
 			
 			// Do the FFT
 			FFT &fft = kernel.getFFT(fftSize);
-			shared_ptr<FreqBlock> freqBlock(fft.fftr(inputTimeDomainPadded, fftSize));
-			rawBlocks.push_back(freqBlock);
-			
+			shared_ptr<FreqBlock> spectrum(fft.fftr(inputTimeDomainPadded, fftSize));
+			spectrum->scale(scaledBy);
+			delete[] inputTimeDomainPadded;
 			
-			delete[] inputTimeDomainPadded;			
+			// Nobody reads the bins till there's a range to read, setting it publishes them
+			rawBlocks[blockNum]->copyFrom(*spectrum);
+			findBandLimits(blockNum, threshold);
 			
 			samplesHandled += blockSize;
-			block++;
 		}
-		blocks = rawBlocks;		
+		numPreparedBlocks = end;
+		
+		return rawBlocks.size() - numPreparedBlocks;
+	}
+	
+	void Signal::setEmptyBlockThreshold(float thresholdDecibels) {
+		emptyBlockThreshold = thresholdDecibels;
+		findEmptyBlocks();
+	}
+	
+	void Signal::setBandLimitThreshold(float thresholdDecibels) {
+		bandLimitThreshold = thresholdDecibels;
+		findBandLimits();
+	}
+	
+	double Signal::getBandLimitBudget() {
+		double totalEnergy = 0.0;
+		foreach(float energy, blockEnergies) totalEnergy += energy;
+		// Split evenly, so all of them together stay under the threshold
+		return totalEnergy * pow(10.0, bandLimitThreshold / 10.0) / std::max<size_t>(rawBlocks.size(), 1);
+	}
+	
+	void Signal::findBandLimits() {
+		double threshold = getBandLimitBudget();
+		for (uint32_t blockNum=0; blockNum < numPreparedBlocks; blockNum++) {
+			findBandLimits(blockNum, threshold);
+		}
+		
+		#if DEBUG
+		uint32_t numBinsKept = 0, numBins = 0;
+		for (uint32_t blockNum=0; blockNum < numPreparedBlocks; blockNum++) {
+			numBinsKept += rawBlocks[blockNum]->getNumBins();
+			numBins += rawBlocks[blockNum]->size();
+		}
+		cout << "Signal::findBandLimits(): multiplying " << numBinsKept << " of " << numBins << " bins" << endl;
+		#endif
+	}
+	
+	void Signal::findBandLimits(uint32_t blockNum, double threshold) {
+		FreqBlock *block = rawBlocks[blockNum].get();
+		uint32_t size = block->size();
+#if USE_APPLE_ACCELERATE
+		block->setBinRange(0, size);
+#else
+		FreqSample *bins = block->cArrayUnpacked();
+		
+		// Each bin's share of the partition's time domain energy (Parseval), whatever the
+		// blocks are scaled by. Everything but DC and Nyquist stands in for its mirror image too.
+		double freqEnergy = 0.0;
+		for (uint32_t i=0; i < size; i++) {
+			freqEnergy += (bins[i].r * bins[i].r + bins[i].i * bins[i].i) * (i == 0 || i == size - 1 ? 1.0 : 2.0);
+		}
+		double toTimeEnergy = freqEnergy > 0.0 ? blockEnergies[blockNum] / freqEnergy : 0.0;
+		
+		double trimmed = 0.0;
+		uint32_t end = size;
+		while (end > 0) {
+			FreqSample &bin = bins[end - 1];
+			double energy = (bin.r * bin.r + bin.i * bin.i) * toTimeEnergy * (end == size ? 1.0 : 2.0);
+			if (trimmed + energy > threshold) break;
+			trimmed += energy;
+			end--;
+		}
+		
+		uint32_t start = 0;
+		while (start < end) {
+			FreqSample &bin = bins[start];
+			double energy = (bin.r * bin.r + bin.i * bin.i) * toTimeEnergy * (start == 0 ? 1.0 : 2.0);
+			if (trimmed + energy > threshold) break;
+			trimmed += energy;
+			start++;
+		}
+		
+		block->setBinRange(start, end - start);
+#endif
+	}
+	
+	void Signal::findEmptyBlocks() {
+		double totalEnergy = 0.0;
+		foreach(float energy, blockEnergies) totalEnergy += energy;
+		double threshold = totalEnergy * pow(10.0, emptyBlockThreshold / 10.0);
+		
+		emptyBlocks.resize(blockEnergies.size());
+		for (uint32_t i=0; i < blockEnergies.size(); i++) {
+			emptyBlocks[i] = blockEnergies[i] <= threshold;
+		}
+		
+		#if DEBUG
+		cout << "Signal::findEmptyBlocks(): " << std::count(emptyBlocks.begin(), emptyBlocks.end(), true) << " of " << blockEnergies.size() << " partitions are empty" << endl;
+		#endif
+	}
+	
+	void Signal::initializeHead(const TimeSample *samplesTimeDomain, uint32_t numSamples) {
+		uint32_t headSize = 0;
+		for (uint32_t i=0; i < numHeadBlocks; i++) {
+			headSize += blockPattern->sizeForTimeBlock(i);
+		}
+		
+		head.assign(headSize, 0.0f);
+		std::copy(samplesTimeDomain, samplesTimeDomain + std::min(headSize, numSamples), head.begin());
+		head.scale(scaledBy);
 	}
 
 	
@@ -90,6 +233,8 @@ namespace Convolver {
 		foreach(shared_ptr<FreqBlock> &block, blocks) {
 			block->scale(scale);
 		}
+		head.scale(scale);
+		scaledBy *= scale;
 	}
 	
 	void Signal::print (float scale) {
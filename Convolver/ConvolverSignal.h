@@ -22,8 +22,12 @@ namespace Convolver {
 namespace Convolver {
 	class Signal {
 	public:
+		static const uint32_t allBlocks = 0xFFFFFFFF;
+		
+		// Every partition's laid out and measured up front, but only the first
+		// numBlocksToPrepare get transformed, see prepareBlocks()
 		Signal(Kernel &kernel, boost::shared_ptr<BlockPattern> &blockPattern, 
-			   const TimeSample *samplesTimeDomain, uint32_t numSamples);
+			   const TimeSample *samplesTimeDomain, uint32_t numSamples, uint32_t numBlocksToPrepare=allBlocks);
 		~Signal();
 
 		void			modify_Scale	(float factor);
@@ -32,9 +36,39 @@ namespace Convolver {
 		virtual std::vector< boost::shared_ptr<FreqBlock> > &getBlocks();
 		virtual uint32_t getTimeSize() { return timeSize; }
 		
+		// The first numHeadBlocks partitions can be done as a direct FIR instead of through
+		// the FFT, getHead() has their taps (scaled like the blocks are). getBlocks() still
+		// has every partition, the Kernel just skips the head ones.
+		uint32_t getNumHeadBlocks() { return numHeadBlocks; }
+		TimeBlock &getHead() { return head; }
+		
+		// Partitions with less than thresholdDecibels (negative) of the whole signal's energy,
+		// e.g. pre-delay or the dregs of a tail, are empty and the Kernel doesn't MAC them.
+		// Silent partitions are always empty.
+		void setEmptyBlockThreshold(float thresholdDecibels);
+		inline bool isBlockEmpty(uint32_t blockNum) { return emptyBlocks[blockNum]; }
+		// Sum of the partition's squared samples, before any scaling
+		inline float getBlockEnergy(uint32_t blockNum) { return blockEnergies[blockNum]; }
+		
+		// Trims each partition's bins (see FreqBlock::setBinRange()), highest first, as long
+		// as what's trimmed off every partition together holds less than thresholdDecibels
+		// (negative) of the whole signal's energy. Quiet late partitions lose the most, they
+		// don't have far to fall.
+		void setBandLimitThreshold(float thresholdDecibels);
+		
+		// Partitions that haven't been prepared yet multiply as silence
+		inline uint32_t getNumPreparedBlocks() { return numPreparedBlocks; }
+		inline bool isPrepared() { return numPreparedBlocks == rawBlocks.size(); }
+		
 	protected:
 		void initialize(Kernel &kernel, boost::shared_ptr<BlockPattern> &blockPattern, 
-						const TimeSample *samplesTimeDomain, uint32_t numSamples);
+						const TimeSample *samplesTimeDomain, uint32_t numSamples, uint32_t numBlocksToPrepare=allBlocks);
+		// Transforms (and scales, and band limits) the next numBlocks partitions, returns how
+		// many are left. Each one's bins are filled in while its range is still empty, then
+		// the range is set, so the Kernel can be convolving with us on another thread all
+		// along: a partition joins in for whatever input it's multiplied with after that.
+		// kernel's FFTs get used on the calling thread, so it mustn't be the audio thread's.
+		uint32_t prepareBlocks(Kernel &kernel, const TimeSample *samplesTimeDomain, uint32_t numSamples, uint32_t numBlocks);
 		
 		
 		std::vector< boost::shared_ptr<FreqBlock> > blocks;
@@ -43,6 +77,21 @@ namespace Convolver {
 		boost::shared_ptr<BlockPattern> blockPattern;
 		
 		uint32_t timeSize;
+		
+		void initializeHead(const TimeSample *samplesTimeDomain, uint32_t numSamples);
+		void findEmptyBlocks();
+		void findBandLimits();
+		void findBandLimits(uint32_t blockNum, double threshold);
+		double getBandLimitBudget();
+		std::vector<float> blockEnergies;
+		std::vector<bool> emptyBlocks;
+		float emptyBlockThreshold;
+		float bandLimitThreshold;
+		uint32_t numPreparedBlocks;
+		
+		uint32_t numHeadBlocks;
+		TimeBlock head;
+		float scaledBy;
 	};
 };
 
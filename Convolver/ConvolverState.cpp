@@ -10,125 +10,259 @@
 #include "ConvolverState.h"
 #include "ConvolverInternal.h"
 
-#include <mach/thread_policy.h>
+#include <time.h>
 
 using std::vector;
 using std::list;
 using boost::shared_ptr;
 
-namespace Convolver {
-	static void *workerThreadEntry(void *arguments) {
-		State &state = *(State *)arguments;
-		state.workThreadLoop();
-		#if DEBUG
-		cout << "workerThreadEntry() THREAD EXITING" << endl;
-		#endif
-		return NULL;
+void Convolver::State::setBlockPattern(boost::shared_ptr<BlockPattern> &blockPattern) {
+	frameSize = blockPattern->minimumBlockSize();
+	timeAccumulator.setFrameSize(frameSize);
+	
+	// Frames are a different size now, but keep counting where we left off
+	if (frameBuffer->getFrameSize() != frameSize) {
+		frameBuffer.reset(new FrameBuffer(frameSize, frameBuffer->getFrameNum()));
+		frameRequests.reset(new FrameRequests(frameBuffer->getFrameNum() - 1));
+		freqAccumulators = FreqAccumulators(frameSize);
+		forgetDeferred();
 	}
 	
-	void State::workThreadLoop() {
-		Kernel kernel;
+	// The spectra we were remembering are the wrong size now
+	frequencyDelayLine.reset();
+	inputHistory.reset();
+	headAccumulator.reset();
+	uniformAccumulator.reset();
+	spreadRequests.clear();
+	reserveJobInputs(*blockPattern);
+}
 
-		State::WorkItem *item;
-		while (this->workThreadRunning) {
-			bool gotData;
-			timespec foo = {0, 666666};			
-			
-			gotData = this->workItems->pop(item);
-			if (gotData) {
-				//cout << "Got data" << endl;
-				#if DEBUG_CONVOLVE
-				cout << "Worker thread got data, processing:" << endl;
-				#endif
-				
-				shared_ptr<TimeBlock> &timeBlock = item->get<0>();
-				shared_ptr<FrameRequest> &request = item->get<1>();
-				FrameNum &frameNum = item->get<2>();
-				
-				bool lockAccumulators = true;
-				kernel.convolve(*this, *timeBlock, *request, frameNum, lockAccumulators);
-				
-				delete item;
-				
-				#if DEBUG_CONVOLVE
-				cout << "Done worker thread work" << endl;
-				#endif
+void Convolver::State::reserveJobInputs(BlockPattern &blockPattern) {
+	jobInputs.clear();
+	
+	// The smallest partitions never leave the audio thread
+	uint32_t maximumBlockSize = blockPattern.maximumBlockSize();
+	uint32_t lastBlockSize = blockPattern.minimumBlockSize();
+	for (uint32_t i=0; lastBlockSize != maximumBlockSize; i++) {
+		uint32_t blockSize = blockPattern.sizeForTimeBlock(i);
+		if (blockSize == lastBlockSize) continue;
+		
+		for (uint32_t j=0; j < kJobInputsPerSize; j++) {
+			jobInputs.push_back(shared_ptr<TimeBlock>(new TimeBlock(blockSize)));
+		}
+		lastBlockSize = blockSize;
+	}
+}
+
+shared_ptr<Convolver::TimeBlock> *Convolver::State::getJobInput(uint32_t numSamples) {
+	foreach(shared_ptr<TimeBlock> &jobInput, jobInputs) {
+		if (jobInput->size() == numSamples && jobInput.unique()) return &jobInput;
+	}
+	return NULL;
+}
+
+void Convolver::State::addAccumulatorNeeds(AccumulatorNeeds &needs, BlockPattern &blockPattern, Filter &filter) {
+	vector<shared_ptr<FreqBlock> > &blocks = filter.getBlocks();
+	uint32_t numHeadBlocks = filter.getNumHeadBlocks();
+	
+	// A request's ops are added in the frame it ends on at the latest, and the furthest
+	// ahead of that one lands is its delay less the frames it took to fill
+	Schedule schedule(blockPattern, blocks.size());
+	for (uint32_t levelNum=0; levelNum < schedule.getNumLevels(); levelNum++) {
+		const Schedule::Level &level = schedule.getLevel(levelNum);
+		foreach(const Schedule::Partition &partition, level.partitions) {
+			if (partition.blockNum < numHeadBlocks) continue;
+			uint32_t framesFromNow = partition.delay + 1 - level.numFrames;
+			uint32_t &need = needs[blocks[partition.blockNum]->size()];
+			need = std::max(need, framesFromNow);
+		}
+	}
+}
+
+void Convolver::State::addAccumulatorNeeds(AccumulatorNeeds &needs, const AccumulatorNeeds &more) {
+	for (AccumulatorNeeds::const_iterator i = more.begin(); i != more.end(); ++i) {
+		uint32_t &need = needs[i->first];
+		need = std::max(need, i->second);
+	}
+}
+
+void Convolver::State::reserveAccumulators(const AccumulatorNeeds &needs) {
+	uint32_t numFrames = 1;
+	for (AccumulatorNeeds::const_iterator i = needs.begin(); i != needs.end(); ++i) {
+		freqAccumulators.reserve(i->first, i->second);
+		numFrames = std::max(numFrames, FFT::getTimeDomainSize(i->first) / frameSize);
+		
+		uint32_t numDeferrals = 0;
+		foreach(shared_ptr<Deferral> &deferral, deferrals) {
+			if (deferral->spectrum.size() == i->first) numDeferrals++;
+		}
+		for (; numDeferrals < kDeferralsPerSize; numDeferrals++) {
+			deferrals.push_back(shared_ptr<Deferral>(new Deferral(i->first)));
+		}
+	}
+	
+	// Each one adds its whole transform in at once
+	timeAccumulator.reserve(numFrames);
+}
+
+void Convolver::State::reserveAccumulators(BlockPattern &blockPattern, Filter &filter) {
+	AccumulatorNeeds needs;
+	addAccumulatorNeeds(needs, blockPattern, filter);
+	reserveAccumulators(needs);
+}
+
+bool Convolver::State::defer(shared_ptr<FrameRequest> &request, ConvolutionOp &op, FreqBlock &spectrum) {
+	// Every op from the same request shares its spectrum
+	Deferral *unused = NULL;
+	foreach(shared_ptr<Deferral> &deferral, deferrals) {
+		if (deferral->request == request) {
+			op.deferred = true;
+			return true;
+		}
+		if (deferral->request == NULL && deferral->spectrum.size() == spectrum.size() && unused == NULL) unused = &*deferral;
+	}
+	if (unused == NULL) return false;
+	
+	unused->spectrum.copyFrom(spectrum);
+	unused->request = request;
+	op.deferred = true;
+	numDeferralsUsed++;
+	return true;
+}
+
+void Convolver::State::addDeferred() {
+	if (numDeferralsUsed == 0) return;
+	
+	// Still busy, we'll be back next callback
+	if (!tryToLockAccumulators("State::addDeferred()")) return;
+	foreach(shared_ptr<Deferral> &deferral, deferrals) {
+		if (deferral->request == NULL) continue;
+		
+		foreach(ConvolutionOp &op, deferral->request->getLazyConvolutions()) {
+			if (!op.deferred || op.output != this) continue;
+			FreqBlock *accumulator = freqAccumulators.find(op.block->size(), op.outputConvolutionStartingAt);
+			if (accumulator != NULL) {
+				convolver.multiplyAccumulate(deferral->spectrum, *op.block, *accumulator);
 			} else {
-				pthread_cond_wait(&workAvailable, &workAvailableMutex);
-				// yield
-				//nanosleep(&foo, NULL);
-				//sched_yield();
+				// Its frame went out without it
+				addLatePartitions(1);
 			}
+			op.deferred = false;
 		}
-		cout << "State::workerThread(): thread exiting" << endl;
+		deferral->request.reset();
+		numDeferralsUsed--;
 	}
+	unlockAccumulators("State::addDeferred()");
 }
 
-void Convolver::State::setBlockPattern(boost::shared_ptr<BlockPattern> &blockPattern) {
-	frameSize = blockPattern->minimumBlockSize();
-	timeAccumulator.setFrameSize(frameSize);
+void Convolver::State::forgetDeferred() {
+	foreach(shared_ptr<Deferral> &deferral, deferrals) {
+		deferral->request.reset();
+	}
+	numDeferralsUsed = 0;
+}
+
+void Convolver::State::takeOverAccumulators(State &other) {
+	assert(other.frameSize == frameSize);
+	freqAccumulators.takeOver(other.freqAccumulators);
+	timeAccumulator.takeOver(other.timeAccumulator);
+}
+
+Convolver::FrequencyDelayLine &Convolver::State::getFrequencyDelayLine() {
+	if (frequencyDelayLine == NULL) {
+		frequencyDelayLine.reset(new FrequencyDelayLine(frameSize));
+	}
+	return *frequencyDelayLine;
+}
+
+Convolver::InputHistory &Convolver::State::getInputHistory() {
+	if (inputHistory == NULL) {
+		inputHistory.reset(new InputHistory(frameSize));
+	}
+	return *inputHistory;
+}
+
+Convolver::TimeBlock &Convolver::State::getHeadAccumulator() {
+	if (headAccumulator == NULL) {
+		headAccumulator.reset(new TimeBlock(frameSize));
+	}
+	return *headAccumulator;
+}
+
+Convolver::UniformAccumulator &Convolver::State::getUniformAccumulator() {
+	if (uniformAccumulator == NULL) {
+		uniformAccumulator.reset(new UniformAccumulator(frameSize));
+	}
+	return *uniformAccumulator;
+}
+
+Convolver::SpreadRequest *Convolver::State::getSpreadRequest(int level) {
+	if (level < 0 || (uint32_t)level >= spreadRequests.size()) return NULL;
+	return spreadRequests[level].get();
+}
+
+Convolver::SpreadRequest &Convolver::State::makeSpreadRequest(int level, uint32_t numFrames, uint32_t numPhases) {
+	if ((uint32_t)level >= spreadRequests.size()) spreadRequests.resize(level + 1);
+	spreadRequests[level].reset(new SpreadRequest(frameSize, numFrames, numPhases));
+	return *spreadRequests[level];
 }
 
 Convolver::State::State(Convolver::Kernel &convolver, shared_ptr<BlockPattern> &blockPattern) 
-	:	frameBuffer(new FrameBuffer()),
+	:	frameBuffer(new FrameBuffer(blockPattern->minimumBlockSize())),
 		frameRequests(new FrameRequests(frameBuffer->getFrameNum()-1)),
 		currentFrameNum(frameBuffer->getFrameNum()),
-		frameSize(blockPattern->minimumBlockSize()), count(0), 
-		// FIXME: we hardcode workItems here, we shouldn't
-		workItems(new LocklessQueue<WorkItem *>(400)), 
-		workThreadRunning(false), releaseAccumulatorLockOnPop(false), signalWorkerThreadOnPop(false),
-		 convolver(convolver), timeAccumulator(frameSize), frameNum(0)
+		frameSize(blockPattern->minimumBlockSize()), 
+		numLatePartitions(0), convolver(convolver), numJobsInFlight(0), freqAccumulators(frameSize), timeAccumulator(frameSize), numDeferralsUsed(0), frameNum(0)
 {
 	pthread_mutex_init(&this->accumulatorMutex, NULL);
-	pthread_mutex_init(&this->workAvailableMutex, NULL);
-	pthread_cond_init(&this->workAvailable, NULL);
 	pthread_cond_init(&this->frameFinallyDone, NULL);
+	reserveJobInputs(*blockPattern);
 }
 
-
-void Convolver::State::startWorkThread() {
-	int result;
-	
-	pthread_attr_t threadAttr;
-	result = pthread_attr_init(&threadAttr);
-	assert(result == 0);
-	
-	int schedPolicy;
-	result = pthread_attr_getschedpolicy(&threadAttr, &schedPolicy);
-	assert(result==0);
-	
-	sched_param schedParam;
-	result = pthread_attr_getschedparam(&threadAttr, &schedParam);
-	assert(result==0);
-	
-	#if DEBUG_CONVOLVE_THREADS
-	cout << "State::startWorkThread() default priority is " << schedParam.sched_priority << endl;
-	#endif
-	
-	schedParam.sched_priority = sched_get_priority_max(schedPolicy);
-	
-	#if DEBUG_CONVOLVE_THREADS
-	cout << "State::startWorkThread() MAX PRIORITY IS " << schedParam.sched_priority << endl;
-	#endif
-	
-	result = pthread_attr_setschedparam(&threadAttr, &schedParam);
-	assert(result ==0);
-	
-	// int pthread_attr_setschedparam(pthread_attr_t *attr, const struct sched_param *param)
-	// Set the scheduling parameter attribute in a thread attributes object.
+bool Convolver::State::queueFrameRequestForWorkThread(WorkerPool::Job &job) {
+	FrameRequest &request = *job.request;
+	foreach(ConvolutionOp &op, request.getLazyConvolutions()) {
+		State &output = *op.output;
+		op.accumulator = output.freqAccumulators.addPending(op.block->size(), op.outputConvolutionStartingAt, op.outputConvolutionStartingAt - output.currentFrameNum);
+		__sync_add_and_fetch(&output.numJobsInFlight, 1);
+	}
+	__sync_add_and_fetch(&numJobsInFlight, 1);
 	
-	// int pthread_attr_setschedpolicy(pthread_attr_t *attr, int policy)
-	// Set the scheduling policy attribute in a thread attributes object.
+	if (WorkerPool::get().submit(job)) return true;
 	
-	workThreadRunning = true;	
-	result = pthread_create(&this->workThread, &threadAttr, &workerThreadEntry, this);	
-	assert(result == 0);
+	foreach(ConvolutionOp &op, request.getLazyConvolutions()) {
+		__sync_sub_and_fetch(&op.accumulator->numPending, 1);
+		op.accumulator.reset();
+	}
+	jobFinished(request);
+	return false;
+}
+
+void Convolver::State::abandonFrameRequest(FrameRequest &request) {
+	foreach(ConvolutionOp &op, request.getLazyConvolutions()) {
+		State &output = *op.output;
+		output.lockAccumulators("State::abandonFrameRequest()"); {
+			output.workerDoneWith(op);
+		} output.unlockAccumulators("State::abandonFrameRequest()");
+	}
+}
+
+void Convolver::State::workerDoneWith(ConvolutionOp &op) {
+	bool lastOne = __sync_sub_and_fetch(&op.accumulator->numPending, 1) == 0;
+	op.accumulator.reset();
 	
-	#if DEBUG_CONVOLVE_THREADS
-	cout << "State::startWorkThread() Worker thread created" << endl;
-	#endif
+	// pop() may be waiting on it
+	if (lastOne) signalFrameDone();
 }
 
+void Convolver::State::jobFinished(FrameRequest &request) {
+	foreach(ConvolutionOp &op, request.getLazyConvolutions()) {
+		__sync_sub_and_fetch(&op.output->numJobsInFlight, 1);
+	}
+	__sync_sub_and_fetch(&numJobsInFlight, 1);
+}
+
+
 Convolver::State::~State() {
 	#if DEBUG_CONVOLVE_THREADS
 	cout << "Unlocking mutex from State::~State" << endl;
@@ -136,27 +270,16 @@ Convolver::State::~State() {
 	// Unlock this in case the thread is waiting on it
 	pthread_mutex_unlock(&this->accumulatorMutex);
 	
-	if (workThreadRunning) {
-		workThreadRunning = false;
-
+	// The workers are shared, so rather than joining one we wait for them to be done with us
+	if (numJobsInFlight > 0) {
 		#if DEBUG_CONVOLVE_THREADS
-		cout << "State::~State(): waiting for worker to join" << endl;
-		#endif
-		// Kick the thread so it wakes up,
-		// trick it, tell it we have a tasty treat for it
-		// then,
-		// kill it.
-		pthread_cond_signal(&workAvailable);
-		
-		pthread_join(workThread, NULL);
-		#if DEBUG_CONVOLVE_THREADS
-		cout << "State::~State(): worker joined" << endl;
+		cout << "State::~State(): waiting on " << numJobsInFlight << " jobs" << endl;
 		#endif
+		timespec pause = {0, 1000000};
+		while (__sync_fetch_and_add(&numJobsInFlight, 0) > 0) nanosleep(&pause, NULL);
 	}
 	
 	pthread_mutex_destroy(&this->accumulatorMutex);
-	pthread_mutex_destroy(&this->workAvailableMutex);
-	pthread_cond_destroy(&this->workAvailable);
 	pthread_cond_destroy(&this->frameFinallyDone);
 }
 
@@ -207,53 +330,317 @@ void Convolver::State::print(float scale) {
 
 namespace Convolver {
 
-	void State::TimeAccumulator::setFrameSize(uint32_t frameSize) {
+	TimeAccumulator::TimeAccumulator(uint32_t frameSize)
+		: samples(frameSize), frameSize(frameSize), numFrames(1), currentFrame(0)
+	{
+		#if DEBUG
+		cout << "TimeAccumulator::TimeAccumulator() Initialized to frame size " << frameSize << endl; 
+		#endif
+	}
+	
+	void TimeAccumulator::setFrameSize(uint32_t frameSize) {
+		// Unroll the ring into one run of samples, starting at the current frame
 		uint32_t oldFrameSize = this->frameSize;
+		uint32_t numSamples = numFrames * oldFrameSize;
+		TimeBlock unrolled(numSamples);
+		std::copy(samples.begin() + currentFrame * oldFrameSize, samples.end(), unrolled.begin());
+		std::copy(samples.begin(), samples.begin() + currentFrame * oldFrameSize, unrolled.end() - currentFrame * oldFrameSize);
+		
+		// And cut it back up into the new size
 		this->frameSize = frameSize;
+		numFrames = (numSamples + frameSize - 1) / frameSize;
+		TimeBlock newSamples(numFrames * frameSize);
+		std::copy(unrolled.begin(), unrolled.end(), newSamples.begin());
+		samples.swap(newSamples);
+		currentFrame = 0;
+	}
+	
+	void TimeAccumulator::grow(uint32_t numFrames) {
+		#if DEBUG
+		cout << "TimeAccumulator::grow(): growing from " << this->numFrames << " to " << numFrames << " frames" << endl;
+		#endif
+		
+		// Put the current frame first, the new frames on the end are silent
+		TimeBlock newSamples(numFrames * frameSize);
+		std::copy(samples.begin() + currentFrame * frameSize, samples.end(), newSamples.begin());
+		std::copy(samples.begin(), samples.begin() + currentFrame * frameSize, newSamples.begin() + (this->numFrames - currentFrame) * frameSize);
+		samples.swap(newSamples);
+		this->numFrames = numFrames;
+		currentFrame = 0;
+	}
+	
+	void TimeAccumulator::reserve(uint32_t numFrames) {
+		if (numFrames > this->numFrames) grow(numFrames);
+	}
+	
+	void TimeAccumulator::takeOver(TimeAccumulator &other) {
+		assert(other.frameSize == frameSize);
+		assert(other.numFrames >= numFrames);
 		
-		// First, copy all the existing samples to a single buffer
-		uint32_t numSamples = oldFrameSize * this->size();
-		TimeBlock samples(numSamples);
-		TimeBlock::iterator samplesIter = samples.begin();
-		for (uint32_t i=0; i < size(); i++) {
-			shared_ptr<TimeBlock> &fromBlock = this->at(i);
-			std::copy(fromBlock->begin(), fromBlock->end(), samplesIter);
-			samplesIter += fromBlock->size();
+		// Same as grow(), only into other's ring: the current frame first, silence after ours
+		std::fill(other.samples.begin(), other.samples.end(), 0.0f);
+		std::copy(samples.begin() + currentFrame * frameSize, samples.end(), other.samples.begin());
+		std::copy(samples.begin(), samples.begin() + currentFrame * frameSize, other.samples.begin() + (numFrames - currentFrame) * frameSize);
+		samples.swap(other.samples);
+		std::swap(numFrames, other.numFrames);
+		currentFrame = 0;
+		other.currentFrame = 0;
+	}
+	
+	void TimeAccumulator::accumulate(const TimeSample *input, uint32_t numSamples) {
+		assert(numSamples % frameSize == 0);
+		uint32_t numInputFrames = numSamples / frameSize;
+		if (numInputFrames > numFrames) {
+			cerr << "TimeAccumulator::accumulate(): " << numInputFrames << " frames weren't reserved, growing on the audio thread" << endl;
+			assert(false);
+			grow(numInputFrames);
 		}
-
-		// Now erase everything, and copy the mono-buffer to a bunch of buffers
-		this->clear();
-		uint32_t numNewAccumulators = (uint32_t)ceil((float)numSamples / (float)this->frameSize);
-
-		samplesIter = samples.begin();
-		for(uint32_t i=0; i < numNewAccumulators; i++) {
-			shared_ptr<TimeBlock> newBlock(new TimeBlock(frameSize));
-			std::copy(samplesIter, samplesIter+frameSize, newBlock->begin());
-			this->push_back(newBlock);
-			samplesIter += frameSize;
+		
+		// Up to the end of the ring, then wrap round to the start
+		uint32_t start = currentFrame * frameSize;
+		uint32_t firstPart = std::min(numSamples, (uint32_t)samples.size() - start);
+		TimeSample *output = samples.cArray();
+		for (uint32_t i=0; i < firstPart; i++) {
+			output[start + i] += input[i];
+		}
+		for (uint32_t i=firstPart; i < numSamples; i++) {
+			output[i - firstPart] += input[i];
+		}
+	}
+	
+	void TimeAccumulator::pop(TimeSample *output) {
+		TimeSample *frame = samples.cArray() + currentFrame * frameSize;
+		for (uint32_t i=0; i < frameSize; i++) {
+			output[i] += frame[i];
 		}
+		std::fill(frame, frame + frameSize, 0.0f);
+		currentFrame = (currentFrame + 1) % numFrames;
+	}
+	
+	void TimeAccumulator::clear() {
+		std::fill(samples.begin(), samples.end(), 0.0f);
+	}
+	
+	
+	FreqAccumulators::FreqAccumulators(uint32_t frameSize)
+		: frameSize(frameSize)
+	{
 	}
 	
-	void State::TimeAccumulator::accumulate(boost::shared_ptr<TimeBlock> timeBlock) {
-		assert(timeBlock->size() % frameSize == 0);
-		uint32_t numIterations = timeBlock->size() / frameSize;
+	void FreqAccumulators::grow(Level &level, uint32_t numSlots) {
+		#if DEBUG
+		cout << "FreqAccumulators::grow(): " << level.freqBlockSize << " accumulators growing from " << level.slots.size() << " to " << numSlots << " slots" << endl;
+		#endif
 		
-		while (this->size() <= numIterations) {
-			this->push_back(shared_ptr<TimeBlock>(new TimeBlock(frameSize)));
+		vector<Slot> newSlots(numSlots);
+		for (uint32_t i=0; i < numSlots; i++) {
+			newSlots[i].accumulator.reset(new Accumulator(level.freqBlockSize));
+			newSlots[i].outputFrame = 0;
+			newSlots[i].used = false;
+			newSlots[i].late = false;
+			newSlots[i].dropped = false;
+		}
+		while (level.spares.size() < numSlots) {
+			level.spares.push_back(shared_ptr<Accumulator>(new Accumulator(level.freqBlockSize)));
 		}
 		
-		TimeBlock::iterator startSection = timeBlock->begin();
+		// Anything still waiting moves to its slot in the bigger ring. Sizes are powers of
+		// two, so slots that were apart in the old ring are still apart in the new one.
+		foreach(Slot &slot, level.slots) {
+			if (!slot.used) continue;
+			Slot &newSlot = newSlots[(slot.outputFrame / level.numFrames) % numSlots];
+			assert(!newSlot.used);
+			newSlot = slot;
+		}
 		
-		for(uint32_t i=0; i < numIterations; i++) {
-			this->at(i)->accumulate(startSection, startSection + frameSize);
-			startSection += frameSize;
+		level.slots.swap(newSlots);
+	}
+	
+	FreqAccumulators::Level *FreqAccumulators::findLevel(uint32_t freqBlockSize) {
+		for (uint32_t i=0; i < levels.size(); i++) {
+			if (levels[i].freqBlockSize == freqBlockSize) return &levels[i];
 		}
+		return NULL;
 	}
 	
-	shared_ptr<TimeBlock> State::TimeAccumulator::pop() {
-		shared_ptr<TimeBlock> block = front();
-		pop_front();
-		return block;
+	void FreqAccumulators::reserve(uint32_t freqBlockSize, uint32_t framesFromNow) {
+		Level *level = findLevel(freqBlockSize);
+		if (level == NULL) {
+			uint32_t timeDomainSize = FFT::getTimeDomainSize(freqBlockSize);
+			Level newLevel(freqBlockSize, timeDomainSize / 2 / frameSize, timeDomainSize);
+			
+			// Keep them smallest first, so pop() goes in the same order as it always has
+			vector<Level>::iterator position = levels.begin();
+			while (position != levels.end() && position->freqBlockSize < freqBlockSize) ++position;
+			level = &*levels.insert(position, newLevel);
+		}
+		
+		// Every output frame from now to framesFromNow may be waiting in its own slot
+		uint32_t numSlotsNeeded = framesFromNow / level->numFrames + 2;
+		if (level->slots.size() < numSlotsNeeded) {
+			uint32_t numSlots = std::max<uint32_t>(level->slots.size(), 1);
+			while (numSlots < numSlotsNeeded) numSlots *= 2;
+			grow(*level, numSlots);
+		}
+	}
+	
+	void FreqAccumulators::takeOver(FreqAccumulators &other) {
+		assert(other.frameSize == frameSize);
+		
+		foreach(Level &level, levels) {
+			Level *otherLevel = other.findLevel(level.freqBlockSize);
+			if (otherLevel == NULL || otherLevel->slots.size() < level.slots.size()) {
+				cerr << "FreqAccumulators::takeOver(): " << level.freqBlockSize << " accumulators weren't reserved, dropping what's waiting in them" << endl;
+				assert(false);
+				continue;
+			}
+			
+			// Everything waiting lands in its slot in the other ring, like grow() does, and
+			// their empty slot comes back to us
+			otherLevel->numLate = level.numLate;
+			foreach(Slot &slot, level.slots) {
+				if (!slot.used) continue;
+				Slot &otherSlot = otherLevel->slots[(slot.outputFrame / level.numFrames) % otherLevel->slots.size()];
+				assert(!otherSlot.used);
+				std::swap(slot, otherSlot);
+			}
+			level.numLate = 0;
+		}
+		levels.swap(other.levels);
+	}
+	
+	FreqAccumulators::Slot &FreqAccumulators::getSlot(uint32_t freqBlockSize, FrameNum outputFrame, uint32_t framesFromNow) {
+		// Everything's made by reserve(), this is only here so a mistake costs an allocation
+		// in the render callback rather than a crash
+		Level *level = findLevel(freqBlockSize);
+		if (level == NULL || level->slots.size() < framesFromNow / level->numFrames + 2) {
+			cerr << "FreqAccumulators::getSlot(): " << freqBlockSize << " accumulators " << framesFromNow << " frames ahead weren't reserved" << endl;
+			assert(false);
+			reserve(freqBlockSize, framesFromNow);
+			level = findLevel(freqBlockSize);
+		}
+		
+		Slot &slot = level->slots[(outputFrame / level->numFrames) % level->slots.size()];
+		if (slot.used && slot.late && slot.outputFrame != outputFrame) {
+			// A whole lap late, it's not worth waiting for any more
+			release(*level, slot);
+		}
+		if (!slot.used) {
+			slot.accumulator->block.clear();
+			slot.outputFrame = outputFrame;
+			slot.used = true;
+		}
+		assert(slot.outputFrame == outputFrame);
+		return slot;
+	}
+	
+	FreqBlock &FreqAccumulators::get(uint32_t freqBlockSize, FrameNum outputFrame, uint32_t framesFromNow) {
+		return getSlot(freqBlockSize, outputFrame, framesFromNow).accumulator->block;
+	}
+	
+	FreqBlock *FreqAccumulators::find(uint32_t freqBlockSize, FrameNum outputFrame) {
+		Level *level = findLevel(freqBlockSize);
+		if (level == NULL || level->slots.empty()) return NULL;
+		Slot &slot = level->slots[(outputFrame / level->numFrames) % level->slots.size()];
+		if (!slot.used || slot.outputFrame != outputFrame) return NULL;
+		return &slot.accumulator->block;
+	}
+	
+	shared_ptr<Accumulator> &FreqAccumulators::addPending(uint32_t freqBlockSize, FrameNum outputFrame, uint32_t framesFromNow) {
+		shared_ptr<Accumulator> &accumulator = getSlot(freqBlockSize, outputFrame, framesFromNow).accumulator;
+		__sync_add_and_fetch(&accumulator->numPending, 1);
+		return accumulator;
+	}
+	
+	bool FreqAccumulators::isPending(FrameNum frameNum) {
+		foreach(Level &level, levels) {
+			if (level.slots.empty()) continue;
+			Slot &slot = level.slots[(frameNum / level.numFrames) % level.slots.size()];
+			if (slot.used && slot.outputFrame == frameNum && slot.accumulator->isPending()) return true;
+		}
+		return false;
+	}
+	
+	void FreqAccumulators::release(Level &level, Slot &slot) {
+		// Given up on, but a worker may still be adding into it, so it's theirs now and we
+		// take a spare nobody's holding any more
+		if (slot.accumulator->isPending()) {
+			shared_ptr<Accumulator> *spare = NULL;
+			foreach(shared_ptr<Accumulator> &accumulator, level.spares) {
+				if (accumulator.unique()) {
+					spare = &accumulator;
+					break;
+				}
+			}
+			if (spare != NULL) {
+				slot.accumulator.swap(*spare);
+			} else {
+				cerr << "FreqAccumulators::release(): every spare " << level.freqBlockSize << " accumulator is still out, allocating one" << endl;
+				slot.accumulator.reset(new Accumulator(level.freqBlockSize));
+			}
+		}
+		
+		if (slot.late) level.numLate--;
+		slot.used = false;
+		slot.late = false;
+		slot.dropped = false;
+	}
+	
+	void FreqAccumulators::transform(Level &level, Slot &slot, FrameNum frameNum, Kernel &kernel, TimeAccumulator &output) {
+		#if DEBUG_CONVOLVE
+		cout << "\toutputting Accumulator( " << (size_t)&*slot.accumulator << ")" << endl;
+		#endif
+		
+		// Late, the frames before this one have already gone out without it
+		uint32_t numSamplesMissed = (frameNum - slot.outputFrame) * frameSize;
+		if (numSamplesMissed >= level.transformed.size()) return;
+		
+		FFT &fft = kernel.getFFTI(level.freqBlockSize);
+		fft.fftri(slot.accumulator->block, level.transformed);
+		output.accumulate(level.transformed.cArray() + numSamplesMissed, level.transformed.size() - numSamplesMissed);
+	}
+	
+	uint32_t FreqAccumulators::pop(FrameNum frameNum, Kernel &kernel, TimeAccumulator &output, bool mixLate) {
+		uint32_t numLate = 0;
+		foreach(Level &level, levels) {
+			if (level.slots.empty()) continue;
+			
+			// Anything that came in late since last time goes in now, whatever of it isn't too late
+			if (level.numLate > 0) {
+				foreach(Slot &slot, level.slots) {
+					if (!slot.late || slot.accumulator->isPending()) continue;
+					if (!slot.dropped) transform(level, slot, frameNum, kernel, output);
+					release(level, slot);
+				}
+			}
+			
+			Slot &slot = level.slots[(frameNum / level.numFrames) % level.slots.size()];
+			if (!slot.used || slot.outputFrame != frameNum) continue;
+			
+			if (slot.accumulator->isPending()) {
+				numLate++;
+				slot.late = true;
+				level.numLate++;
+				if (mixLate) continue;
+				
+				// Otherwise out it goes as it is, but the workers are still adding into it
+				transform(level, slot, frameNum, kernel, output);
+				slot.dropped = true;
+				continue;
+			}
+			
+			transform(level, slot, frameNum, kernel, output);
+			release(level, slot);
+		}
+		return numLate;
+	}
+	
+	void FreqAccumulators::reset() {
+		foreach(Level &level, levels) {
+			foreach(Slot &slot, level.slots) {
+				release(level, slot);
+			}
+		}
 	}
 }
 
@@ -263,62 +650,61 @@ namespace Convolver {
 }
 
 shared_ptr<Convolver::TimeBlock> Convolver::State::pop(uint32_t timeBlockSize) {
-	unordered_map<FrameNum, int>::iterator iter = workThreadFrameStatus.find(currentFrameNum);
-	if (iter != workThreadFrameStatus.end()) {
-		if (iter->second > 0) {
-			timespec waitTime;
-			waitTime.tv_sec = 0;
-			waitTime.tv_nsec = 200000000;
-
-			assert(workThreadRunning);
-			assert(releaseAccumulatorLockOnPop);
-			
-			cerr << "State::pop() underrun, waiting on a thread\n";		
+	shared_ptr<TimeBlock> toReturn(new TimeBlock(timeBlockSize));
+	pop(toReturn->cArray(), timeBlockSize);
+	return toReturn;
+}
+
+void Convolver::State::pop(TimeSample *output, uint32_t timeBlockSize) {
+	assert(timeBlockSize == frameSize);
+	
+	Kernel::LatePolicy latePolicy = convolver.getLatePolicy();
+	
+	// Before we look at what's ready, in case it's for this frame
+	addDeferred();
+	
+	// Only rendering offline can we afford to sit here until the workers catch up. They
+	// count themselves out with our accumulators locked, so we can't miss the last one.
+	if (latePolicy == Kernel::LATE_WAIT && freqAccumulators.isPending(currentFrameNum)) {
+		lockAccumulators("State::pop()"); {
+			while (freqAccumulators.isPending(currentFrameNum)) {
+				cerr << "State::pop() underrun, waiting on a thread\n";		
+				#if DEBUG_CONVOLVE_STATS
+				numUnderruns++;
+				#endif
+				
+				pthread_cond_wait(&this->frameFinallyDone, &this->accumulatorMutex);
+			}
+		} unlockAccumulators("State::pop()");
+	}
+	
+	std::fill(output, output + timeBlockSize, 0.0f);
+	
+	// With a time domain head or the FDL scheduler, there may be nothing out here at all
+	if (!freqAccumulators.empty()) {
+		uint32_t numLate = freqAccumulators.pop(currentFrameNum, convolver, timeAccumulator, latePolicy == Kernel::LATE_MIX_LATE);
+		if (numLate > 0) {
+			addLatePartitions(numLate);
 			#if DEBUG_CONVOLVE_STATS
 			numUnderruns++;
 			#endif
-			
-			pthread_cond_wait(&this->frameFinallyDone, &this->accumulatorMutex);
-			//int result = pthread_cond_timedwait(&this->frameFinallyDone, &this->accumulatorMutex, &waitTime);
-			//assert(result != ETIMEDOUT);
-			assert(workThreadFrameStatus[currentFrameNum] == 0);
 		}
-		workThreadFrameStatus.erase(iter);
+		timeAccumulator.pop(output);
 	}
 	
-	
-	
-	assert(freqAccumulators.size() > 0);
-	
-	// Now get the IFFT for the top buffer on the accumulator
-	FreqAccumulator &accumulator = freqAccumulators.front();
-	#if DEBUG_CONVOLVE
-	cout << "OUTPUTTING " << accumulator.size() <<  " FREQ ACCUMULATORS" << endl;
-	#endif
-	FreqAccumulator::iterator i;
-	for(i=accumulator.begin(); i != accumulator.end(); ++i) {
-		shared_ptr<FreqBlock> freqBlock = i->second;
-		
-	#if DEBUG_CONVOLVE
-	cout << "\toutputting Accumulator( " << (size_t)&(*freqBlock) << ")" << endl;
-	cout << "\t\tdoing IFFT\n" << endl;
-	#endif		
-		
-		FFT &fft = convolver.getFFTI(freqBlock->size());
-		shared_ptr<TimeBlock> localAccumulator = fft.fftri(*freqBlock);
-		timeAccumulator.accumulate(localAccumulator);
+	if (uniformAccumulator != NULL) {
+		FFT &fft = convolver.getFFTI(uniformAccumulator->getFreqBlockSize());
+		uniformAccumulator->pop(fft, output);
 	}
 	
-	#if	DEBUG_CONVOLVE
-	cout << "Popping timeAccumulator, before size: " << timeAccumulator.size() << endl;
-	#endif
-	shared_ptr<TimeBlock> toReturn = timeAccumulator.pop();
-	
-	assert(toReturn->size() == timeBlockSize);
+	if (headAccumulator != NULL) {
+		TimeSample *head = headAccumulator->cArray();
+		for (uint32_t i=0; i < timeBlockSize; i++) {
+			output[i] += head[i];
+		}
+		std::fill(headAccumulator->begin(), headAccumulator->end(), 0.0f);
+	}
 	
-	// Drop the current frame off the accumulators
-	freqAccumulators.pop_front();
-
 	this->currentFrameNum = frameBuffer->getFrameNum();
 	
 	#if DEBUG_MEMORY
@@ -329,17 +715,6 @@ shared_ptr<Convolver::TimeBlock> Convolver::State::pop(uint32_t timeBlockSize) {
 	#if DEBUG_CONVOLVE
 	cout << endl;
 	#endif
-	
-	if (releaseAccumulatorLockOnPop) {
-		unlockAccumulators("State::pop");
-		releaseAccumulatorLockOnPop = false;
-	}
-	if (signalWorkerThreadOnPop) {
-		signalThreadWorkAvailable();
-		signalWorkerThreadOnPop = false;
-	}
-	
-	return toReturn;
 }
 
 void Convolver::State::alertUnderrun() {
@@ -348,34 +723,32 @@ void Convolver::State::alertUnderrun() {
 
 
 void Convolver::State::reset() {
-	freqAccumulators.erase(freqAccumulators.begin(), freqAccumulators.end());
-	timeAccumulator.erase(timeAccumulator.begin(), timeAccumulator.end());
+	freqAccumulators.reset();
+	forgetDeferred();
+	timeAccumulator.clear();
+	
+	// Forget whatever the scheduler had in flight, and pick up at the next frame
+	frameRequests.reset(new FrameRequests(currentFrameNum - 1));
+	frequencyDelayLine.reset();
+	inputHistory.reset();
+	headAccumulator.reset();
+	uniformAccumulator.reset();
+	spreadRequests.clear();
 }
 
 Convolver::FreqBlock *Convolver::State::getAccumulator(uint32_t framesFromNow, uint32_t accumulatorSize) {
-	if (freqAccumulators.size() <= framesFromNow) {
-		uint32_t newSize = framesFromNow + 1;
-		freqAccumulators.resize(newSize);
-	}
-	
-	FreqAccumulator &accumulatorsAtFrame = freqAccumulators.at(framesFromNow);
-	FreqAccumulator::iterator existingAccumulator = accumulatorsAtFrame.find(accumulatorSize);
-	if (existingAccumulator==accumulatorsAtFrame.end()) {
-		pair<uint32_t, shared_ptr<FreqBlock> > mapValue(accumulatorSize, shared_ptr<FreqBlock>(new FreqBlock(accumulatorSize)));
-		accumulatorsAtFrame.insert(mapValue);
-		return &*mapValue.second;
-	} else {
-		return &*(*existingAccumulator).second;
-	}
+	return &freqAccumulators.get(accumulatorSize, currentFrameNum + framesFromNow, framesFromNow);
 }
 
+volatile uint64_t Convolver::State::totalLatePartitions = 0;
+
 namespace Convolver {
 	using boost::unordered_map;
 	
 	uint32_t FrameRequest::maxRequests = 0;
 	
-	void FrameRequest::lazilyConvolveWith(shared_ptr<FreqBlock> &block, FrameNum frameNum) {
-		ConvolutionOp op = {block, frameNum};
+	void FrameRequest::lazilyConvolveWith(shared_ptr<FreqBlock> &block, State *output, FrameNum frameNum) {
+		ConvolutionOp op = {block, output, frameNum};
 		convolutionOps.push_back(op);
 		uint32_t numOps = convolutionOps.size();
 		if (maxRequests < numOps) maxRequests = numOps;
@@ -386,132 +759,287 @@ namespace Convolver {
 	}
 	
 	
-	FrameNum FrameBuffer::addFrame(shared_ptr<TimeBlock> &frame) {
-		buffer.push_back(frame);
-		return frameNum++;
+	FrequencyDelayLine::FrequencyDelayLine(uint32_t frameSize)
+		: freqBlockSize(FFT::getFreqDomainSize(frameSize * 2)), newestFrame(0), lastSoundFrame(0), haveSpectrum(false), heardSound(false)
+	{
 	}
 	
-	// 		FrameNum bufferOffset;
-	void FrameBuffer::flushFramesBefore(FrameNum oldestFrameToKeep) {
-		uint32_t oldestIndexToKeep = frameNumToBufferIndex(oldestFrameToKeep);
+	void FrequencyDelayLine::reserve(uint32_t numPartitions) {
+		uint32_t oldSize = spectra.size();
+		if (numPartitions <= oldSize) return;
 		
-		// We're already flushed
-		if (oldestIndexToKeep == NEGATIVE_BUFFER_INDEX) {
-			cerr << "Asked to flush before a negative buffer, skipping" << endl;
-			return;
-		} else if (oldestIndexToKeep == 0) {
-			return;
+		#if DEBUG
+		cout << "FrequencyDelayLine::reserve(): growing from " << oldSize << " to " << numPartitions << " partitions" << endl;
+		#endif
+		
+		vector<shared_ptr<FreqBlock> > newSpectra(numPartitions);
+		vector<bool> newSilent(numPartitions, true);
+		for (uint32_t i=0; i < numPartitions; i++) {
+			newSpectra[i].reset(new FreqBlock(freqBlockSize));
 		}
 		
-		bufferOffset += oldestIndexToKeep;
+		// Move the spectra we remember to their slots in the bigger ring
+		if (haveSpectrum) {
+			uint32_t numToKeep = std::min<FrameNum>(oldSize, newestFrame + 1);
+			for (uint32_t i=0; i < numToKeep; i++) {
+				FrameNum frame = newestFrame - i;
+				newSpectra[frame % numPartitions] = spectra[frame % oldSize];
+				newSilent[frame % numPartitions] = silent[frame % oldSize];
+			}
+		}
 		
-		Buffer::iterator bufferStart = buffer.begin();
-		buffer.erase(bufferStart, bufferStart + oldestIndexToKeep);
+		spectra.swap(newSpectra);
+		silent.swap(newSilent);
 	}
 	
-	shared_ptr<TimeBlock> FrameBuffer::fulfill(FrameRequest &frameRequest, uint32_t frameSize, bool pad) {
-		uint32_t requestStartIndex = frameNumToBufferIndex(frameRequest.id.first);
-		uint32_t requestEndIndex   = frameNumToBufferIndex(frameRequest.id.second);
-#if 0
-		cout << "FrameBuffer::fulfill[idx:" << requestStartIndex << ", idx:" << requestEndIndex << ")" << endl;
-		cout << "FrameBuffer::fulfull: buffer.size() = " << buffer.size() << endl;
-#endif
-		assert(requestStartIndex != NEGATIVE_BUFFER_INDEX);
-		assert(requestEndIndex <= buffer.size());
-		assert(requestEndIndex > requestStartIndex);
+	FreqBlock &FrequencyDelayLine::startSpectrum(FrameNum frameNum) {
+		assert(spectra.size() > 0);
+		assert(!haveSpectrum || frameNum == newestFrame + 1);
 		
-		uint32_t numFrames = requestEndIndex - requestStartIndex;
+		newestFrame = frameNum;
+		lastSoundFrame = frameNum;
+		haveSpectrum = true;
+		heardSound = true;
+		silent[frameNum % spectra.size()] = false;
+		return *spectra[frameNum % spectra.size()];
+	}
+	
+	void FrequencyDelayLine::startSilence(FrameNum frameNum) {
+		assert(spectra.size() > 0);
+		assert(!haveSpectrum || frameNum == newestFrame + 1);
 		
-#if 0
-		cout << "FrameBuffer::fulfill: numFrames=" << numFrames << endl;
-#endif
+		newestFrame = frameNum;
+		haveSpectrum = true;
+		silent[frameNum % spectra.size()] = true;
+	}
+	
+	
+	UniformAccumulator::UniformAccumulator(uint32_t frameSize)
+		: spectrum(FFT::getFreqDomainSize(frameSize * 2)), transformed(frameSize * 2), overlap(frameSize), frameSize(frameSize), used(false)
+	{
+	}
+	
+	void UniformAccumulator::pop(FFT &ffti, TimeSample *output) {
+		TimeSample *tail = overlap.cArray();
 		
-		uint32_t paddingFactor = pad ? 2 : 1;
-		shared_ptr<TimeBlock> output(new TimeBlock(numFrames * frameSize * paddingFactor));
+		if (used) {
+			ffti.fftri(spectrum, transformed);
+			spectrum.clear();
+			used = false;
+			
+			TimeSample *head = transformed.cArray();
+			for (uint32_t i=0; i < frameSize; i++) {
+				output[i] += head[i] + tail[i];
+			}
+			std::copy(transformed.begin() + frameSize, transformed.end(), overlap.begin());
+		} else {
+			for (uint32_t i=0; i < frameSize; i++) {
+				output[i] += tail[i];
+			}
+			std::fill(overlap.begin(), overlap.end(), 0.0f);
+		}
+	}
+	
+	void UniformAccumulator::reset() {
+		spectrum.clear();
+		std::fill(overlap.begin(), overlap.end(), 0.0f);
+		used = false;
+	}
+	
+	FreqBlock *FrequencyDelayLine::getSpectrum(FrameNum frameNum) {
+		// Frames from before we started, or that fell off the end of the ring, are silent
+		if (!haveSpectrum || frameNum > newestFrame || newestFrame - frameNum >= spectra.size()) {
+			return NULL;
+		}
+		if (silent[frameNum % spectra.size()]) return NULL;
+		return &*spectra[frameNum % spectra.size()];
+	}
+	
+	
+	InputHistory::InputHistory(uint32_t frameSize)
+		: samples(frameSize), frameSize(frameSize), numPastSamples(0), newestFrame(0), haveFrame(false)
+	{
+	}
+	
+	void InputHistory::reserve(uint32_t numPastSamples) {
+		if (numPastSamples <= this->numPastSamples) return;
 		
-#if 0
-		cout << "FrameBuffer::fulfill: created a timeblock of size=" << output->size() << endl;
-#endif
+		#if DEBUG
+		cout << "InputHistory::reserve(): growing from " << this->numPastSamples << " to " << numPastSamples << " samples of history" << endl;
+		#endif
 		
-		TimeBlock::iterator outputIter = output->begin();
+		// Keep what we've heard so far, right aligned, the older part is silence
+		TimeBlock newSamples(numPastSamples + frameSize);
+		std::copy(samples.begin(), samples.end(), newSamples.end() - samples.size());
+		samples.swap(newSamples);
+		this->numPastSamples = numPastSamples;
+	}
+	
+	void InputHistory::push(FrameNum frameNum, const TimeSample *frame) {
+		// Slide everything back a frame and put the new one on the end
+		std::copy(samples.begin() + frameSize, samples.end(), samples.begin());
+		std::copy(frame, frame + frameSize, samples.end() - frameSize);
 		
-		Buffer::iterator start = buffer.begin() + requestStartIndex;
-		Buffer::iterator end = buffer.begin() + requestEndIndex;		
+		newestFrame = frameNum;
+		haveFrame = true;
+	}
+	
+	// About -120dB below full scale over the frame
+	const float FrameBuffer::silentFrameEnergy = 1e-12f;
+	
+	FrameBuffer::FrameBuffer(uint32_t frameSize, FrameNum firstFrame)
+		: ring(2 * 16 * frameSize), frameSize(frameSize), capacity(16), oldestFrame(firstFrame), frameNum(firstFrame), lastSoundFrame(0), heardSound(false)
+	{
+	}
+	
+	FrameNum FrameBuffer::addFrame(const TimeSample *samples) {
+		if (getNumFrames() == capacity) grow();
+		
+		TimeSample *frame = &ring[offsetOf(frameNum)];
+		TimeSample *mirror = frame + capacity * frameSize;
+		if (samples) {
+			std::copy(samples, samples + frameSize, frame);
+			std::copy(samples, samples + frameSize, mirror);
+			
+			float energy = 0.0f;
+			for (uint32_t i=0; i < frameSize; i++) energy += samples[i] * samples[i];
+			if (energy > silentFrameEnergy) {
+				lastSoundFrame = frameNum;
+				heardSound = true;
+			}
+		} else {
+			std::fill(frame, frame + frameSize, 0.0f);
+			std::fill(mirror, mirror + frameSize, 0.0f);
+		}
+		return frameNum++;
+	}
+	
+	void FrameBuffer::grow() {
+		uint32_t newCapacity = capacity * 2;
+		
+		#if DEBUG
+		cout << "FrameBuffer::grow(): growing from " << capacity << " to " << newCapacity << " frames" << endl;
+		#endif
 		
-		Buffer::iterator i;
-		for(i = start; i != end; ++i) {
-			shared_ptr<TimeBlock> &timeBlock = *i;
-			assert(timeBlock->size() == frameSize);
-			std::copy(timeBlock->begin(), timeBlock->end(), outputIter);
-			outputIter += frameSize;
+		// Frames land at different offsets in the bigger ring, so move them one by one
+		TimeBlock newRing(2 * newCapacity * frameSize);
+		for (FrameNum i = oldestFrame; i < frameNum; i++) {
+			const TimeSample *frame = &ring[offsetOf(i)];
+			uint32_t newOffset = (uint32_t)(i & (newCapacity - 1)) * frameSize;
+			std::copy(frame, frame + frameSize, newRing.begin() + newOffset);
+			std::copy(frame, frame + frameSize, newRing.begin() + newOffset + newCapacity * frameSize);
 		}
 		
-		return output;
+		ring.swap(newRing);
+		capacity = newCapacity;
 	}
 	
+	void FrameBuffer::flushFramesBefore(FrameNum oldestFrameToKeep) {
+		// We're already flushed
+		if (oldestFrameToKeep < oldestFrame) {
+			cerr << "Asked to flush before a negative buffer, skipping" << endl;
+			return;
+		}
+		
+		// The samples stay where they are until addFrame() writes over them
+		oldestFrame = std::min(oldestFrameToKeep, frameNum);
+	}
+	
+	const TimeSample *FrameBuffer::getFrames(FrameNum startFrame, FrameNum endFrame) {
+		assert(startFrame >= oldestFrame);
+		assert(endFrame <= frameNum);
+		assert(endFrame > startFrame);
+		assert(endFrame - startFrame <= capacity);
+		return &ring[offsetOf(startFrame)];
+	}
+	
+	const TimeSample *FrameBuffer::fulfill(FrameRequest &frameRequest, uint32_t &numSamples) {
+#if 0
+		cout << "FrameBuffer::fulfill[" << frameRequest.id.first << ", " << frameRequest.id.second << ")" << endl;
+#endif
+		numSamples = (frameRequest.id.second - frameRequest.id.first) * frameSize;
+		return getFrames(frameRequest.id.first, frameRequest.id.second);
+	}
+	
+	
+	static bool outputsSooner(const ConvolutionOp &a, const ConvolutionOp &b) {
+		return a.outputConvolutionStartingAt < b.outputConvolutionStartingAt;
+	}
+	
+	SpreadRequest::SpreadRequest(uint32_t frameSize, uint32_t numFrames, uint32_t numPhases)
+		: fft(new SplitFFT(2 * frameSize * numFrames, numPhases)), spectrum(FFT::getFreqDomainSize(2 * frameSize * numFrames)),
+		  numStepsDone(0), numFrames(numFrames), lastFrame(0)
+	{
+	}
+	
+	void SpreadRequest::start(shared_ptr<FrameRequest> &request, const TimeSample *samples, FrameNum frameNum) {
+		assert(!busy());
+		this->request = request;
+		std::sort(request->convolutionOps.begin(), request->convolutionOps.end(), &outputsSooner);
+		fft->start(samples);
+		numStepsDone = 0;
+		// The next request for this level comes due numFrames from now
+		lastFrame = frameNum + numFrames - 1;
+	}
+	
+	void SpreadRequest::finish() {
+		request.reset();
+	}
+	
+	uint32_t SpreadRequest::getNumSteps() {
+		return fft->getNumSteps() + request->convolutionOps.size();
+	}
+	
+	FrameNum SpreadRequest::getDeadline(uint32_t stepNum) {
+		vector<ConvolutionOp> &ops = request->convolutionOps;
+		uint32_t numFFTSteps = fft->getNumSteps();
+		// The transform's needed by the first op
+		uint32_t opNum = stepNum < numFFTSteps ? 0 : stepNum - numFFTSteps;
+		return std::min(ops[opNum].outputConvolutionStartingAt, lastFrame);
+	}
+	
+	FrameRequests::FrameRequests(FrameNum initialFrame)
+		: frameNum(initialFrame), firstFrame(initialFrame + 1)
+	{
+	}
 	
 	shared_ptr<FrameRequest> &FrameRequests::request(FrameNum startFrame, FrameNum endFrame) {
+		assert(endFrame == frameNum + 2);
 		FrameRequestID id(startFrame, endFrame);
-		IDToRequestMap::iterator requestIter = idsToRequests.find(id);
-		if (requestIter == idsToRequests.end()) {
-			shared_ptr<FrameRequest> frameRequest(new FrameRequest(id));
-			
-			// Insert the new item into our maps
-			std::pair<IDToRequestMap::iterator, bool> result = idsToRequests.insert(IDToRequestMap::value_type(id, frameRequest));
-			endFrameToIDs[endFrame].push_back(id);
-			requestIter = result.first;
+		
+		// Another filter on this input may have asked already
+		uint32_t numDue = due.size();
+		for (uint32_t i=0; i < numDue; i++) {
+			if (due[i]->id == id) return due[i];
 		}
 		
-		return requestIter->second;
+		// Anything a worker thread is still holding on to stays in spare till it's done
+		shared_ptr<FrameRequest> frameRequest;
+		for (int i = (int)spare.size() - 1; i >= 0; i--) {
+			if (spare[i].unique()) {
+				frameRequest.swap(spare[i]);
+				spare.erase(spare.begin() + i);
+				frameRequest->reuse(id);
+				break;
+			}
+		}
+		if (frameRequest == NULL) frameRequest.reset(new FrameRequest(id));
+		
+		due.push_back(frameRequest);
+		return due.back();
 	}
 	
-	// Pop all the frames that are ready
-	list<shared_ptr<FrameRequest> > FrameRequests::advanceToFrame(FrameNum frameNum) {
+	vector<shared_ptr<FrameRequest> > &FrameRequests::advanceToFrame(FrameNum frameNum) {
 		// We don't support big jumps yet
 		assert(this->frameNum + 1 == frameNum);
 		
 		this->frameNum = frameNum;
 		
-		EndFrameToIDMap::iterator iter = endFrameToIDs.find(frameNum+1);
-		assert(iter != endFrameToIDs.end());
-		list<FrameRequestID> &ids = (*iter).second;
-		
-		list<shared_ptr<FrameRequest> > toReturn;
-		// FIXME: If it was a vector... toReturn.reserve(ids.size()); would that be faster?
-		
-		foreach(FrameRequestID &id, ids) {
-			IDToRequestMap::iterator requestIter = idsToRequests.find(id);
-			assert(requestIter != idsToRequests.end());
-			toReturn.push_back((*requestIter).second);
-			idsToRequests.erase(requestIter);
-		}
-		
-		endFrameToIDs.erase(iter);
+		// Last frame's requests are done with, on this thread anyway
+		spare.insert(spare.end(), ready.begin(), ready.end());
+		ready.clear();
+		ready.swap(due);
 		
-		return toReturn;
+		return ready;
 	}
-	
-	// FIXME: slow
-	FrameNum FrameRequests::getOldestFrameRequested() {
-		FrameNum oldestFrame = frameNum;
-#if DEBUG_CONVOLVE2
-		cout << "FrameRequests::getEndiestFrameRequested():" << endl;		
-#endif
-		
-		foreach(IDToRequestMap::value_type &entry, idsToRequests) {
-#if DEBUG_CONVOLVE2
-			cout << "[" << entry.first.first << ", " << entry.first.second << ")";
-#endif
-			if (entry.first.first < oldestFrame) {
-				oldestFrame = entry.first.first;
-#if DEBUG_CONVOLVE2
-				cout << " *" << endl;
-#endif
-			}
-#if DEBUG_CONVOLVE2
-			cout << endl;
-#endif
-		}
-		return oldestFrame;
-	}	
 }
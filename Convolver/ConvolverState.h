@@ -17,14 +17,16 @@
 namespace Convolver {
 	class State;
 	class FrameRequest;
+	class Filter;
 	typedef uint64_t FrameNum;	
 }
 
 #include "ConvolverTypes.h"
 #include "ConvolverKernel.h"
-#include "LockFreeQueue.h"
 #include "ConvolverStateTypes.h"
+#include "ConvolverWorkerPool.h"
 #include <sstream>
+#include <map>
 #include "DebugSettings.h"
 #include <boost/foreach.hpp>
 
@@ -39,6 +41,20 @@ namespace Convolver {
 		
 		void setBlockPattern(boost::shared_ptr<BlockPattern> &blockPattern);
 		
+		// How far ahead (in frames) output of each partition size (freq domain) may be owed
+		typedef std::map<uint32_t, uint32_t> AccumulatorNeeds;
+		// What filter's partitions, as they're laid out by blockPattern, will need
+		static void addAccumulatorNeeds(AccumulatorNeeds &needs, BlockPattern &blockPattern, Filter &filter);
+		static void addAccumulatorNeeds(AccumulatorNeeds &needs, const AccumulatorNeeds &more);
+		// Makes room in our accumulators ahead of time, so the audio thread never has to. Off
+		// the audio thread, before the State's handed to it.
+		void reserveAccumulators(const AccumulatorNeeds &needs);
+		void reserveAccumulators(BlockPattern &blockPattern, Filter &filter);
+		// Carries on with other's accumulators, taking whatever's still owed in ours along,
+		// and leaves other with ours. other has to have been reserved for at least as much as
+		// we were. Nothing's allocated or freed, so it's fine on the audio thread.
+		void takeOverAccumulators(State &other);
+		
 		/* new stuff */
 		
 		// FIXME: these two should be members, not shared_ptrs
@@ -46,13 +62,32 @@ namespace Convolver {
 		boost::shared_ptr<FrameRequests> frameRequests;
 		FrameNum currentFrameNum;
 		
-		FreqBlock* getAccumulator(uint32_t framesFromNow, uint32_t accumulatorSize);
+		// Only allocated when the Kernel runs the FDL scheduler on us
+		FrequencyDelayLine &getFrequencyDelayLine();
+		
+		// Only allocated when a Filter has a time domain head. Whatever gets accumulated
+		// into getHeadAccumulator() is added to the next frame pop() returns.
+		InputHistory &getInputHistory();
+		TimeBlock &getHeadAccumulator();
 		
-		// FIXME: can FrameRequest be a pointer instead of a shared_ptr ? the worker thread owns it...
-		typedef boost::tuple<boost::shared_ptr<TimeBlock>, boost::shared_ptr<FrameRequest>, FrameNum> WorkItem;
+		// Only allocated when the Kernel runs the FDL scheduler into us
+		UniformAccumulator &getUniformAccumulator();
+		
+		// Only allocated when the Kernel spreads big partitions over several callbacks,
+		// one per partition level. getSpreadRequest() is NULL until it's been made.
+		SpreadRequest *getSpreadRequest(int level);
+		SpreadRequest &makeSpreadRequest(int level, uint32_t numFrames, uint32_t numPhases);
+		inline uint32_t getNumSpreadRequests() { return spreadRequests.size(); }
+		
+		FreqBlock* getAccumulator(uint32_t framesFromNow, uint32_t accumulatorSize);
+		// For when Kernel::convolve() finds a worker has our accumulators locked: rather than
+		// wait for it, or leave op out, we keep a copy of the request's spectrum and pop() does
+		// op once it can get the lock, this callback or a later one. False if there's no room.
+		bool defer(boost::shared_ptr<FrameRequest> &request, ConvolutionOp &op, FreqBlock &spectrum);
 		
+		// Keeps the workers from adding into the same accumulator at once. The audio thread
+		// only ever tries it, see Kernel::convolve(), or waits on it with LATE_WAIT.
 		inline bool tryToLockAccumulators(const char * who) {
-			if (releaseAccumulatorLockOnPop) return true;
 			int result = pthread_mutex_trylock(&accumulatorMutex);
 			switch(result) {
 				case 0: {
@@ -114,96 +149,99 @@ namespace Convolver {
 					assert(false);
 			}		
 		}
-		inline void setReleaseAccumulatorLockOnPop(bool value) {
-			releaseAccumulatorLockOnPop |= value;
-		}
-		inline void setSignalThreadWorkAvailable(bool value) {
-			signalWorkerThreadOnPop |= value;
-		}
 		inline void push(shared_ptr<TimeBlock> &frame) {
 			assert(frame->size() == frameSize);
 			lastInputBlockSize = frame->size();
 			if (lastInputBlockSize != frameSize) {
 				cerr << "ConvolverState::push() WARNING block being pushed has size " << frame->size() << ", but we were initialized with frame size " << frameSize << endl;
 			}
-			this->currentFrameNum = this->frameBuffer->addFrame(frame);
+			this->currentFrameNum = this->frameBuffer->addFrame(frame->cArray());
+		}
+		// Copies the samples into the FrameBuffer. NULL pushes a frame of silence.
+		inline void push(const TimeSample *samples, uint32_t numSamples) {
+			assert(numSamples == frameSize);
+			lastInputBlockSize = numSamples;
+			this->currentFrameNum = this->frameBuffer->addFrame(samples);
 		}
 		inline uint32_t getFrameSize() {
 			return frameSize;
 		}
-		bool queueFrameRequestForWorkThread(WorkItem *item) {
-			BOOST_FOREACH(ConvolutionOp &op, item->get<1>()->getLazyConvolutions()) {
-				workThreadFrameStatus[op.outputConvolutionStartingAt]++;
-			}
-
-			return workItems->push(item);
-		}
+		// Hands the job to the WorkerPool, by whoever's processing every State it outputs to
+		bool queueFrameRequestForWorkThread(WorkerPool::Job &job);
+		// Somewhere to copy a job's input, since the ring will have moved on by the time a
+		// worker gets to it. They're made with the State, and each one's free again once the
+		// worker lets go of it. NULL if every one that size is still out.
+		boost::shared_ptr<TimeBlock> *getJobInput(uint32_t numSamples);
+		// The worker's done with every State job touched
+		void jobFinished(FrameRequest &request);
+		// The worker won't be doing request after all, let everyone waiting on it go ahead without it
+		void abandonFrameRequest(FrameRequest &request);
+		// One of the worker's ops into us is done (or abandoned), with our accumulators locked
+		void workerDoneWith(ConvolutionOp &op);
 		inline void signalFrameDone() {
 			pthread_cond_signal(&this->frameFinallyDone);
 		}
-		inline void sorryFinallydoneWithCurrentFrame() {
-			pthread_cond_signal(&this->frameFinallyDone);
-		}
 		
 		void alertUnderrun();
 		
-		typedef map<uint32_t, shared_ptr<FreqBlock> > FreqAccumulator;
-		typedef deque<FreqAccumulator> FreqAccumulators;	
-		
-		class TimeAccumulator : public deque<shared_ptr<TimeBlock> > {
-		public:
-			TimeAccumulator(uint32_t frameSize) : frameSize(frameSize) { 
-				#if DEBUG
-				std::cout << "TimeAccumulator::TimeAccumulator() Initialized to frame size " << frameSize << std::endl; 
-				#endif
-			}
-			
-			void setFrameSize(uint32_t frameSize);
-			void accumulate(boost::shared_ptr<TimeBlock> timeBlock);
-			boost::shared_ptr<TimeBlock> pop();
-			
-			uint32_t frameSize;
-		};
-		
 		uint32_t frameSize;
 		boost::shared_ptr<TimeBlock> pop(uint32_t size);
+		// Same, but writes the frame to output instead of allocating a block for it
+		void pop(TimeSample *output, uint32_t size);
 		inline FrameNum getCurrentFrameNum() { return currentFrameNum; }
 		
 		void reset();	
 		void print(float scale);
 
-		uint32_t count;		
-
-		void workThreadLoop();
-		unordered_map<FrameNum, int> workThreadFrameStatus;
+		// Partitions that weren't done by the time their frame went out, see Kernel::LatePolicy.
+		// Safe to read from any thread.
+		inline uint64_t getNumLatePartitions() { return numLatePartitions; }
+		// ...in every State in the process
+		static inline uint64_t getTotalLatePartitions() { return totalLatePartitions; }
+		inline void addLatePartitions(uint64_t numLate) {
+			__sync_add_and_fetch(&numLatePartitions, numLate);
+			__sync_add_and_fetch(&totalLatePartitions, numLate);
+		}
 
 	protected:
-		shared_ptr<LocklessQueue<WorkItem *> > workItems;
-
-		bool workThreadRunning;
-		bool releaseAccumulatorLockOnPop;
-		bool signalWorkerThreadOnPop;
+		volatile uint64_t numLatePartitions;
+		static volatile uint64_t totalLatePartitions;
 		
 		Kernel &convolver;
 		
-		pthread_t workThread;
 		pthread_mutex_t accumulatorMutex;
-		pthread_mutex_t workAvailableMutex;
-		pthread_cond_t  workAvailable;
 		pthread_cond_t  frameFinallyDone;
+		// Jobs in the WorkerPool that read from us or write into us, we can't go away until they're done
+		volatile int32_t numJobsInFlight;
 		
 		// Checked
 		FreqAccumulators freqAccumulators;	
 		TimeAccumulator timeAccumulator;
+		boost::shared_ptr<FrequencyDelayLine> frequencyDelayLine;
+		boost::shared_ptr<InputHistory> inputHistory;
+		boost::shared_ptr<TimeBlock> headAccumulator;
+		boost::shared_ptr<UniformAccumulator> uniformAccumulator;
+		vector<boost::shared_ptr<SpreadRequest> > spreadRequests;
+		
+		// A few for each partition size above the smallest, see getJobInput()
+		static const uint32_t kJobInputsPerSize = 4;
+		void reserveJobInputs(BlockPattern &blockPattern);
+		vector<boost::shared_ptr<TimeBlock> > jobInputs;
+		
+		// See defer(), made by reserveAccumulators()
+		typedef struct Deferral {
+			Deferral(uint32_t freqBlockSize) : spectrum(freqBlockSize) {}
+			FreqBlock spectrum;
+			// NULL while it's free. The ops into us it's for are marked deferred.
+			boost::shared_ptr<FrameRequest> request;
+		} Deferral;
+		static const uint32_t kDeferralsPerSize = 4;
+		vector<boost::shared_ptr<Deferral> > deferrals;
+		uint32_t numDeferralsUsed;
+		void addDeferred();
+		void forgetDeferred();
 		
 		FrameNum frameNum;
-		
-		void startWorkThread();
-		inline void signalThreadWorkAvailable() {
-			if (!workThreadRunning) startWorkThread();
-			pthread_cond_signal(&workAvailable);
-		}
-		
 	};
 }
 
@@ -30,12 +30,30 @@ namespace Convolver {
 	using std::vector;
 	using std::map;
 	
+	class FFT;
+	class SplitFFT;
+	class Kernel;
 	
 	typedef pair<FrameNum,FrameNum> FrameRequestID;
 	
+	// A spectrum waiting to go out, and how many worker jobs still have to add into it. They
+	// count themselves out atomically, so the audio thread never waits on a lock to find out.
+	typedef struct Accumulator {
+		Accumulator(uint32_t freqBlockSize) : block(freqBlockSize), numPending(0) {}
+		inline bool isPending() { return __sync_fetch_and_add(&numPending, 0) > 0; }
+		
+		FreqBlock block;
+		volatile uint32_t numPending;
+	} Accumulator;
+	
 	typedef struct ConvolutionOp {
 		shared_ptr<FreqBlock> block;
+		State *output;
 		FrameNum outputConvolutionStartingAt;
+		// Set when it's handed to a worker, which holds on to it until it's added into it
+		shared_ptr<Accumulator> accumulator;
+		// Waiting for output to do it, see State::defer()
+		bool deferred;
 	} ConvolutionOp;		
 	
 	class FrameRequest {
@@ -43,61 +61,295 @@ namespace Convolver {
 		static uint32_t maxRequests;
 		FrameRequest(FrameRequestID id) : id(id) { convolutionOps.reserve(maxRequests); }
 		
-		void lazilyConvolveWith(shared_ptr<FreqBlock> &block, FrameNum frameNum);
+		// Start over as a different request, keeping the storage
+		inline void reuse(FrameRequestID id) { this->id = id; convolutionOps.clear(); }
+		
+		void lazilyConvolveWith(shared_ptr<FreqBlock> &block, State *output, FrameNum frameNum);
 		vector<ConvolutionOp> &getLazyConvolutions();
 		
 		vector<ConvolutionOp> convolutionOps;
 		FrameRequestID id;
 	};	
 	
+	// Every frame of input somebody may still ask for, in one power of two ring of samples.
+	// Each frame is written twice, capacity frames apart, so any run of up to capacity
+	// frames can be read straight out of the ring even when it wraps around the end.
 	class FrameBuffer {
 	public:
-		FrameBuffer() : NEGATIVE_BUFFER_INDEX(std::numeric_limits<uint32_t>::max()), bufferOffset(0), frameNum(0) {}
-		
-		typedef deque<shared_ptr<TimeBlock> > Buffer;
+		FrameBuffer(uint32_t frameSize, FrameNum firstFrame = 0);
 		
 		void flushFramesBefore(FrameNum oldestFrameToKeep);
-		shared_ptr<TimeBlock> fulfill(FrameRequest &frameRequest, uint32_t frameSize, bool pad);
+		// The request's frames, in place: good until they're flushed, so copy them if
+		// they're going to outlive the frame
+		const TimeSample *fulfill(FrameRequest &frameRequest, uint32_t &numSamples);
+		const TimeSample *getFrames(FrameNum startFrame, FrameNum endFrame);
+		inline const TimeSample *getFrame(FrameNum frameNum) { return getFrames(frameNum, frameNum + 1); }
+		
 		FrameNum getFrameNum() { return frameNum; }
+		inline uint32_t getFrameSize() { return frameSize; }
+		inline uint32_t getNumFrames() { return frameNum - oldestFrame; }
+		// In frames, only grows, so once it covers the biggest partition pushing frames is free
+		inline uint32_t getCapacity() { return capacity; }
+		
+		// Every frame from frameNum up to the newest one was silent, flushed or not
+		inline bool silentSince(FrameNum frameNum) { return !heardSound || lastSoundFrame < frameNum; }
+		// Frames quieter than this (sum of squares) count as silence
+		static const float silentFrameEnergy;
 		
 		void test();		
 	protected:
-		FrameNum addFrame(shared_ptr<TimeBlock> &frame);
+		// Copies the samples into the ring, NULL samples is silence
+		FrameNum addFrame(const TimeSample *samples);
 		
 	private:
-		uint32_t NEGATIVE_BUFFER_INDEX; 
-		inline uint32_t frameNumToBufferIndex(FrameNum frameNum) {
-			if (frameNum < bufferOffset) {
-				return NEGATIVE_BUFFER_INDEX;
-			} else {
-				return frameNum - bufferOffset;
-			}
+		void grow();
+		inline uint32_t offsetOf(FrameNum frameNum) {
+			return (uint32_t)(frameNum & (capacity - 1)) * frameSize;
 		}
 		
-		Buffer buffer;
-		FrameNum bufferOffset;
+		// 2 * capacity frames long, the second half mirrors the first
+		TimeBlock ring;
+		uint32_t frameSize;
+		uint32_t capacity;
+		FrameNum oldestFrame;
 		FrameNum frameNum;
-		
+		FrameNum lastSoundFrame;
+		bool heardSound;
+
 		friend class State;
 	};
+
+	// Ring of input spectra for the uniformly partitioned (FDL) scheduler. Frame N's
+	// spectrum lives at spectra[N % spectra.size()], so partition j of a filter always
+	// multiplies against the spectrum for (currentFrame - j).
+	class FrequencyDelayLine {
+	public:
+		FrequencyDelayLine(uint32_t frameSize);
+
+		// Grow the ring so it remembers at least numPartitions spectra
+		void reserve(uint32_t numPartitions);
+
+		// The slot frameNum's spectrum goes in, whatever was there before falls off the end
+		FreqBlock &startSpectrum(FrameNum frameNum);
+		FreqBlock *getSpectrum(FrameNum frameNum);
+
+		// A silent frame takes its slot without a transform, and getSpectrum() is NULL for it
+		void startSilence(FrameNum frameNum);
+		// Nothing but silence in the last numPartitions frames, so there's nothing to MAC
+		inline bool silentFor(uint32_t numPartitions) { return !heardSound || newestFrame - lastSoundFrame >= numPartitions; }
+		
+		inline bool hasSpectrum(FrameNum frameNum) { return haveSpectrum && newestFrame == frameNum; }
+		inline uint32_t getNumPartitions() { return spectra.size(); }
+		inline uint32_t getFreqBlockSize() { return freqBlockSize; }
+
+	private:
+		vector<shared_ptr<FreqBlock> > spectra;
+		vector<bool> silent;
+		uint32_t freqBlockSize;
+		FrameNum newestFrame;
+		FrameNum lastSoundFrame;
+		bool haveSpectrum;
+		bool heardSound;
+	};
 	
-	class FrameRequests {
+	// Output side of the FDL scheduler. Every filter feeding a state MACs into one
+	// spectrum, pop() transforms it once and overlap-adds it into the frame going out.
+	class UniformAccumulator {
 	public:
-		FrameRequests(FrameNum initialFrame) : frameNum(initialFrame) {}
+		UniformAccumulator(uint32_t frameSize);
+		
+		inline uint32_t getFreqBlockSize() { return spectrum.size(); }
+		// Accumulate into this for the current frame
+		FreqBlock &get() { used = true; return spectrum; }
+		// Adds this frame's output (and the tail of the last one) to output
+		void pop(FFT &ffti, TimeSample *output);
+		void reset();
 		
-		// FIXME: we technically only need one map here, we can overrride the hash function
-		// to only use the endFrame, and then access the buckets when we want to
-		// retrieve an item
-		typedef unordered_map<FrameRequestID, shared_ptr<FrameRequest> > IDToRequestMap;
-		typedef unordered_map<FrameNum, list<FrameRequestID> > EndFrameToIDMap;
+	private:
+		FreqBlock spectrum;
+		TimeBlock transformed;
+		TimeBlock overlap;
+		uint32_t frameSize;
+		bool used;
+	};
+	
+	// Time domain output waiting to go out, as a ring of frames. A transformed accumulator
+	// is twice as long as its partition, so it spills over into the frames after this one.
+	class TimeAccumulator {
+	public:
+		TimeAccumulator(uint32_t frameSize);
+		
+		// Keeps whatever's waiting, cut up into the new size
+		void setFrameSize(uint32_t frameSize);
+		// Makes the ring at least numFrames long, so accumulate() never has to grow it
+		void reserve(uint32_t numFrames);
+		// Carries on in other's ring, which has to be at least as long as ours, with whatever's
+		// waiting in ours moved over. other gets ours. Nothing's allocated or freed.
+		void takeOver(TimeAccumulator &other);
+		// Adds numSamples into the current frame and as many after it as they cover
+		void accumulate(const TimeSample *samples, uint32_t numSamples);
+		// Adds the current frame into output, and moves on to the next one
+		void pop(TimeSample *output);
+		void clear();
+		
+	private:
+		void grow(uint32_t numFrames);
+		
+		TimeBlock samples;
+		uint32_t frameSize;
+		uint32_t numFrames;
+		uint32_t currentFrame;
+	};
+	
+	// Spectra waiting to be transformed and added to the output, a ring per partition size.
+	// A size's output frames all come round numFrames apart, so its accumulator for
+	// outputFrame lives in slot (outputFrame / numFrames) of the ring, and gets cleared and
+	// used again once that frame has gone out.
+	//
+	// Each slot's Accumulator also counts the worker jobs still to add into it. pop() never
+	// waits on them: a slot that's still pending when its frame goes out is late, and either
+	// goes out as it is (whatever's missing is dropped), or, with mixLate, stays put until
+	// the workers are done and then goes out with the part that's still ahead of us lined up
+	// where it belongs. Either way it isn't used again till they've let go of it.
+	//
+	// Only ever touched by the thread processing its State, the workers only see the
+	// Accumulators they were handed by addPending(). Every ring, and a spare Accumulator for
+	// each of its slots to swap in for one the workers are still holding, is made up front by
+	// reserve(), so the audio thread never allocates here.
+	class FreqAccumulators {
+	public:
+		FreqAccumulators(uint32_t frameSize);
+		
+		// Room for outputs of freqBlockSize up to framesFromNow ahead of the frame going out
+		// next. Off the audio thread, before the State's handed to it.
+		void reserve(uint32_t freqBlockSize, uint32_t framesFromNow);
+		// Carries on in other's rings, with whatever's waiting in ours moved over, and other
+		// gets ours. other has to have been reserved for at least as much as we were. Nothing's
+		// allocated or freed, so it's fine on the audio thread.
+		void takeOver(FreqAccumulators &other);
+		
+		// Zeroed the first time it's asked for, framesFromNow is how far outputFrame is
+		// from the frame going out next. It has to have been reserved for.
+		FreqBlock &get(uint32_t freqBlockSize, FrameNum outputFrame, uint32_t framesFromNow);
+		// The same, if it's still waiting to go out, or NULL
+		FreqBlock *find(uint32_t freqBlockSize, FrameNum outputFrame);
+		
+		// A worker's going to add into outputFrame, it counts itself out of what it's handed
+		shared_ptr<Accumulator> &addPending(uint32_t freqBlockSize, FrameNum outputFrame, uint32_t framesFromNow);
+		// Whether a worker still owes anything to frameNum
+		bool isPending(FrameNum frameNum);
+		
+		// Transforms everything due on frameNum (and anything late that's since been
+		// finished) and adds it into output. Returns how many slots were late.
+		uint32_t pop(FrameNum frameNum, Kernel &kernel, TimeAccumulator &output, bool mixLate);
+		void reset();
+		
+		inline bool empty() { return levels.empty(); }
+		
+	private:
+		typedef struct Slot {
+			shared_ptr<Accumulator> accumulator;
+			FrameNum outputFrame;
+			bool used;
+			// Its frame's gone out, we're waiting on the workers to mix it in late
+			bool late;
+			// ...or it went out without them, and we're only waiting for them to let go
+			bool dropped;
+		} Slot;
+		
+		typedef struct Level {
+			Level(uint32_t freqBlockSize, uint32_t numFrames, uint32_t timeDomainSize)
+				: freqBlockSize(freqBlockSize), numFrames(numFrames), numLate(0), transformed(timeDomainSize) {}
+			
+			uint32_t freqBlockSize;
+			uint32_t numFrames;
+			uint32_t numLate;
+			vector<Slot> slots;
+			// As many as there are slots, free once they're the only reference
+			vector<shared_ptr<Accumulator> > spares;
+			TimeBlock transformed;
+		} Level;
+		
+		Level *findLevel(uint32_t freqBlockSize);
+		Slot &getSlot(uint32_t freqBlockSize, FrameNum outputFrame, uint32_t framesFromNow);
+		void grow(Level &level, uint32_t numSlots);
+		void release(Level &level, Slot &slot);
+		// Adds whatever of slot's output is still to come (from frameNum on) into output
+		void transform(Level &level, Slot &slot, FrameNum frameNum, Kernel &kernel, TimeAccumulator &output);
+		
+		vector<Level> levels;
+		uint32_t frameSize;
+	};
+	
+	// The newest frame of input plus however much came before it, in one contiguous
+	// run so a time domain FIR can read back past the start of the frame.
+	class InputHistory {
+	public:
+		InputHistory(uint32_t frameSize);
+		
+		// Remember at least numPastSamples before the current frame
+		void reserve(uint32_t numPastSamples);
+		void push(FrameNum frameNum, const TimeSample *frame);
+		
+		inline bool hasFrame(FrameNum frameNum) { return haveFrame && newestFrame == frameNum; }
+		// Start of the newest frame, getNumPastSamples() valid samples precede it
+		inline const TimeSample *getFrame() { return &samples[numPastSamples]; }
+		inline uint32_t getNumPastSamples() { return numPastSamples; }
+		
+	private:
+		TimeBlock samples;
+		uint32_t frameSize;
+		uint32_t numPastSamples;
+		FrameNum newestFrame;
+		bool haveFrame;
+	};
+	
+	// Without worker threads, the request one partition level is working through a step
+	// per callback rather than all at once (see Kernel::setSpreadLargePartitions()): first
+	// the pieces of the input's transform, then a MAC per op, soonest output first.
+	class SpreadRequest {
+	public:
+		// numFrames is the level's size, it has until the next one comes due to finish
+		SpreadRequest(uint32_t frameSize, uint32_t numFrames, uint32_t numPhases);
+		
+		// Sorts request's ops and takes a copy of its input
+		void start(shared_ptr<FrameRequest> &request, const TimeSample *samples, FrameNum frameNum);
+		void finish();
+		inline bool busy() { return request != NULL; }
+		
+		uint32_t getNumSteps();
+		// The frame step stepNum has to be done by (before that frame's popped)
+		FrameNum getDeadline(uint32_t stepNum);
+		
+		shared_ptr<FrameRequest> request;
+		shared_ptr<SplitFFT> fft;
+		FreqBlock spectrum;
+		uint32_t numStepsDone;
+		
+	private:
+		uint32_t numFrames;
+		FrameNum lastFrame;
+	};
+	
+	// The requests that end on the current frame, at most one per partition size, shared by
+	// every filter reading this input. The Schedule says which are due, so all we do is
+	// hand them out, and reuse them next time round unless a worker thread still has one.
+	class FrameRequests {
+	public:
+		FrameRequests(FrameNum initialFrame);
 		
+		// endFrame is always the frame after the current one
 		shared_ptr<FrameRequest> &request(FrameNum startFrame, FrameNum endFrame);
-		list<shared_ptr<FrameRequest> > advanceToFrame(FrameNum frameNum);
-		FrameNum getOldestFrameRequested();
+		// The requests due on frameNum, good until the next call
+		vector<shared_ptr<FrameRequest> > &advanceToFrame(FrameNum frameNum);
+		// Input from before this frame is nothing to do with us (we were reset, say)
+		inline FrameNum getFirstFrame() { return firstFrame; }
 	private:
-		EndFrameToIDMap endFrameToIDs;
-		IDToRequestMap idsToRequests;
+		vector<shared_ptr<FrameRequest> > due;
+		vector<shared_ptr<FrameRequest> > ready;
+		vector<shared_ptr<FrameRequest> > spare;
 		FrameNum frameNum;
+		FrameNum firstFrame;
 		
 		// Just for debugging
 		friend class State;
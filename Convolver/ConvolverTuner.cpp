@@ -0,0 +1,286 @@
+/*
+ *  ConvolverTuner.cpp
+ *  Convolvotron
+ *
+ *  Created by Seth Nickell on 10/17/09.
+ *  Copyright 2009 Meatscience. All rights reserved.
+ *
+ */
+
+#include "ConvolverTuner.h"
+#include "ConvolverInternal.h"
+
+#include <sys/time.h>
+#include <stdlib.h>
+#include <iostream>
+
+using std::cout;
+using std::endl;
+using std::map;
+using std::vector;
+
+// Keep timing each operation until this much time has passed
+static const double minimumMeasureSeconds = 0.002;
+// We never build blocks bigger than this, the FFTs get slow and the memory silly
+static const uint32_t maximumTunerBlockSize = 65536;
+// No host hands us buffers smaller than this
+static const uint32_t minimumTunerFrameSize = 16;
+
+static double secondsNow() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+namespace Convolver {
+
+	Tuner::Tuner() {
+		pthread_mutex_init(&mutex, NULL);
+	}
+
+	Tuner::~Tuner() {
+		pthread_mutex_destroy(&mutex);
+	}
+
+	Tuner &Tuner::getSharedTuner() {
+		static Tuner sharedTuner;
+		return sharedTuner;
+	}
+
+	void Tuner::benchmark(uint32_t minBlockSize, uint32_t maxBlockSize) {
+		for (uint32_t blockSize = minBlockSize; blockSize <= maxBlockSize; blockSize *= 2) {
+			getBlockCost(blockSize);
+		}
+	}
+
+	void Tuner::benchmarkFrameSizes(uint32_t maxFrameSize) {
+		// Candidate patterns only ever double the frame size
+		benchmark(std::min(minimumTunerFrameSize, maxFrameSize), maximumTunerBlockSize);
+		benchmark(maxFrameSize, maximumTunerBlockSize);
+	}
+
+	Tuner::BlockCost &Tuner::getBlockCost(uint32_t timeBlockSize) {
+		pthread_mutex_lock(&mutex);
+		map<uint32_t, BlockCost>::iterator found = blockCosts.find(timeBlockSize);
+		if (found == blockCosts.end()) {
+			found = blockCosts.insert(std::make_pair(timeBlockSize, measure(timeBlockSize))).first;
+		}
+		pthread_mutex_unlock(&mutex);
+
+		return found->second;
+	}
+
+#if !USE_APPLE_ACCELERATE
+	void Tuner::chooseFFTBackend(uint32_t fftSize) {
+		TimeBlock timeBlock(fftSize);
+		for (uint32_t i=0; i < fftSize; i++) {
+			timeBlock[i] = (float)rand() / RAND_MAX - 0.5f;
+		}
+		FreqBlock freqBlock(FFT::getFreqDomainSize(fftSize));
+		
+		FFTBackend::Type fastest = FFT::getDefaultBackend();
+		double fastestSeconds = 0.0;
+		
+		for (int type=0; type < FFTBackend::NUM_BACKENDS; type++) {
+			shared_ptr<const FFTBackend> backend = FFTBackend::get((FFTBackend::Type)type, fftSize);
+			if (!backend) continue;
+			vector<float> scratch(backend->getScratchSize() + 1);
+			
+			double start = secondsNow();
+			uint32_t n;
+			for (n=0; n < 3 || secondsNow() - start < minimumMeasureSeconds; n++) {
+				backend->forward(timeBlock.cArray(), freqBlock.cArrayUnpacked(), &scratch[0]);
+				backend->inverse(freqBlock.cArrayUnpacked(), timeBlock.cArray(), &scratch[0]);
+				// Keep the numbers from running off to infinity
+				timeBlock.scale(1.0f / fftSize);
+			}
+			double seconds = (secondsNow() - start) / n;
+			
+#if DEBUG
+			cout << "Tuner::chooseFFTBackend(" << fftSize << "): " << FFTBackend::name((FFTBackend::Type)type) << "=" << seconds * 1e6 << "us" << endl;
+#endif
+			
+			if (fastestSeconds == 0.0 || seconds < fastestSeconds) {
+				fastest = (FFTBackend::Type)type;
+				fastestSeconds = seconds;
+			}
+		}
+		
+		FFT::setBackendForSize(fftSize, fastest);
+	}
+#endif
+
+	Tuner::BlockCost Tuner::measure(uint32_t timeBlockSize) {
+		uint32_t fftSize = timeBlockSize * 2;
+
+#if !USE_APPLE_ACCELERATE
+		if (!FFT::isDefaultBackendForced()) {
+			chooseFFTBackend(fftSize);
+		}
+#endif
+
+		TimeBlock timeBlock(fftSize);
+		for (uint32_t i=0; i < timeBlockSize; i++) {
+			timeBlock[i] = (float)rand() / RAND_MAX - 0.5f;
+		}
+
+		FFT &fft = kernel.getFFT(fftSize);
+		shared_ptr<FreqBlock> input = fft.fftr(timeBlock);
+		shared_ptr<FreqBlock> filter = fft.fftr(timeBlock);
+		FreqBlock accumulator(input->size());
+		FFT &ffti = kernel.getFFTI(input->size());
+
+		BlockCost cost;
+		double start;
+		uint32_t n;
+
+		start = secondsNow();
+		for (n=0; n < 3 || secondsNow() - start < minimumMeasureSeconds; n++) {
+			fft.fftr(timeBlock);
+		}
+		cost.fft = (secondsNow() - start) / n;
+
+		start = secondsNow();
+		for (n=0; n < 3 || secondsNow() - start < minimumMeasureSeconds; n++) {
+			ffti.fftri(accumulator);
+		}
+		cost.ifft = (secondsNow() - start) / n;
+
+		start = secondsNow();
+		for (n=0; n < 3 || secondsNow() - start < minimumMeasureSeconds; n++) {
+			kernel.multiplyAccumulate(*input, *filter, accumulator);
+		}
+		cost.multiplyAccumulate = (secondsNow() - start) / n;
+
+#if DEBUG
+		cout << "Tuner::measure(" << timeBlockSize << "): fft=" << cost.fft * 1e6 << "us, ifft=" << cost.ifft * 1e6;
+		cout << "us, mac=" << cost.multiplyAccumulate * 1e6 << "us" << endl;
+#endif
+
+		return cost;
+	}
+
+	TunerEstimate Tuner::estimate(shared_ptr<BlockPattern> blockPattern, uint32_t irLength, uint32_t numChannels, float sampleRate, bool useBackgroundThreads) {
+		uint32_t frameSize = blockPattern->minimumBlockSize();
+
+		// How many partitions of each size the IR ends up cut into
+		map<uint32_t, uint32_t> numPartitions;
+		uint32_t samplesCovered = 0;
+		for (uint32_t i=0; samplesCovered < irLength; i++) {
+			uint32_t blockSize = blockPattern->sizeForTimeBlock(i);
+			numPartitions[blockSize]++;
+			samplesCovered += blockSize;
+		}
+
+		double secondsPerFrame = 0.0;
+		double audioThreadWorstFrame = 0.0;
+		uint64_t memoryBytes = 0;
+		uint32_t biggestBlockSize = frameSize;
+
+		typedef map<uint32_t, uint32_t>::value_type Level;
+		foreach(Level &level, numPartitions) {
+			uint32_t blockSize = level.first;
+			uint32_t n = level.second;
+			uint32_t framesPerBlock = blockSize / frameSize;
+			BlockCost &cost = getBlockCost(blockSize);
+
+			// Every framesPerBlock frames: transform the input once, MAC each partition into
+			// its own accumulator, and IFFT one accumulator when it reaches the front
+			double levelSeconds = cost.fft + n * cost.multiplyAccumulate + cost.ifft;
+			secondsPerFrame += levelSeconds / framesPerBlock;
+
+			// Every level comes due on the same frame now and then. With workers only the
+			// smallest level stays on the audio thread, but the IFFTs always happen in pop().
+			bool onAudioThread = !useBackgroundThreads || blockSize == frameSize;
+			audioThreadWorstFrame += onAudioThread ? levelSeconds : cost.ifft;
+
+			// Filter spectra, and about as many accumulators waiting to be output
+			uint64_t freqBlockBytes = (uint64_t)FFT::getFreqDomainSize(blockSize * 2) * sizeof(FreqSample);
+			memoryBytes += 2 * n * freqBlockBytes;
+
+			biggestBlockSize = std::max(biggestBlockSize, blockSize);
+		}
+
+		// The FrameBuffer's mirrored ring holds about four of the biggest blocks, the TimeAccumulator two
+		memoryBytes += 6 * biggestBlockSize * sizeof(TimeSample);
+		memoryBytes *= numChannels;
+
+		double secondsAvailable = frameSize / sampleRate;
+
+		TunerEstimate estimate;
+		estimate.blockPattern = blockPattern;
+		estimate.cpuPercent = 100.0 * numChannels * secondsPerFrame / secondsAvailable;
+		estimate.audioThreadPercent = 100.0 * numChannels * audioThreadWorstFrame / secondsAvailable;
+		estimate.memoryBytes = memoryBytes;
+		estimate.latencyFrames = frameSize;
+
+		return estimate;
+	}
+
+	vector<shared_ptr<BlockPattern> > Tuner::candidatePatterns(uint32_t frameSize, uint32_t irLength) {
+		uint32_t maxBlockSize = frameSize;
+		while (maxBlockSize < irLength && maxBlockSize * 2 <= maximumTunerBlockSize) maxBlockSize *= 2;
+
+		vector<shared_ptr<BlockPattern> > patterns;
+		patterns.push_back(shared_ptr<BlockPattern>(new FixedSizeBlockPattern(frameSize)));
+
+		for (uint32_t k = 2; frameSize * k <= maxBlockSize; k *= 2) {
+			patterns.push_back(shared_ptr<BlockPattern>(new TwoSizeBlockPattern(frameSize, frameSize * k, k)));
+			patterns.push_back(shared_ptr<BlockPattern>(new DoublingBlockPattern(frameSize, frameSize * k)));
+		}
+
+		for (uint32_t a = 4; frameSize * a * 2 <= maxBlockSize; a *= 2) {
+			for (uint32_t b = 2; frameSize * a * b <= maxBlockSize; b *= 2) {
+				patterns.push_back(shared_ptr<BlockPattern>(new ThreeSizeBlockPattern(frameSize, frameSize * a, frameSize * a * b, a, b)));
+			}
+		}
+
+		return patterns;
+	}
+
+	TunerEstimate Tuner::choose(uint32_t frameSize, uint32_t irLength, uint32_t numChannels, float sampleRate, bool useBackgroundThreads, float maxAudioThreadPercent) {
+		vector<shared_ptr<BlockPattern> > patterns = candidatePatterns(frameSize, irLength);
+
+		TunerEstimate best;
+		bool haveBest = false;
+		bool bestFits = false;
+
+		foreach(shared_ptr<BlockPattern> &pattern, patterns) {
+			TunerEstimate candidate = estimate(pattern, irLength, numChannels, sampleRate, useBackgroundThreads);
+
+			bool fits = candidate.audioThreadPercent <= maxAudioThreadPercent;
+
+#if DEBUG
+			cout << "Tuner::choose(): " << pattern->toString() << " cpu=" << candidate.cpuPercent << "% audioThread=";
+			cout << candidate.audioThreadPercent << "% memory=" << candidate.memoryBytes << endl;
+#endif
+
+			// Anything that fits beats anything that doesn't, then the cheapest wins.
+			// If nothing fits, go for whatever is kindest to the audio thread.
+			bool better;
+			if (!haveBest) {
+				better = true;
+			} else if (fits != bestFits) {
+				better = fits;
+			} else if (fits) {
+				better = candidate.cpuPercent < best.cpuPercent;
+			} else {
+				better = candidate.audioThreadPercent < best.audioThreadPercent;
+			}
+
+			if (better) {
+				best = candidate;
+				bestFits = fits;
+				haveBest = true;
+			}
+		}
+
+		assert(haveBest);
+
+#if DEBUG
+		cout << "Tuner::choose(): picked " << best.blockPattern->toString() << " for frameSize=" << frameSize << ", irLength=" << irLength << endl;
+#endif
+
+		return best;
+	}
+}
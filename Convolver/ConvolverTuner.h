@@ -0,0 +1,88 @@
+/*
+ *  ConvolverTuner.h
+ *  Convolvotron
+ *
+ *  Created by Seth Nickell on 10/17/09.
+ *  Copyright 2009 Meatscience. All rights reserved.
+ *
+ */
+
+#ifndef _ConvolverTuner_h__
+#define _ConvolverTuner_h__
+
+namespace Convolver {
+	class Tuner;
+}
+
+#include "ConvolverTypes.h"
+#include "ConvolverKernel.h"
+
+#include <map>
+#include <vector>
+#include <pthread.h>
+#include <boost/shared_ptr.hpp>
+
+namespace Convolver {
+	using boost::shared_ptr;
+
+	// What running a given IR through a given BlockPattern is predicted to cost
+	typedef struct TunerEstimate {
+		shared_ptr<BlockPattern> blockPattern;
+		float cpuPercent;		// of one core, summed over the audio and worker threads
+		float audioThreadPercent;	// worst single frame on the audio thread
+		uint64_t memoryBytes;
+		uint32_t latencyFrames;
+	} TunerEstimate;
+
+	// Picks a BlockPattern by measuring how long FFTs and MACs take on this machine and
+	// plugging that into a cost model. Measurements are cached, so sharing one Tuner
+	// between instances (see getSharedTuner()) means we only pay for them once.
+	class Tuner {
+	public:
+		Tuner();
+		~Tuner();
+
+		static Tuner &getSharedTuner();
+
+		// Measure every block size between the two up front, otherwise sizes are measured
+		// the first time an estimate needs them. Unless a backend was forced with
+		// FFT::setDefaultBackend() or $CONVOLVER_FFT_BACKEND, this also picks the
+		// fastest FFT backend for each size.
+		void benchmark(uint32_t minBlockSize, uint32_t maxBlockSize);
+
+		// Everything choose() needs for maxFrameSize and any power of two frameSize below it,
+		// so a host changing its buffer size later only costs cached lookups
+		void benchmarkFrameSizes(uint32_t maxFrameSize);
+
+		// Predicted cost of convolving numChannels channels with an IR of irLength samples.
+		// Safe to call before the IR is loaded, nothing is allocated for it.
+		TunerEstimate estimate(shared_ptr<BlockPattern> blockPattern, uint32_t irLength, uint32_t numChannels, float sampleRate, bool useBackgroundThreads=true);
+
+		// Cheapest pattern whose latency is at most the host's frameSize. Patterns that
+		// would put more than maxAudioThreadPercent on the audio thread are avoided if we can.
+		TunerEstimate choose(uint32_t frameSize, uint32_t irLength, uint32_t numChannels, float sampleRate, bool useBackgroundThreads=true, float maxAudioThreadPercent=25.0f);
+
+		std::vector<shared_ptr<BlockPattern> > candidatePatterns(uint32_t frameSize, uint32_t irLength);
+
+	private:
+		// Seconds per operation on blocks of timeBlockSize samples (FFT size is 2x that)
+		typedef struct BlockCost {
+			double fft;
+			double ifft;
+			double multiplyAccumulate;
+		} BlockCost;
+
+		BlockCost &getBlockCost(uint32_t timeBlockSize);
+		BlockCost measure(uint32_t timeBlockSize);
+#if !USE_APPLE_ACCELERATE
+		// Time every FFT backend that can do fftSize and make the fastest one its default
+		void chooseFFTBackend(uint32_t fftSize);
+#endif
+
+		Kernel kernel;
+		std::map<uint32_t, BlockCost> blockCosts;
+		pthread_mutex_t mutex;
+	};
+};
+
+#endif
@@ -50,22 +50,23 @@ uint32_t Convolver::BlockPattern::sizeForFreqBlock(uint32_t blockNum) {
 
 namespace Convolver {
 	FreqBlock::FreqBlock(uint32_t size)
-	: mSize(size), splitComplexNumComplex(size - 1)
+	: mSize(size), splitComplexNumComplex(size - 1), firstBin(0), numBins(size)
 	{
 		splitComplex = new DSPSplitComplex;
-		splitComplex->realp = new float[splitComplexNumComplex]();
-		splitComplex->imagp = new float[splitComplexNumComplex]();
+		splitComplex->realp = (float *)BlockPool::allocate(splitComplexNumComplex * sizeof(float));
+		splitComplex->imagp = (float *)BlockPool::allocate(splitComplexNumComplex * sizeof(float));
+		clear();
 	}
 	
 	FreqBlock::FreqBlock(uint32_t size, DSPSplitComplex *splitComplex)
-	: mSize(size), splitComplex(splitComplex), splitComplexNumComplex(size - 1)
+	: mSize(size), splitComplex(splitComplex), splitComplexNumComplex(size - 1), firstBin(0), numBins(size)
 	{
 		
 	}
 	
 	FreqBlock::~FreqBlock() {
-		delete splitComplex->realp;
-		delete splitComplex->imagp;
+		BlockPool::deallocate(splitComplex->realp, splitComplexNumComplex * sizeof(float));
+		BlockPool::deallocate(splitComplex->imagp, splitComplexNumComplex * sizeof(float));
 		delete splitComplex;
 		
 #if DEBUG_MEMORY
@@ -94,11 +95,22 @@ namespace Convolver {
 		}
 	}
 	
+	void Convolver::FreqBlock::clear() {
+		std::fill(splitComplex->realp, splitComplex->realp + splitComplexNumComplex, 0.0f);
+		std::fill(splitComplex->imagp, splitComplex->imagp + splitComplexNumComplex, 0.0f);
+	}
+	
+	void Convolver::FreqBlock::copyFrom(FreqBlock &other) {
+		assert(other.size() == size());
+		std::copy(other.splitComplex->realp, other.splitComplex->realp + splitComplexNumComplex, splitComplex->realp);
+		std::copy(other.splitComplex->imagp, other.splitComplex->imagp + splitComplexNumComplex, splitComplex->imagp);
+	}
+	
 }
 #else
 namespace Convolver {
 
-	FreqBlock::FreqBlock(uint32_t size) : block(size) { 
+	FreqBlock::FreqBlock(uint32_t size) : block(size), firstBin(0), numBins(size) { 
 	}
 	
 	FreqBlock::~FreqBlock() {
@@ -120,6 +132,16 @@ namespace Convolver {
 			sample.i *= by;
 		}
 	}
+	
+	void Convolver::FreqBlock::clear() {
+		FreqSample zero = {0.0f, 0.0f};
+		std::fill(block.begin(), block.end(), zero);
+	}
+	
+	void Convolver::FreqBlock::copyFrom(FreqBlock &other) {
+		assert(other.size() == size());
+		std::copy(other.block.begin(), other.block.end(), block.begin());
+	}
 
 }
 #endif
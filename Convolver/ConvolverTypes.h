@@ -15,6 +15,8 @@ namespace Convolver {
 }
 
 #include "ConvolverFFTType.h"
+#include "ConvolverAlignedAllocator.h"
+#include "ConvolverBlockPool.h"
 #include <vector>
 #include <iostream>
 #include <boost/array.hpp>
@@ -131,10 +133,36 @@ namespace Convolver {
 		
 		uint32_t size();
 		void scale(float by);
+		void clear();
 		void print();
+		// Just the bins, other's range stays its own
+		void copyFrom(FreqBlock &other);
+		
+		// Only bins [firstBin, firstBin + numBins) of a filter block are worth multiplying,
+		// the Kernel's MACs leave the rest of the accumulator alone. The whole block by default.
+		// The loader sets a range on blocks the workers may already be reading, so numBins
+		// goes in last and getBinRange() reads it first: they see the bins and all of the
+		// range, or an empty block, never one half of the range with the other's old value.
+		inline void setBinRange(uint32_t firstBin, uint32_t numBins) {
+			this->firstBin = firstBin;
+			__sync_synchronize();
+			this->numBins = numBins;
+		}
+		inline void getBinRange(uint32_t &firstBin, uint32_t &numBins) {
+			numBins = this->numBins;
+			__sync_synchronize();
+			firstBin = this->firstBin;
+		}
+		inline uint32_t getFirstBin() { return firstBin; }
+		inline uint32_t getNumBins() { return numBins; }
+		
+		// Blocks come and go on both the audio and worker threads, keep them off malloc
+		static void *operator new(size_t numBytes) { return BlockPool::allocate(numBytes); }
+		static void operator delete(void *memory, size_t numBytes) { BlockPool::deallocate(memory, numBytes); }
 		
 #if USE_APPLE_ACCELERATE
 	public:
+		// Takes ownership, realp and imagp must come from the BlockPool
 		FreqBlock(uint32_t size, DSPSplitComplex *splitComplex);
 		FreqBlock(uint32_t size);		
 		inline DSPSplitComplex* dspSplitComplex() {
@@ -152,11 +180,15 @@ namespace Convolver {
 			return &block.front();
 		}
 	private:
-		std::vector<FreqSample> block;
+		std::vector<FreqSample, PoolAllocator<FreqSample> > block;
 #endif
+		volatile uint32_t firstBin;
+		volatile uint32_t numBins;
 	};
 	
-	class TimeBlock : public std::vector<TimeSample> {
+	typedef std::vector<TimeSample, PoolAllocator<TimeSample> > TimeSamples;
+	
+	class TimeBlock : public TimeSamples {
 	public:
 		static uint32_t numTimeBlocks;
 		inline void init() {
@@ -165,12 +197,12 @@ namespace Convolver {
 			numTimeBlocks++;
 #endif
 		}
-		TimeBlock(uint32_t size) : std::vector<TimeSample>(size) { init(); };
-		TimeBlock(uint32_t size, const TimeSample* data, uint32_t dataSize) : std::vector<TimeSample>(size) {
+		TimeBlock(uint32_t size) : TimeSamples(size) { init(); };
+		TimeBlock(uint32_t size, const TimeSample* data, uint32_t dataSize) : TimeSamples(size) {
 			std::copy(data, data+dataSize, cArray());
 			init();
 		};
-		TimeBlock(const TimeSample* dataStart, const TimeSample* dataEnd) : std::vector<TimeSample>(dataStart, dataEnd) { 
+		TimeBlock(const TimeSample* dataStart, const TimeSample* dataEnd) : TimeSamples(dataStart, dataEnd) { 
 			init();
 		}
 		
@@ -185,6 +217,9 @@ namespace Convolver {
 			return &front();
 		}
 		
+		static void *operator new(size_t numBytes) { return BlockPool::allocate(numBytes); }
+		static void operator delete(void *memory, size_t numBytes) { BlockPool::deallocate(memory, numBytes); }
+		
 		void scale(float by);
 		
 		void accumulate(TimeBlock &anotherBlock);
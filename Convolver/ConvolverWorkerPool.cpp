@@ -0,0 +1,379 @@
+/*
+ *  ConvolverWorkerPool.cpp
+ *  Convolvotron
+ *
+ *  Created by Seth Nickell on 10/18/09.
+ *  Copyright 2009 Meatscience. All rights reserved.
+ *
+ */
+
+#include "ConvolverWorkerPool.h"
+#include "ConvolverState.h"
+#include "ConvolverKernel.h"
+#include "DebugSettings.h"
+
+#include <iostream>
+#include <algorithm>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/time.h>
+
+#ifdef __APPLE__
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/thread_policy.h>
+#endif
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using boost::shared_ptr;
+
+namespace Convolver {
+	// Backstop for a wake() that lands between a worker checking for jobs and going to
+	// sleep, the audio thread can't always take the mutex to rule that out
+	static const long kIdleWaitNanoseconds = 2000000;
+
+	// Orders the heap with the soonest deadline on top
+	static bool dueLater(const WorkerPool::Job &a, const WorkerPool::Job &b) {
+		return a.deadline > b.deadline;
+	}
+
+	static WorkerPool *pool = NULL;
+	static pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
+
+	void WorkerPool::createPool() {
+		long numCores = sysconf(_SC_NPROCESSORS_ONLN);
+		// Leave a core for the host's audio thread
+		uint32_t numWorkers = numCores > 2 ? numCores - 1 : 1;
+		pool = new WorkerPool(numWorkers);
+	}
+
+	WorkerPool &WorkerPool::get() {
+		pthread_once(&poolOnce, &createPool);
+		return *pool;
+	}
+
+	uint64_t WorkerPool::now() {
+#ifdef __APPLE__
+		static mach_timebase_info_data_t timebase;
+		if (timebase.denom == 0) mach_timebase_info(&timebase);
+		return mach_absolute_time() * timebase.numer / timebase.denom / 1000;
+#else
+		timespec time;
+		clock_gettime(CLOCK_MONOTONIC, &time);
+		return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+#endif
+	}
+
+	WorkerPool::Tier::Tier(uint32_t index, uint32_t numQueues) : index(index), nextQueue(0), numQueuedJobs(0) {
+		for (uint32_t i=0; i < numQueues; i++) {
+			queues.push_back(shared_ptr<LockFreeQueue<Job> >(new LockFreeQueue<Job>(kQueueCapacity)));
+		}
+		heap.reserve(numQueues * kQueueCapacity);
+		pthread_mutex_init(&heapMutex, NULL);
+		pthread_mutex_init(&workAvailableMutex, NULL);
+		pthread_cond_init(&workAvailable, NULL);
+	}
+
+	WorkerPool::WorkerPool(uint32_t numWorkers) : numTiers(0), numWorkers(numWorkers), numSubmitted(0), numRejected(0), numSkipped(0) {
+		pthread_mutex_init(&tiersMutex, NULL);
+		for (int i=0; i < kNumSizeClasses; i++) expectedMicroseconds[i] = 0;
+		
+		tiers.reserve(kMaxTiers);
+		// Level 1, which every threaded BlockPattern has
+		reserveTiers(2);
+	}
+
+	void WorkerPool::reserveTiers(uint32_t numLevels) {
+		pthread_mutex_lock(&tiersMutex); {
+			while (numTiers < kMaxTiers && numTiers + 1 < numLevels) addTier();
+		} pthread_mutex_unlock(&tiersMutex);
+	}
+
+	void WorkerPool::addTier() {
+		shared_ptr<Tier> tier(new Tier(numTiers, numWorkers));
+
+		// Never reallocates, so submit() and the workers can be reading the ones before it all along
+		tiers.push_back(tier);
+		__sync_synchronize();
+		numTiers++;
+
+		// Every worker's in the vector before any of them go looking for work
+		for (uint32_t i=0; i < numWorkers; i++) {
+			tier->workers.push_back(shared_ptr<Worker>(new Worker(this, &*tier, i)));
+		}
+		for (uint32_t i=0; i < numWorkers; i++) {
+			startWorker(*tier->workers[i]);
+		}
+
+		#if DEBUG
+		cout << "WorkerPool::addTier(): added a tier for level " << numTiers << endl;
+		#endif
+	}
+
+	uint32_t WorkerPool::getTier(uint32_t level) {
+		uint32_t tier = level > 0 ? level - 1 : 0;
+		return std::min(tier, numTiers - 1);
+	}
+
+	void *WorkerPool::workerEntry(void *arguments) {
+		Worker &worker = *(Worker *)arguments;
+		worker.pool->workerLoop(worker);
+		return NULL;
+	}
+
+	void WorkerPool::startWorker(Worker &worker) {
+		int result;
+
+		pthread_attr_t threadAttr;
+		result = pthread_attr_init(&threadAttr);
+		assert(result == 0);
+
+		// The bottom of the realtime priorities: ahead of whatever the host isn't running in
+		// realtime, behind its audio thread, and each tier behind the ones for smaller levels
+		sched_param schedParam;
+		schedParam.sched_priority = sched_get_priority_min(SCHED_FIFO) + kMaxTiers - 1 - worker.tier->index;
+		result = pthread_attr_setinheritsched(&threadAttr, PTHREAD_EXPLICIT_SCHED);
+		assert(result == 0);
+		result = pthread_attr_setschedpolicy(&threadAttr, SCHED_FIFO);
+		assert(result == 0);
+		result = pthread_attr_setschedparam(&threadAttr, &schedParam);
+		assert(result == 0);
+
+		result = pthread_create(&worker.thread, &threadAttr, &workerEntry, &worker);
+		pthread_attr_destroy(&threadAttr);
+		if (result == EPERM) {
+			// Not allowed realtime threads, so make do with the default
+			#if DEBUG_CONVOLVE_THREADS
+			cerr << "WorkerPool::startWorker(): no realtime priority for tier " << worker.tier->index << " worker " << worker.index << endl;
+			#endif
+			result = pthread_create(&worker.thread, NULL, &workerEntry, &worker);
+		}
+		assert(result == 0);
+
+		// Keep each worker on its own core, so its spectra stay in that core's cache
+#ifdef __APPLE__
+		// OS X only takes hints: threads with different tags get kept apart
+		thread_affinity_policy_data_t affinity = { (integer_t)worker.index + 1 };
+		thread_policy_set(pthread_mach_thread_np(worker.thread), THREAD_AFFINITY_POLICY, (thread_policy_t)&affinity, THREAD_AFFINITY_POLICY_COUNT);
+#elif defined(__linux__)
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(worker.index % CPU_SETSIZE, &cpus);
+		pthread_setaffinity_np(worker.thread, sizeof(cpus), &cpus);
+#endif
+	}
+
+	bool WorkerPool::submit(Job &job) {
+		Tier &tier = *tiers[getTier(job.level)];
+		uint32_t numQueues = tier.queues.size();
+		uint32_t start = __sync_fetch_and_add(&tier.nextQueue, 1);
+
+		for (uint32_t i=0; i < numQueues; i++) {
+			if (tier.queues[(start + i) % numQueues]->push(job)) {
+				__sync_add_and_fetch(&tier.numQueuedJobs, 1);
+				__sync_add_and_fetch(&numSubmitted, 1);
+				return true;
+			}
+		}
+
+		__sync_add_and_fetch(&numRejected, 1);
+		return false;
+	}
+
+	void WorkerPool::wake() {
+		uint32_t numTiers = this->numTiers;
+		for (uint32_t i=0; i < numTiers; i++) {
+			if (tiers[i]->numQueuedJobs > 0) wake(*tiers[i]);
+		}
+	}
+
+	void WorkerPool::wake(Tier &tier) {
+		// If we get the mutex, no worker can be between checking for jobs and waiting
+		if (pthread_mutex_trylock(&tier.workAvailableMutex) == 0) {
+			pthread_cond_signal(&tier.workAvailable);
+			pthread_mutex_unlock(&tier.workAvailableMutex);
+		} else {
+			pthread_cond_signal(&tier.workAvailable);
+		}
+	}
+
+	bool WorkerPool::takeJob(Tier &tier, Job &job) {
+		std::vector<Job> &heap = tier.heap;
+		pthread_mutex_lock(&tier.heapMutex);
+
+		uint32_t numQueues = tier.queues.size();
+		for (uint32_t i=0; i < numQueues && heap.size() < heap.capacity(); i++) {
+			LockFreeQueue<Job> &jobs = *tier.queues[i];
+			Job queued;
+			while (heap.size() < heap.capacity() && jobs.pop(queued)) {
+				heap.push_back(queued);
+				std::push_heap(heap.begin(), heap.end(), &dueLater);
+			}
+		}
+
+		if (heap.empty()) {
+			pthread_mutex_unlock(&tier.heapMutex);
+			return false;
+		}
+
+		std::pop_heap(heap.begin(), heap.end(), &dueLater);
+		Job &soonest = heap.back();
+		job.state = soonest.state;
+		job.input.swap(soonest.input);
+		job.request.swap(soonest.request);
+		job.frameNum = soonest.frameNum;
+		job.level = soonest.level;
+		job.deadline = soonest.deadline;
+		job.skipIfLate = soonest.skipIfLate;
+		heap.pop_back();
+
+		pthread_mutex_unlock(&tier.heapMutex);
+
+		__sync_sub_and_fetch(&tier.numQueuedJobs, 1);
+		return true;
+	}
+
+	int WorkerPool::sizeClassFor(uint32_t numSamples) {
+		int sizeClass = 0;
+		while (numSamples > 1 && sizeClass < kNumSizeClasses - 1) {
+			numSamples >>= 1;
+			sizeClass++;
+		}
+		return sizeClass;
+	}
+
+	bool WorkerPool::canMakeDeadline(Job &job) {
+		// Until we've timed one this big, give it the benefit of the doubt
+		uint64_t expected = expectedMicroseconds[sizeClassFor(job.input->size())];
+		return now() + expected <= job.deadline;
+	}
+
+	void WorkerPool::run(Kernel &kernel, Job &job) {
+		uint64_t start = now();
+
+		bool inWorkThread = true;
+		kernel.convolve(*job.state, job.input->cArray(), job.input->size(), job.request, job.frameNum, inWorkThread);
+		job.state->jobFinished(*job.request);
+
+		// Workers racing on this only cost us a sample of the average
+		volatile uint64_t &expected = expectedMicroseconds[sizeClassFor(job.input->size())];
+		uint64_t took = now() - start;
+		expected = expected == 0 ? took : (7 * expected + took) / 8;
+
+		job.input.reset();
+		job.request.reset();
+	}
+
+	void WorkerPool::skip(Job &job) {
+		__sync_add_and_fetch(&numSkipped, 1);
+		#if DEBUG_CONVOLVE_THREADS
+		cerr << "WorkerPool::skip(): " << job.input->size() << " samples due in " << (int64_t)(job.deadline - now()) << "us, we'd never make it" << endl;
+		#endif
+
+		job.state->abandonFrameRequest(*job.request);
+		job.state->jobFinished(*job.request);
+
+		job.input.reset();
+		job.request.reset();
+	}
+
+	void WorkerPool::workerLoop(Worker &worker) {
+		// Our own FFTs and scratch spectra
+		Kernel kernel;
+
+		Tier &tier = *worker.tier;
+		Job job;
+		while (true) {
+			// Whatever's more urgent than this is on a higher priority thread
+			if (tier.numQueuedJobs > 0 && takeJob(tier, job)) {
+				// There's more where that came from, get somebody else on it
+				if (tier.numQueuedJobs > 0) pthread_cond_signal(&tier.workAvailable);
+
+				if (job.skipIfLate && !canMakeDeadline(job)) {
+					skip(job);
+				} else {
+					run(kernel, job);
+				}
+				continue;
+			}
+
+			pthread_mutex_lock(&tier.workAvailableMutex); {
+				if (tier.numQueuedJobs == 0) {
+					timeval now;
+					gettimeofday(&now, NULL);
+					long nanoseconds = now.tv_usec * 1000 + kIdleWaitNanoseconds;
+					timespec until = { now.tv_sec + nanoseconds / 1000000000, nanoseconds % 1000000000 };
+					pthread_cond_timedwait(&tier.workAvailable, &tier.workAvailableMutex, &until);
+				}
+			} pthread_mutex_unlock(&tier.workAvailableMutex);
+		}
+	}
+
+	static Releaser *releaser = NULL;
+	static pthread_once_t releaserOnce = PTHREAD_ONCE_INIT;
+
+	void Releaser::createReleaser() {
+		releaser = new Releaser();
+	}
+
+	Releaser &Releaser::get() {
+		pthread_once(&releaserOnce, &createReleaser);
+		return *releaser;
+	}
+
+	Releaser::Releaser() : garbage(kQueueCapacity) {
+		pthread_mutex_init(&garbageAvailableMutex, NULL);
+		pthread_cond_init(&garbageAvailable, NULL);
+
+		// Default priority, nobody's waiting on us
+		int result = pthread_create(&thread, NULL, &releaserEntry, this);
+		assert(result == 0);
+	}
+
+	bool Releaser::release(shared_ptr<void> &garbage) {
+		if (!this->garbage.pushSwap(garbage)) {
+			#if DEBUG
+			cerr << "Releaser::release(): queue's full, releasing on the caller's thread" << endl;
+			#endif
+			return false;
+		}
+
+		// Same as WorkerPool::wake(), the timed wait covers us if we miss
+		if (pthread_mutex_trylock(&garbageAvailableMutex) == 0) {
+			pthread_cond_signal(&garbageAvailable);
+			pthread_mutex_unlock(&garbageAvailableMutex);
+		} else {
+			pthread_cond_signal(&garbageAvailable);
+		}
+		return true;
+	}
+
+	void *Releaser::releaserEntry(void *arguments) {
+		((Releaser *)arguments)->releaserLoop();
+		return NULL;
+	}
+
+	void Releaser::releaserLoop() {
+		shared_ptr<void> object;
+		while (true) {
+			if (garbage.pop(object)) {
+				object.reset();
+				continue;
+			}
+
+			pthread_mutex_lock(&garbageAvailableMutex); {
+				if (garbage.empty()) {
+					timeval now;
+					gettimeofday(&now, NULL);
+					long nanoseconds = now.tv_usec * 1000 + kIdleWaitNanoseconds;
+					timespec until = { now.tv_sec + nanoseconds / 1000000000, nanoseconds % 1000000000 };
+					pthread_cond_timedwait(&garbageAvailable, &garbageAvailableMutex, &until);
+				}
+			} pthread_mutex_unlock(&garbageAvailableMutex);
+		}
+	}
+}
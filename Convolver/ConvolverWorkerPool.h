@@ -0,0 +1,209 @@
+/*
+ *  ConvolverWorkerPool.h
+ *  Convolvotron
+ *
+ *  Created by Seth Nickell on 10/18/09.
+ *  Copyright 2009 Meatscience. All rights reserved.
+ *
+ */
+
+#ifndef _ConvolverWorkerPool_h__
+#define _ConvolverWorkerPool_h__
+
+#include <stdint.h>
+#include <pthread.h>
+
+namespace Convolver {
+	class WorkerPool;
+	class State;
+	class FrameRequest;
+	class Kernel;
+	typedef uint64_t FrameNum;
+}
+
+#include "ConvolverTypes.h"
+#include "LockFreeQueue.h"
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+namespace Convolver {
+	// The threads that convolve the big partitions, shared by every State in the process.
+	//
+	// Each partition level the audio thread hands off (level 1 up, see
+	// Kernel::getPartitionLevel()) gets its own tier: a worker per core (bar one for the
+	// host's audio thread), each pinned to its core, that only ever run that level's jobs.
+	// A level's partitions have as many callbacks to finish in as it's frames long, so the
+	// smaller the level the sooner its work is due, and the tiers run at realtime priorities
+	// that go down as the level goes up, all of them below the host's audio thread. So a
+	// level 1 job that turns up while a core's busy with a level 4 one preempts it then and
+	// there, rather than waiting for it to finish. The big levels soak up whatever time the
+	// small ones leave, and the audio thread only ever does level 0, however long the IR.
+	// Where the system won't give us realtime threads they all run at the default priority,
+	// and the levels just share the cores.
+	//
+	// Each tier is one earliest-deadline-first queue its workers all share, there's no work
+	// stealing. The audio threads deal jobs out across a lock-free inbox per worker, so
+	// they never wait on each other or on a worker. Whichever of the tier's workers comes
+	// looking next takes the tier's heapMutex, moves everything in the inboxes into the
+	// deadline heap, and takes the job due soonest, whoever it's from. So a burst of big
+	// partitions from one channel gets spread over every core, and an instance running small
+	// frames gets its work done ahead of one with frames to spare. The cost is that the
+	// tier's workers take turns at the heap for every job.
+	//
+	// The audio thread never allocates or takes a lock in here: the inboxes are fixed size.
+	// When they're all full submit() says so, and the caller runs the job itself (see
+	// getNumRejected()). The heaps' locks are only ever taken by workers.
+	class WorkerPool {
+	public:
+		static const uint32_t kQueueCapacity = 256;
+		// Levels past the last tier share it
+		static const uint32_t kMaxTiers = 8;
+
+		typedef struct Job {
+			// The input the request was cut from
+			State *state;
+			boost::shared_ptr<TimeBlock> input;
+			boost::shared_ptr<FrameRequest> request;
+			FrameNum frameNum;
+			// The request's partition level, which picks the tier
+			uint32_t level;
+			// When the first output it feeds gets popped, on the now() clock
+			uint64_t deadline;
+			// Rather than start it when we expect to finish too late, give up on it
+			bool skipIfLate;
+		} Job;
+
+		// The first call starts the workers, so make it somewhere other than the audio thread
+		static WorkerPool &get();
+		// Makes sure there's a tier for every level up to numLevels - 1. Call it off the
+		// audio thread once the BlockPattern's known.
+		void reserveTiers(uint32_t numLevels);
+
+		// False if every queue is full, in which case job is left as it was. Doesn't wake
+		// anybody: call wake() once everything for this callback's been submitted.
+		bool submit(Job &job);
+		void wake();
+
+		// Microseconds, only good for comparing with each other
+		static uint64_t now();
+
+		// In each tier
+		inline uint32_t getNumWorkers() { return numWorkers; }
+		inline uint32_t getNumTiers() { return numTiers; }
+		uint32_t getTier(uint32_t level);
+		// How many jobs were handed to us, how many we turned away for want of room, and how
+		// many we gave up on because they'd have missed their deadline, since the process started
+		inline uint64_t getNumSubmitted() { return numSubmitted; }
+		inline uint64_t getNumRejected() { return numRejected; }
+		inline uint64_t getNumSkipped() { return numSkipped; }
+
+	private:
+		WorkerPool(uint32_t numWorkers);
+
+		struct Tier;
+		typedef struct Worker {
+			Worker(WorkerPool *pool, Tier *tier, uint32_t index) : pool(pool), tier(tier), index(index) {}
+
+			WorkerPool *pool;
+			Tier *tier;
+			// Which core it's pinned to
+			uint32_t index;
+			pthread_t thread;
+		} Worker;
+
+		typedef struct Tier {
+			Tier(uint32_t index, uint32_t numQueues);
+
+			uint32_t index;
+			std::vector<boost::shared_ptr<Worker> > workers;
+			// Inboxes, one per worker, though any of the tier's workers empties all of them
+			std::vector<boost::shared_ptr<LockFreeQueue<Job> > > queues;
+			// Where the next submit() starts looking, so jobs get dealt round the queues
+			volatile uint32_t nextQueue;
+			// Jobs sitting in queues or the heap, so idle workers know whether to bother looking
+			volatile int32_t numQueuedJobs;
+
+			// Soonest deadline on top. Big enough for every queue at once, so it doesn't
+			// grow, and we leave jobs in the queues rather than go past that.
+			std::vector<Job> heap;
+			pthread_mutex_t heapMutex;
+
+			pthread_mutex_t workAvailableMutex;
+			pthread_cond_t workAvailable;
+		} Tier;
+
+		static void *workerEntry(void *arguments);
+		static void createPool();
+
+		void addTier();
+		void startWorker(Worker &worker);
+		void workerLoop(Worker &worker);
+		void wake(Tier &tier);
+		// The tier's job with the earliest deadline, once everything's been moved out of its
+		// inboxes into the heap. Takes the heap's lock, so only workers call it.
+		bool takeJob(Tier &tier, Job &job);
+		void run(Kernel &kernel, Job &job);
+		// Whether we'd expect to finish job by its deadline if we started it now
+		bool canMakeDeadline(Job &job);
+		void skip(Job &job);
+		static int sizeClassFor(uint32_t numSamples);
+
+		// Reserved to kMaxTiers, so the audio thread can look at the first numTiers while
+		// reserveTiers() adds more
+		std::vector<boost::shared_ptr<Tier> > tiers;
+		volatile uint32_t numTiers;
+		pthread_mutex_t tiersMutex;
+		uint32_t numWorkers;
+
+		volatile uint64_t numSubmitted;
+		volatile uint64_t numRejected;
+		volatile uint64_t numSkipped;
+
+		// How long a job took lately, by log2 of its input size
+		static const int kNumSizeClasses = 32;
+		volatile uint64_t expectedMicroseconds[kNumSizeClasses];
+	};
+
+	// A thread of its own that lets go of whatever the audio thread's done with, so freeing
+	// a setup (and waiting on the jobs its states still have out) happens off the audio
+	// thread. Nothing gets released till it's popped, since pushSwap() hands over the only
+	// reference. When the queue's full, release() leaves the caller's reference alone, so
+	// the caller has to hang on to it and try again later: letting go of it there and then
+	// would free it on the audio thread. Doesn't start any workers, so Convolvers without
+	// threads can use it too.
+	class Releaser {
+	public:
+		static const uint32_t kQueueCapacity = 256;
+
+		// The first call starts the thread, so make it somewhere other than the audio thread
+		static Releaser &get();
+
+		// Leaves garbage empty if it's been queued. If the queue's full garbage is left as it
+		// was, and it's up to the caller to keep it till there's room.
+		bool release(boost::shared_ptr<void> &garbage);
+		template <class T> bool release(boost::shared_ptr<T> &object) {
+			boost::shared_ptr<void> garbage(object);
+			if (!release(garbage)) return false;
+			// The queue's got the only other reference now
+			object.reset();
+			return true;
+		}
+
+		// How many releases we turned away for want of room, since the process started
+		inline uint64_t getNumFull() { return garbage.getNumFull(); }
+
+	private:
+		Releaser();
+
+		static void *releaserEntry(void *arguments);
+		static void createReleaser();
+		void releaserLoop();
+
+		LockFreeQueue<boost::shared_ptr<void> > garbage;
+		pthread_t thread;
+		pthread_mutex_t garbageAvailableMutex;
+		pthread_cond_t garbageAvailable;
+	};
+}
+
+#endif
@@ -48,7 +48,10 @@ typedef struct IRLoadingStatus {
 
 typedef struct IRInfo {
 	uint32_t numChannels;
+	// As long as the file
 	float seconds;
+	// What's convolved, after the inaudible tail's truncated
+	float trimmedSeconds;
 } IRInfo;
 
 enum {
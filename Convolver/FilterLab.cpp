@@ -141,6 +141,7 @@ namespace Convolver {
 		 cout << "FilterLab::FilterLab(): blockSize=" << blockSize << endl;
 		#endif
 		State filterMeasurementState(kernel, blockPatternPtr);
+		filterMeasurementState.reserveAccumulators(*blockPatternPtr, *filter);
 
 		measureAreaOffset = filterSize;
 		
@@ -1,79 +1,160 @@
-#ifndef _LOCKLESS_QUEUE_
-#define _LOCKLESS_QUEUE_
-
-//*******************************************************************************
-//  Copyright (C) 2006 Casey Borders, Moo Productions
-//  Contact: Casey.Borders@MooProductions.org
-//
-//  This software is provided 'as-is', without any express or implied warranty.
-//  In no event will the authors be held liable for any damages arising from
-//  the use of this software.
-//
-//  Permission is granted to anyone to use this software for any purpose,
-//  including commercial applications, and to alter it and redistribute it
-//  freely, subject to the following restrictions:
-//
-//  *  The origin of this software must not be misrepresented; you must not
-//     claim that you wrote the original software. If you use this software in a
-//     product, an acknowledgment in the product documentation would be
-//     appreciated but is not required.
-//
-//  *  Altered source versions must be plainly marked as such, and must not be
-//     misrepresented as being the original software.
-//
-//  *  This notice may not be removed or altered from any source distribution.
-//********************************************************************************
-
-template <class T> class LocklessQueue
-	{
-	private:
-		T* mBuffer;
-		size_t mHead;
-		size_t mTail;
-		int mSize;
-		
+/*
+ *  LockFreeQueue.h
+ *  Convolvotron
+ *
+ *  Created by Seth Nickell on 10/18/09.
+ *  Copyright 2009 Meatscience. All rights reserved.
+ *
+ */
+
+#ifndef _LockFreeQueue_h__
+#define _LockFreeQueue_h__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+#include <algorithm>
+
+namespace Convolver {
+	// Bounded queue any number of threads can push to and pop from without a lock, so the
+	// audio thread never waits on a worker that got descheduled halfway through. Each cell
+	// has a sequence number saying whose turn it is: pushers and poppers claim a position
+	// with a compare-and-swap, then the sequence number is published after the data (and
+	// read before it), so nobody sees a cell half written. With one thread on each end
+	// the compare-and-swaps never fail and it's as cheap as a plain ring.
+	//
+	// push() never blocks or allocates: when the queue is full it says so, and it's up to
+	// the caller what to do about it. getNumFull() counts how often that's happened.
+	template <class T> class LockFreeQueue {
 	public:
-		LocklessQueue(int size) : mSize(size+1),
-		mBuffer(0), mHead(0), mTail(0)
-		{
-			mBuffer = new T[mSize];
+		// Rounded up to a power of two
+		LockFreeQueue(uint32_t minimumCapacity) : pushPosition(0), popPosition(0), numPushed(0), numFull(0) {
+			capacity = 1;
+			while (capacity < minimumCapacity) capacity *= 2;
+			mask = capacity - 1;
+
+			cells = new Cell[capacity];
+			for (size_t i=0; i < capacity; i++) cells[i].sequence = i;
 		}
-		
-		~LocklessQueue()
-		{
-			delete[] mBuffer;
+
+		~LockFreeQueue() {
+			delete[] cells;
 		}
-		
-		bool push(T msg)
-		{
-			size_t head = mHead;
-			
-			if((head+1)%mSize == mTail)
-				return false;
-			
-			mBuffer[head++] = msg;
-			
-			if(head == mSize)
-				head = 0;
-			
-			mHead = head;
+
+		bool push(const T &value) {
+			size_t position;
+			Cell *cell = claimPush(position);
+			if (cell == NULL) return false;
+
+			cell->value = value;
+			publishPush(cell, position);
 			return true;
 		}
-		
-		bool pop(T &msg)
-		{
-			size_t tail = mTail;
-			
-			if(tail == mHead)
-				return false;
-			
-			msg = mBuffer[tail++];
-			
-			if(tail == mSize)
-				tail = 0;
-			
-			mTail = tail;
+
+		// Like push(), but swaps value into the cell rather than copying it, so value comes
+		// back holding whatever the cell had (nothing, after a pop()). Handing over the only
+		// reference to something this way means the popper's the one who lets go of it last.
+		bool pushSwap(T &value) {
+			size_t position;
+			Cell *cell = claimPush(position);
+			if (cell == NULL) return false;
+
+			std::swap(cell->value, value);
+			publishPush(cell, position);
 			return true;
 		}
+
+		// The cell lets go of its copy, so a T holding references doesn't keep them alive
+		bool pop(T &value) {
+			Cell *cell;
+			size_t position = popPosition;
+			while (true) {
+				cell = &cells[position & mask];
+				intptr_t difference = (intptr_t)loadAcquire(cell->sequence) - (intptr_t)(position + 1);
+				if (difference == 0) {
+					if (__sync_bool_compare_and_swap(&popPosition, position, position + 1)) break;
+					position = popPosition;
+				} else if (difference < 0) {
+					// Empty
+					return false;
+				} else {
+					position = popPosition;
+				}
+			}
+
+			value = cell->value;
+			cell->value = T();
+			storeRelease(cell->sequence, position + capacity);
+			return true;
+		}
+
+		// Only a hint when other threads are at it
+		inline bool empty() { return loadAcquire(popPosition) == loadAcquire(pushPosition); }
+		inline uint32_t getCapacity() { return capacity; }
+		inline uint64_t getNumPushed() { return numPushed; }
+		inline uint64_t getNumFull() { return numFull; }
+
+	private:
+		static const size_t kCacheLineSize = 64;
+
+		static inline size_t loadAcquire(volatile size_t &location) {
+			size_t value = location;
+			__sync_synchronize();
+			return value;
+		}
+		static inline void storeRelease(volatile size_t &location, size_t value) {
+			__sync_synchronize();
+			location = value;
+		}
+
+		typedef struct Cell {
+			volatile size_t sequence;
+			T value;
+		} Cell;
+
+		// The cell at position is ours to fill, or NULL if the queue's full
+		Cell *claimPush(size_t &position) {
+			Cell *cell;
+			position = pushPosition;
+			while (true) {
+				cell = &cells[position & mask];
+				intptr_t difference = (intptr_t)loadAcquire(cell->sequence) - (intptr_t)position;
+				if (difference == 0) {
+					// It's free, as long as nobody else took it first
+					if (__sync_bool_compare_and_swap(&pushPosition, position, position + 1)) return cell;
+					position = pushPosition;
+				} else if (difference < 0) {
+					// Still holding what was pushed a lap ago
+					__sync_add_and_fetch(&numFull, 1);
+					return NULL;
+				} else {
+					position = pushPosition;
+				}
+			}
+		}
+
+		void publishPush(Cell *cell, size_t position) {
+			storeRelease(cell->sequence, position + 1);
+			__sync_add_and_fetch(&numPushed, 1);
+		}
+
+		// Not copyable, the cells are ours
+		LockFreeQueue(const LockFreeQueue &);
+		LockFreeQueue &operator=(const LockFreeQueue &);
+
+		// Pushers and poppers each get their own cache line, so they don't slow each other down
+		char padding0[kCacheLineSize];
+		volatile size_t pushPosition;
+		char padding1[kCacheLineSize - sizeof(size_t)];
+		volatile size_t popPosition;
+		char padding2[kCacheLineSize - sizeof(size_t)];
+
+		Cell *cells;
+		size_t capacity;
+		size_t mask;
+		volatile uint64_t numPushed;
+		volatile uint64_t numFull;
 	};
-#endif
\ No newline at end of file
+}
+
+#endif
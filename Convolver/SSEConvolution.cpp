@@ -8,29 +8,32 @@
  */
 
 
+#include "SSEConvolution.h"
+
 #if defined __i386__ || defined __x86_64__
 #include <emmintrin.h>
 #include <xmmintrin.h>
 #include <pmmintrin.h>
+#if SSE_CONVOLUTION_MULTIVERSION
+#include <immintrin.h>
+#endif
 #endif
 
 
-#include "SSEConvolution.h"
-
-
-// Multiplying complex numbers using SSE3 intrinsics
+// Multiplying complex numbers using SSE3 intrinsics, two complex numbers at a time.
+// Returns how many complex numbers it did, the caller finishes the rest.
 int multiply_complex_SSE3(float *input, float *filter, float *accumulator, int numComplexNumbers)
 {
-    // Prime the registers
-	static float minus1=-1.0f;	
-    __m128 mm_data,mm_exp1,mm_exp,mm_exp_c,mm_exp_s,mm_acl =_mm_load_ps1(&minus1);
+    __m128 mm_data,mm_exp1,mm_exp,mm_exp_c,mm_exp_s,mm_acl;
 		
-    register int i = 0;
-	register int nFloats = numComplexNumbers*2;
-    do {
-        mm_data = _mm_load_ps(&input[i]);
-        mm_exp = _mm_load_ps(&filter[i]);
-		mm_acl = _mm_load_ps(&accumulator[i]);
+	int nFloats = numComplexNumbers*2;
+    int i;
+    // Blocks are 64 byte aligned these days, but loadu costs nothing on aligned memory
+    // and keeps us safe on anything that isn't a FreqBlock
+    for (i = 0; i <= nFloats-4; i += 4) {
+        mm_data = _mm_loadu_ps(&input[i]);
+        mm_exp = _mm_loadu_ps(&filter[i]);
+		mm_acl = _mm_loadu_ps(&accumulator[i]);
 		
         // next two commands SSE3
         mm_exp_c = _mm_moveldup_ps(mm_exp);
@@ -39,14 +42,7 @@ int multiply_complex_SSE3(float *input, float *filter, float *accumulator, int n
         mm_exp = _mm_mul_ps(mm_exp_c,mm_data);
         mm_exp1 = _mm_mul_ps(mm_exp_s,mm_data);
 
-		//FIXME: what is this?
-		// 0b10110001
-		// 2  3  0  1
-		// number[1]
-		// number[0]
-		// number[3]
-		// number[2]
-		// I think this swaps one with two and three with fours
+		// 0xB1 = 0b10110001 swaps the real and imaginary halves of each complex number
 		mm_exp1 = _mm_shuffle_ps(mm_exp1,mm_exp1,0xB1);
 		
         // next command is SSE3
@@ -54,10 +50,98 @@ int multiply_complex_SSE3(float *input, float *filter, float *accumulator, int n
 		
 		mm_acl = _mm_add_ps(mm_exp, mm_acl);
 		
-        _mm_store_ps(&accumulator[i],mm_acl); // aligned FIXME: on OS/X we are gauranteed alignment.
-        i += 4;
-	} while (i <= nFloats-4);
-	return (i - 4) / 2;
+        _mm_storeu_ps(&accumulator[i],mm_acl);
+	}
+	return i / 2;
+};
+
+#if SSE_CONVOLUTION_MULTIVERSION
+
+// Same as the SSE3 version, four complex numbers at a time, with the multiply and
+// addsub fused: fmaddsub(re(f), x, im(f) * swap(x))
+__attribute__((target("avx2,fma")))
+int multiply_complex_AVX2(float *input, float *filter, float *accumulator, int numComplexNumbers)
+{
+	int nFloats = numComplexNumbers*2;
+	int i;
+	for (i = 0; i <= nFloats-8; i += 8) {
+		__m256 mm_data = _mm256_loadu_ps(&input[i]);
+		__m256 mm_exp = _mm256_loadu_ps(&filter[i]);
+		__m256 mm_acl = _mm256_loadu_ps(&accumulator[i]);
+		
+		__m256 mm_exp_c = _mm256_moveldup_ps(mm_exp);
+		__m256 mm_exp_s = _mm256_movehdup_ps(mm_exp);
+		__m256 mm_swapped = _mm256_permute_ps(mm_data, 0xB1);
+		
+		__m256 mm_product = _mm256_fmaddsub_ps(mm_exp_c, mm_data, _mm256_mul_ps(mm_exp_s, mm_swapped));
+		
+		_mm256_storeu_ps(&accumulator[i], _mm256_add_ps(mm_acl, mm_product));
+	}
+	return i / 2;
+}
+
+// Eight complex numbers at a time
+__attribute__((target("avx512f")))
+int multiply_complex_AVX512(float *input, float *filter, float *accumulator, int numComplexNumbers)
+{
+	int nFloats = numComplexNumbers*2;
+	int i;
+	for (i = 0; i <= nFloats-16; i += 16) {
+		__m512 mm_data = _mm512_loadu_ps(&input[i]);
+		__m512 mm_exp = _mm512_loadu_ps(&filter[i]);
+		__m512 mm_acl = _mm512_loadu_ps(&accumulator[i]);
+		
+		__m512 mm_exp_c = _mm512_moveldup_ps(mm_exp);
+		__m512 mm_exp_s = _mm512_movehdup_ps(mm_exp);
+		__m512 mm_swapped = _mm512_permute_ps(mm_data, 0xB1);
+		
+		__m512 mm_product = _mm512_fmaddsub_ps(mm_exp_c, mm_data, _mm512_mul_ps(mm_exp_s, mm_swapped));
+		
+		_mm512_storeu_ps(&accumulator[i], _mm512_add_ps(mm_acl, mm_product));
+	}
+	return i / 2;
+}
+
+#endif
+
+MultiplyComplexFunction multiply_complex_best()
+{
+#if SSE_CONVOLUTION_MULTIVERSION
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) return multiply_complex_AVX512;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return multiply_complex_AVX2;
+#endif
+	return multiply_complex_SSE3;
+}
+
+const char *multiply_complex_name(MultiplyComplexFunction function)
+{
+#if SSE_CONVOLUTION_MULTIVERSION
+	if (function == multiply_complex_AVX512) return "AVX-512";
+	if (function == multiply_complex_AVX2) return "AVX2+FMA";
+#endif
+	if (function == multiply_complex_SSE3) return "SSE3";
+	return "unknown";
+}
+
+// Direct form FIR, four outputs at a time: broadcast each tap against the input
+// slid back by that tap. Nothing here needs to be aligned.
+int fir_accumulate_SSE(const float *input, const float *taps, float *output, int numTaps, int numOutputs)
+{
+	int n;
+	for (n = 0; n <= numOutputs - 4; n += 4) {
+		__m128 mm_acc = _mm_loadu_ps(&output[n]);
+		const float *x = &input[n];
+		
+		for (int k = 0; k < numTaps; k++) {
+			__m128 mm_tap = _mm_set1_ps(taps[k]);
+			__m128 mm_x = _mm_loadu_ps(x - k);
+			mm_acc = _mm_add_ps(mm_acc, _mm_mul_ps(mm_tap, mm_x));
+		}
+		
+		_mm_storeu_ps(&output[n], mm_acc);
+	}
+	return n;
 };
 
 /*
@@ -8,5 +8,33 @@
  */
 
 
+#ifndef _SSEConvolution_h__
+#define _SSEConvolution_h__
+
+// Compilers that can build AVX code into an SSE3 binary and pick at runtime
+#if (defined __i386__ || defined __x86_64__) && (defined __clang__ || (defined __GNUC__ && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+#define SSE_CONVOLUTION_MULTIVERSION 1
+#else
+#define SSE_CONVOLUTION_MULTIVERSION 0
+#endif
+
+// accumulator += input * filter over interleaved complex numbers. Each returns how many
+// complex numbers it did, the caller finishes the rest. No alignment needed.
+typedef int (*MultiplyComplexFunction)(float *input, float *filter, float *accumulator, int numComplexNumbers);
+
 int multiply_complex_SSE3(float *input, float *filter, float *accumulator, int numComplexNumbers);
-//inline void multiply_SSE2(complex_num x, complex_num y, complex_num *z);
\ No newline at end of file
+#if SSE_CONVOLUTION_MULTIVERSION
+int multiply_complex_AVX2(float *input, float *filter, float *accumulator, int numComplexNumbers);
+int multiply_complex_AVX512(float *input, float *filter, float *accumulator, int numComplexNumbers);
+#endif
+
+// The widest one this CPU can run
+MultiplyComplexFunction multiply_complex_best();
+const char *multiply_complex_name(MultiplyComplexFunction function);
+
+// output[n] += sum(taps[k] * input[n-k]) for n in [0, numOutputs), so input needs numTaps-1
+// samples of history in front of it. Returns how many outputs it did, the caller does the rest.
+int fir_accumulate_SSE(const float *input, const float *taps, float *output, int numTaps, int numOutputs);
+//inline void multiply_SSE2(complex_num x, complex_num y, complex_num *z);
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ *  TestBlockPool.cpp
+ *  Convolvotron
+ *
+ *  Created by Seth Nickell on 10/18/09.
+ *  Copyright 2009 Meatscience. All rights reserved.
+ *
+ */
+
+#include "ConvolverBlockPool.h"
+#include "ConvolverAlignedAllocator.h"
+
+#include <iostream>
+#include <vector>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+
+using std::cout;
+using std::endl;
+using namespace Convolver;
+
+static const uint32_t kNumThreads = 4;
+static const uint32_t kNumSlots = 16;
+static const uint32_t kIterations = 200000;
+static const size_t kSizes[] = {64, 100, 256, 4096};
+static const uint32_t kNumSizes = sizeof(kSizes) / sizeof(kSizes[0]);
+
+// A block handed between threads, stamped so we can tell if two owners ever got the same memory
+typedef struct Block {
+	uint32_t stamp;
+	uint32_t sizeIndex;
+} Block;
+
+static Block * volatile slots[kNumSlots];
+static volatile uint32_t numCorrupted = 0;
+
+static Block *newBlock(uint32_t sizeIndex, uint32_t stamp) {
+	size_t numBytes = kSizes[sizeIndex];
+	uint32_t *words = (uint32_t *)BlockPool::allocate(numBytes);
+	assert((uintptr_t)words % kVectorAlignment == 0);
+	for (size_t i=0; i < numBytes / sizeof(uint32_t); i++) words[i] = stamp;
+	words[1] = sizeIndex;
+	return (Block *)words;
+}
+
+static void freeBlock(Block *block) {
+	size_t numBytes = kSizes[block->sizeIndex];
+	uint32_t *words = (uint32_t *)block;
+	for (size_t i=2; i < numBytes / sizeof(uint32_t); i++) {
+		if (words[i] != block->stamp) {
+			__sync_fetch_and_add(&numCorrupted, 1);
+			break;
+		}
+	}
+	BlockPool::deallocate(block, numBytes);
+}
+
+// Every thread swaps freshly allocated blocks into random slots and frees whatever it
+// swapped out, so most blocks are freed on a different thread from the one that made them
+static void *swapBlocks(void *arg) {
+	uint32_t threadNum = (uint32_t)(uintptr_t)arg;
+	uint32_t seed = threadNum + 1;
+	for (uint32_t i=0; i < kIterations; i++) {
+		seed = seed * 1103515245 + 12345;
+		uint32_t random = seed >> 8;
+		Block *block = newBlock(random % kNumSizes, (threadNum << 24) | (i & 0xffffff));
+		Block *old = __sync_lock_test_and_set(&slots[(random / kNumSizes) % kNumSlots], block);
+		if (old != NULL) freeBlock(old);
+	}
+	return NULL;
+}
+
+static bool testReuse() {
+	// Once a size has been seen, coming back for it shouldn't go to the system
+	void *first = BlockPool::allocate(1000);
+	BlockPool::deallocate(first, 1000);
+	uint64_t before = BlockPool::getNumSystemAllocations();
+	void *second = BlockPool::allocate(1024);
+	BlockPool::deallocate(second, 1024);
+	bool passed = BlockPool::getNumSystemAllocations() == before;
+
+	BlockPool::reserve(3000, 2);
+	before = BlockPool::getNumSystemAllocations();
+	void *a = BlockPool::allocate(3000);
+	void *b = BlockPool::allocate(2500);
+	passed &= BlockPool::getNumSystemAllocations() == before && a != b;
+	BlockPool::deallocate(a, 3000);
+	BlockPool::deallocate(b, 2500);
+
+	// Too big to pool, but still aligned
+	size_t hugeSize = BlockPool::kMaxPooledBytes + 1;
+	void *huge = BlockPool::allocate(hugeSize);
+	passed &= (uintptr_t)huge % kVectorAlignment == 0;
+	BlockPool::deallocate(huge, hugeSize);
+
+	cout << "reuse" << (passed ? " passed" : " FAILED") << endl;
+	return passed;
+}
+
+static bool testThreads() {
+	pthread_t threads[kNumThreads];
+	for (uint32_t t=0; t < kNumThreads; t++) {
+		pthread_create(&threads[t], NULL, swapBlocks, (void *)(uintptr_t)t);
+	}
+	for (uint32_t t=0; t < kNumThreads; t++) {
+		pthread_join(threads[t], NULL);
+	}
+	for (uint32_t s=0; s < kNumSlots; s++) {
+		if (slots[s] != NULL) freeBlock(slots[s]);
+		slots[s] = NULL;
+	}
+
+	bool passed = numCorrupted == 0;
+	cout << "threads: " << numCorrupted << " corrupted blocks, " << BlockPool::getNumSystemAllocations();
+	cout << " system allocations" << (passed ? " passed" : " FAILED") << endl;
+	return passed;
+}
+
+int main(int argc, char *argv[]) {
+	bool passed = true;
+	passed &= testReuse();
+	passed &= testThreads();
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,89 @@
+/*
+ *  TestCrossfade.cpp
+ *  Convolvotron
+ *
+ *  Copyright 2026 Meatscience. All rights reserved.
+ *
+ */
+
+#include "TestHelpers.h"
+
+#include <iostream>
+
+using std::cout;
+using std::endl;
+using std::vector;
+using boost::shared_ptr;
+using namespace Convolver;
+
+static const uint32_t kFrameSize = 64;
+static const uint32_t kIRLength = 4096;
+static const uint32_t kSwapFrame = 100;
+static const uint32_t kCrossfadeLength = 1000;
+static const uint32_t kNumFrames = kSwapFrame + 2 * kIRLength / kFrameSize;
+
+static vector<TimeSample> irSignalA(kIRLength);
+static vector<TimeSample> irSignalB(kIRLength);
+static vector<TimeSample> inSignal(kNumFrames * kFrameSize);
+
+// Swaps in the second IR at kSwapFrame, and counts the callbacks spent fading over to it
+class SwapIR : public MonoRunHooks {
+public:
+	SwapIR(IR &newIR) : newIR(newIR), numCrossfadingFrames(0) {}
+	bool beforeFrame(Convolver::Convolver &convolver, uint32_t frame, const TimeSample *input) {
+		if (frame == kSwapFrame) setupMono(convolver, newIR);
+		return true;
+	}
+	void afterFrame(Convolver::Convolver &convolver, uint32_t frame) {
+		if (convolver.isCrossfading()) numCrossfadingFrames++;
+	}
+	IR &newIR;
+	uint32_t numCrossfadingFrames;
+};
+
+static bool testPattern(const char *name, shared_ptr<BlockPattern> pattern, Kernel::Scheduler scheduler) {
+	Convolver::Convolver convolver(pattern, false);
+	convolver.setScheduler(scheduler);
+	convolver.setCrossfadeLength(kCrossfadeLength);
+
+	vector<const TimeSample *> irsA(1, &irSignalA[0]);
+	IR irA(convolver.getKernel(), pattern, irsA, kIRLength, false);
+	vector<const TimeSample *> irsB(1, &irSignalB[0]);
+	IR irB(convolver.getKernel(), pattern, irsB, kIRLength, false);
+	setupMono(convolver, irA);
+
+	SwapIR swapIR(irB);
+	vector<TimeSample> outSignal = runMono(convolver, inSignal, kFrameSize, &swapIR);
+
+	// The old IR carries on over everything, the new one only hears what came after the swap
+	vector<TimeSample> referenceA = convolveTheSlowWay(inSignal, irSignalA);
+	vector<TimeSample> referenceB = convolveTheSlowWay(inSignal, irSignalB, kSwapFrame * kFrameSize);
+	vector<TimeSample> expected(referenceA);
+	for (uint32_t i=kSwapFrame * kFrameSize; i < expected.size(); i++) {
+		float gain = std::min((float)(i - kSwapFrame * kFrameSize + 1) / kCrossfadeLength, 1.0f);
+		expected[i] = referenceB[i] * gain + referenceA[i] * (1.0f - gain);
+	}
+	float error = worstError(outSignal, expected);
+
+	// The last frame of the fade finishes it
+	uint32_t expectedFrames = (kCrossfadeLength + kFrameSize - 1) / kFrameSize - 1;
+	bool passed = error < 1e-3f && swapIR.numCrossfadingFrames == expectedFrames && !convolver.isCrossfading();
+
+	cout << name << ": error " << error << ", crossfaded for " << swapIR.numCrossfadingFrames << " callbacks";
+	cout << ", " << convolver.getCrossfadeMicroseconds() << "us running the old setup last callback";
+	cout << (passed ? "" : " FAILED") << endl;
+	return passed;
+}
+
+int main(int argc, char *argv[]) {
+	for (uint32_t i=0; i < kIRLength; i++) {
+		irSignalA[i] = randomSample() * expf(-(float)i / 1000.0f);
+		irSignalB[i] = randomSample() * expf(-(float)i / 500.0f);
+	}
+	for (uint32_t i=0; i < inSignal.size(); i++) inSignal[i] = randomSample();
+
+	bool passed = true;
+	passed &= testPattern("doubling", shared_ptr<BlockPattern>(new DoublingBlockPattern(kFrameSize, 1024)), Kernel::SCHEDULER_FRAME_REQUESTS);
+	passed &= testPattern("fdl", shared_ptr<BlockPattern>(new FixedSizeBlockPattern(kFrameSize)), Kernel::SCHEDULER_FDL);
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,86 @@
+/*
+ *  TestFFTBackend.cpp
+ *  Convolvotron
+ *
+ *  Created by Seth Nickell on 10/18/09.
+ *  Copyright 2009 Meatscience. All rights reserved.
+ *
+ */
+
+#include "ConvolverFFTBackend.h"
+
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+
+using std::cout;
+using std::endl;
+using std::vector;
+using boost::shared_ptr;
+using namespace Convolver;
+
+static float randomSample() {
+	return (float)rand() / RAND_MAX - 0.5f;
+}
+
+// Every backend should give the same (unscaled) spectrum as kiss, and get back size * input
+static bool testBackend(FFTBackend::Type type, uint32_t size) {
+	shared_ptr<const FFTBackend> backend = FFTBackend::get(type, size);
+	shared_ptr<const FFTBackend> reference = FFTBackend::get(FFTBackend::KISS, size);
+	assert(backend && reference);
+	assert(FFTBackend::get(type, size) == backend);
+
+	vector<float> scratch(backend->getScratchSize() + 1), referenceScratch(reference->getScratchSize() + 1);
+
+	uint32_t numBins = size / 2 + 1;
+	vector<TimeSample> input(size), output(size);
+	vector<FreqSample> spectrum(numBins), expected(numBins);
+	for (uint32_t i=0; i < size; i++) input[i] = randomSample();
+
+	backend->forward(&input[0], &spectrum[0], &scratch[0]);
+	reference->forward(&input[0], &expected[0], &referenceScratch[0]);
+
+	// Errors grow with the size of the transform
+	float tolerance = 1e-5f * size;
+	for (uint32_t k=0; k < numBins; k++) {
+		if (fabs(spectrum[k].r - expected[k].r) > tolerance || fabs(spectrum[k].i - expected[k].i) > tolerance) {
+			cout << FFTBackend::name(type) << ": forward mismatch at bin " << k << " of size " << size << ": ";
+			cout << spectrum[k].r << "+" << spectrum[k].i << "i != " << expected[k].r << "+" << expected[k].i << "i" << endl;
+			return false;
+		}
+	}
+
+	backend->inverse(&spectrum[0], &output[0], &scratch[0]);
+	for (uint32_t i=0; i < size; i++) {
+		if (fabs(output[i] / size - input[i]) > 1e-5) {
+			cout << FFTBackend::name(type) << ": round trip mismatch at sample " << i << " of size " << size << ": ";
+			cout << output[i] / size << " != " << input[i] << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	bool passed = true;
+	for (int type=0; type < FFTBackend::NUM_BACKENDS; type++) {
+		bool backendPassed = true;
+		bool ranAny = false;
+		for (uint32_t size = 2; size <= 65536; size *= 2) {
+			if (!FFTBackend::isAvailable((FFTBackend::Type)type, size)) continue;
+			backendPassed &= testBackend((FFTBackend::Type)type, size);
+			ranAny = true;
+		}
+		if (ranAny) {
+			cout << FFTBackend::name((FFTBackend::Type)type) << (backendPassed ? " passed" : " FAILED") << endl;
+		} else {
+			cout << FFTBackend::name((FFTBackend::Type)type) << " not built" << endl;
+		}
+		passed &= backendPassed;
+	}
+
+	return passed ? 0 : 1;
+}
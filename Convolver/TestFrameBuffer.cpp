@@ -17,116 +17,112 @@ using boost::shared_ptr;
 
 using namespace Convolver;
 
-/*
-FrameBuffer() : NEGATIVE_BUFFER_INDEX(std::numeric_limits<uint32_t>::max()), bufferOffset(0), frameNum(0) {}
-
-typedef deque<shared_ptr<TimeBlock> > Buffer;
-
-FrameNum addFrame(shared_ptr<TimeBlock> frame);
-void flushFramesBefore(FrameNum oldestFrameToKeep);
-shared_ptr<TimeBlock> fulfill(FrameRequest &frameRequest, uint32_t frameSize, bool pad);
-FrameNum getFrameNum() { return frameNum; }
-
- */
 #define FRAME_SIZE 1024
 
 
-static shared_ptr<TimeBlock> fulfillL(FrameBuffer *buffer, FrameNum start, FrameNum end) {
+static const TimeSample *fulfillL(FrameBuffer *buffer, FrameNum start, FrameNum end) {
 	FrameRequest request(FrameRequestID(start, end));
-	return buffer->fulfill(request, FRAME_SIZE, true);
+	uint32_t numSamples;
+	const TimeSample *samples = buffer->fulfill(request, numSamples);
+	assert(numSamples == (end - start) * FRAME_SIZE);
+	return samples;
 }
 
-
-static shared_ptr<TimeBlock> getSingleFrame(FrameBuffer *buffer, FrameNum frame) {
-	shared_ptr<TimeBlock> toReturn = fulfillL(buffer, frame, frame+1);
-	assert(toReturn->size() == FRAME_SIZE * 2);
-	return toReturn;
-}
-
-static shared_ptr<TimeBlock> makeBlock(uint32_t size, float value) {
-	TimeBlock *block = new TimeBlock(size);
-	block->at(0) = value;
-	assert(block->size() == size);
-	return shared_ptr<TimeBlock>(block);
+// Marked at both ends, so we notice a frame that got split or shifted
+static TimeBlock makeFrame(float value) {
+	TimeBlock block(FRAME_SIZE);
+	block[0] = value;
+	block[FRAME_SIZE - 1] = -value;
+	return block;
 }
 
-static FrameNum addFrameL(FrameBuffer *buffer, float value) {
-	return buffer->addFrame(makeBlock(FRAME_SIZE, value));
+static bool isFrame(FrameBuffer *buffer, FrameNum num, float value) {
+	const TimeSample *frame = fulfillL(buffer, num, num+1);
+	return frame[0] == value && frame[FRAME_SIZE - 1] == -value;
 }
 
-static bool isFrame(FrameBuffer *buffer, FrameNum num, float value) {
-	shared_ptr<TimeBlock> frame(getSingleFrame(buffer, num));
-	return ((*frame)[0] == value);
+// Every frame in [start, end) should be in one run, in order
+static bool isRun(FrameBuffer *buffer, FrameNum start, FrameNum end, float firstValue) {
+	const TimeSample *samples = fulfillL(buffer, start, end);
+	for (FrameNum i=0; i < end - start; i++) {
+		if (samples[i * FRAME_SIZE] != firstValue + i) return false;
+		if (samples[(i + 1) * FRAME_SIZE - 1] != -(firstValue + i)) return false;
+	}
+	return true;
 }
 
 void FrameBuffer::test() {
-	FrameNum one   = addFrameL(this, 1.0);
+	FrameNum one   = addFrame(makeFrame(1.0).cArray());
 	assert(isFrame(this, one, 1.0));
 	
-	FrameNum two   = addFrameL(this, 2.0);
+	FrameNum two   = addFrame(makeFrame(2.0).cArray());
 	assert(isFrame(this, one, 1.0));
 	assert(isFrame(this, two, 2.0));
 	
-	FrameNum three = addFrameL(this, 3.0);
+	FrameNum three = addFrame(makeFrame(3.0).cArray());
 	assert(isFrame(this, one, 1.0));
 	assert(!isFrame(this, two, 1.0));
 	assert(isFrame(this, two, 2.0));
 	assert(isFrame(this, three, 3.0));
 	
-	FrameNum four  = addFrameL(this, 4.0);
+	FrameNum four  = addFrame(makeFrame(4.0).cArray());
 	assert(isFrame(this, four, 4.0));	
-	assert(buffer.size() == 4);
+	assert(getNumFrames() == 4);
 	
 	flushFramesBefore(two);
-	assert(buffer.size() == 3);
+	assert(getNumFrames() == 3);
 	assert(isFrame(this, two, 2.0));
 	
 	flushFramesBefore(two);
-	assert(buffer.size() == 3);
+	assert(getNumFrames() == 3);
 	assert(isFrame(this, two, 2.0));	
 	assert(isFrame(this, four, 4.0));		
 
 	flushFramesBefore(one);
 	assert(isFrame(this, two, 2.0));	
-	assert(buffer.size() == 3);
+	assert(getNumFrames() == 3);
 	
-	FrameNum five = addFrameL(this, 5.0);
-	FrameNum six = addFrameL(this, 6.0);
+	FrameNum five = addFrame(makeFrame(5.0).cArray());
+	FrameNum six = addFrame(makeFrame(6.0).cArray());
 	assert(isFrame(this, five, 5.0));
 	assert(isFrame(this, six, 6.0));	
 	
-	assert(buffer.size() == 5);
+	assert(getNumFrames() == 5);
 	
 	flushFramesBefore(three);
-	assert(buffer.size() == 4);	
+	assert(getNumFrames() == 4);	
 	assert(isFrame(this, five, 5.0));
 	assert(isFrame(this, three, 3.0));
 	
-	FrameNum seven = addFrameL(this, 7.0);
-	FrameNum eight = addFrameL(this, 8.0);
-	FrameNum nine  = addFrameL(this, 9.0);
-	FrameNum ten   = addFrameL(this, 10.0);
-	
-	shared_ptr<TimeBlock> block(fulfillL(this, three, eight));
-	assert(block->size() == 5 * FRAME_SIZE * 2);
-
-	block = fulfillL(this, five, eight);
-	assert(block->size() == 3 * FRAME_SIZE * 2);
+	addFrame(makeFrame(7.0).cArray());
+	FrameNum eight = addFrame(makeFrame(8.0).cArray());
+	addFrame(makeFrame(9.0).cArray());
+	addFrame(makeFrame(10.0).cArray());
+	
+	assert(isRun(this, three, eight, 3.0));
+	assert(isRun(this, five, eight, 5.0));
+	
+	// Keep a sliding window of 8 frames going long enough to wrap the ring a few times,
+	// every run in it should still read straight through
+	uint32_t initialCapacity = getCapacity();
+	float value = 11.0;
+	for (uint32_t i=0; i < 5 * initialCapacity; i++) {
+		FrameNum newest = addFrame(makeFrame(value++).cArray());
+		flushFramesBefore(newest - 7);
+		assert(getNumFrames() == 8);
+		assert(isRun(this, newest - 7, newest + 1, value - 8));
+	}
+	assert(getCapacity() == initialCapacity);
 	
-	assert(block->at(0) == 5.0);
-	assert(block->at(FRAME_SIZE) == 6.0);
-	assert(block->at(FRAME_SIZE*2) == 7.0);
+	// Holding on to more frames than fit has to grow the ring, without losing any
+	FrameNum oldest = getFrameNum() - 8;
+	float oldestValue = value - 8;
+	for (uint32_t i=0; i < 3 * initialCapacity; i++) addFrame(makeFrame(value++).cArray());
+	assert(getCapacity() >= 3 * initialCapacity + 8);
+	assert(isRun(this, oldest, getFrameNum(), oldestValue));
 	
 	cout << "All tests seem to have passed" << endl;
 }
-static void printComplex(kiss_fft_cpx *buffer, int size, float scale) {
-	for (int j=0; j < size; j++) {
-		char sign = buffer[j].i >= 0.0f ? '+' : '-';
-		printf("%7.4f%c%7.4f \t", buffer[j].r*scale, sign, fabs(buffer[j].i*scale));
-		if ((j+1) % 7 == 0) printf("\n\t%4d: ", j+1);	
-	}
-}
-
 static void printFloats(float *buffer, int size, float scale) {
 	for (int j=0; j < size; j++) {
 		printf("%8.4f \t", buffer[j]*scale);
@@ -138,8 +134,8 @@ static void printFloats(float *buffer, int size, float scale) {
 #define FFT_SIZE 1024
 int main(int argc, char *argv[]) {
 	cout << "Hi world" << endl;
-	//FrameBuffer frameBuffer;
-	//frameBuffer.test();
+	FrameBuffer frameBuffer(FRAME_SIZE);
+	frameBuffer.test();
 	kiss_fftr_cfg cfg = kiss_fftr_alloc(FFT_SIZE, 0, NULL, NULL);
 	kiss_fftr_cfg cfgi = kiss_fftr_alloc(FFT_SIZE, 1, NULL, NULL);
 	
@@ -0,0 +1,96 @@
+/*
+ *  TestHelpers.h
+ *  Convolvotron
+ *
+ *  Copyright 2026 Meatscience. All rights reserved.
+ *
+ */
+
+// What the tests that push a signal through a whole Convolver have in common: the
+// noise, the Convolver playing one IR, the callback loop and a straight time domain
+// convolution to check against. Inline, so a test that doesn't use one doesn't warn.
+
+#ifndef _TestHelpers_h__
+#define _TestHelpers_h__
+
+#include "Convolver.h"
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+inline float randomSample() {
+	return (float)rand() / RAND_MAX - 0.5f;
+}
+
+// Straight time domain convolution of input from start on, every sample, as long as input
+inline std::vector<Convolver::TimeSample> convolveTheSlowWay(const std::vector<Convolver::TimeSample> &input, const std::vector<Convolver::TimeSample> &ir, uint32_t start=0) {
+	std::vector<Convolver::TimeSample> reference(input.size(), 0.0f);
+	for (uint32_t n=start; n < input.size(); n++) {
+		if (input[n] == 0.0f) continue;
+		uint32_t numTaps = std::min<uint32_t>(ir.size(), input.size() - n);
+		for (uint32_t k=0; k < numTaps; k++) reference[n + k] += input[n] * ir[k];
+	}
+	return reference;
+}
+
+inline float worstError(const std::vector<Convolver::TimeSample> &output, const std::vector<Convolver::TimeSample> &reference) {
+	float worst = 0.0f;
+	for (uint32_t i=0; i < output.size(); i++) {
+		worst = std::max(worst, (float)fabs(output[i] - reference[i]));
+	}
+	return worst;
+}
+
+// One input straight to one output
+inline void setupMono(Convolver::Convolver &convolver, Convolver::IR &ir) {
+	bool changeOutChannels = true;
+	uint32_t numOutChannels = 1;
+	convolver.setupMonoIn(ir.getFilters(), changeOutChannels, numOutChannels);
+}
+
+// Whatever a test wants to do around each callback
+class MonoRunHooks {
+public:
+	virtual ~MonoRunHooks() {}
+	// False skips the callback, leaving the frame's output silent
+	virtual bool beforeFrame(Convolver::Convolver &convolver, uint32_t frame, const Convolver::TimeSample *input) { return true; }
+	virtual void afterFrame(Convolver::Convolver &convolver, uint32_t frame) {}
+};
+
+// Runs the whole input through a mono Convolver a frame per callback, like the AU does
+inline std::vector<Convolver::TimeSample> runMono(Convolver::Convolver &convolver, const std::vector<Convolver::TimeSample> &input, uint32_t frameSize, MonoRunHooks *hooks=NULL) {
+	uint32_t numFrames = input.size() / frameSize;
+	std::vector<Convolver::TimeSample> output(numFrames * frameSize, 0.0f);
+	for (uint32_t frame=0; frame < numFrames; frame++) {
+		const Convolver::TimeSample *frameIn = &input[frame * frameSize];
+		if (hooks && !hooks->beforeFrame(convolver, frame, frameIn)) continue;
+		std::vector<const Convolver::TimeSample *> in(1, frameIn);
+		std::vector<Convolver::TimeSample *> out(1, &output[frame * frameSize]);
+		convolver.convolve(in, out, frameSize, 0.0f, 1.0f);
+		if (hooks) hooks->afterFrame(convolver, frame);
+	}
+	return output;
+}
+
+// A Convolver without threads playing irSignal, one input to one output. Set the
+// Convolver up however the test wants, then setup() before run().
+class MonoConvolver {
+public:
+	MonoConvolver(boost::shared_ptr<Convolver::BlockPattern> pattern, const std::vector<Convolver::TimeSample> &irSignal)
+		: convolver(pattern, false), irs(1, &irSignal[0]), ir(convolver.getKernel(), pattern, irs, irSignal.size(), false) {}
+	
+	void setup() { setupMono(convolver, ir); }
+	std::vector<Convolver::TimeSample> run(const std::vector<Convolver::TimeSample> &input, uint32_t frameSize, MonoRunHooks *hooks=NULL) {
+		return runMono(convolver, input, frameSize, hooks);
+	}
+	
+	Convolver::Convolver convolver;
+	// irSignal's one channel, which has to be made before ir is
+	std::vector<const Convolver::TimeSample *> irs;
+	Convolver::IR ir;
+};
+
+#endif
@@ -0,0 +1,77 @@
+/*
+ *  TestIRTruncation.cpp
+ *  Convolvotron
+ *
+ *  Created by Seth Nickell on 10/18/09.
+ *  Copyright 2009 Meatscience. All rights reserved.
+ *
+ */
+
+#include "Convolver.h"
+
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+
+using std::cout;
+using std::endl;
+using std::vector;
+using boost::shared_ptr;
+using namespace Convolver;
+
+static const uint32_t kIRLength = 200000;
+static const float kDecaySamples = 2000.0f;
+
+static float randomSample() {
+	return (float)rand() / RAND_MAX - 0.5f;
+}
+
+// Exponential decay into a noise floor that runs to the end
+static vector<TimeSample> makeIR(uint32_t length, float noiseLevel) {
+	vector<TimeSample> signal(length);
+	for (uint32_t i=0; i < length; i++) {
+		signal[i] = randomSample() * expf(-(float)i / kDecaySamples) + randomSample() * noiseLevel;
+	}
+	return signal;
+}
+
+static bool testLength(const char *name, vector<TimeSample> &signal, float thresholdDecibels, uint32_t minLength, uint32_t maxLength) {
+	vector<const TimeSample *> signals(1, &signal[0]);
+	uint32_t length = IR::findDecayedLength(signals, signal.size(), thresholdDecibels);
+	bool passed = length >= minLength && length <= maxLength;
+	cout << name << ": " << signal.size() << " samples decayed after " << length << (passed ? "" : " FAILED") << endl;
+	return passed;
+}
+
+int main(int argc, char *argv[]) {
+	bool passed = true;
+
+	// Energy left after t falls as exp(-2t / decay), so it's 60dB down at about 6.9 decays
+	uint32_t expected = (uint32_t)(kDecaySamples * log(1e6) / 2.0);
+
+	// The noise floor holds the raw curve up at about -40dB, it has to be taken out
+	vector<TimeSample> noisy = makeIR(kIRLength, 1e-3f);
+	passed &= testLength("noise floor", noisy, -60.0f, expected * 9 / 10, expected * 11 / 10);
+
+	vector<TimeSample> clean = makeIR(kIRLength, 0.0f);
+	passed &= testLength("clean", clean, -60.0f, expected * 9 / 10, expected * 11 / 10);
+
+	// Cut off while it's still ringing, there's nothing to take away
+	vector<TimeSample> cutOff = makeIR(4000, 0.0f);
+	passed &= testLength("cut off", cutOff, -60.0f, 4000, 4000);
+
+	// Truncating at load keeps the filters that short, faded out at the end
+	shared_ptr<BlockPattern> pattern(new DoublingBlockPattern(64, 4096));
+	Kernel kernel(pattern);
+	vector<const TimeSample *> signals(1, &noisy[0]);
+	IR ir(kernel, pattern, signals, kIRLength, false, "noisy", -60.0f);
+	Filter &filter = *ir.getFilters()[0];
+	bool truncated = ir.getOriginalLength() == kIRLength && ir.getLength() < kIRLength / 10 && filter.getNumSamples() == ir.getLength();
+	truncated &= filter.getSamples()[filter.getNumSamples() - 1] == 0.0f;
+	cout << "IR: truncated to " << ir.getLength() << " samples" << (truncated ? "" : " FAILED") << endl;
+	passed &= truncated;
+
+	return passed ? 0 : 1;
+}
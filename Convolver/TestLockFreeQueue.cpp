@@ -0,0 +1,116 @@
+/*
+ *  TestLockFreeQueue.cpp
+ *  Convolvotron
+ *
+ *  Created by Seth Nickell on 10/18/09.
+ *  Copyright 2009 Meatscience. All rights reserved.
+ *
+ */
+
+#include "LockFreeQueue.h"
+
+#include <iostream>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+#include <assert.h>
+#include <boost/shared_ptr.hpp>
+
+using std::cout;
+using std::endl;
+using std::vector;
+using boost::shared_ptr;
+using namespace Convolver;
+
+static const uint32_t kNumProducers = 3;
+static const uint32_t kNumConsumers = 3;
+static const uint32_t kItemsPerProducer = 100000;
+
+static LockFreeQueue<uint64_t> queue(64);
+static volatile uint32_t numProducersDone = 0;
+static vector<uint32_t> timesSeen(kNumProducers * kItemsPerProducer);
+
+static void *producer(void *arguments) {
+	uint64_t first = *(uint32_t *)arguments * kItemsPerProducer;
+	for (uint64_t i=first; i < first + kItemsPerProducer; i++) {
+		// Full just means the consumers are behind
+		while (!queue.push(i)) sched_yield();
+	}
+	__sync_add_and_fetch(&numProducersDone, 1);
+	return NULL;
+}
+
+static void *consumer(void *arguments) {
+	uint64_t item;
+	while (true) {
+		if (queue.pop(item)) {
+			__sync_add_and_fetch(&timesSeen[item], 1);
+		} else if (numProducersDone == kNumProducers && queue.empty()) {
+			return NULL;
+		} else {
+			sched_yield();
+		}
+	}
+}
+
+static void testSingleThreaded() {
+	LockFreeQueue<shared_ptr<int> > small(3);
+	assert(small.getCapacity() == 4);
+	assert(small.empty());
+
+	shared_ptr<int> value(new int(7));
+	for (uint32_t i=0; i < 4; i++) assert(small.push(value));
+	assert(!small.push(value));
+	assert(!small.push(value));
+	assert(small.getNumFull() == 2);
+	assert(small.getNumPushed() == 4);
+	assert(value.use_count() == 5);
+
+	// Popping should let go of the queue's copy, not just hand us another
+	shared_ptr<int> popped;
+	assert(small.pop(popped));
+	assert(*popped == 7);
+	popped.reset();
+	assert(value.use_count() == 4);
+
+	// Round a few more laps, in order
+	for (int i=0; i < 20; i++) {
+		assert(small.push(shared_ptr<int>(new int(i))));
+		assert(small.pop(popped));
+		if (i == 0) assert(popped == value);
+	}
+	while (small.pop(popped)) ;
+	popped.reset();
+	assert(small.empty());
+	assert(value.use_count() == 1);
+}
+
+int main(int argc, char *argv[]) {
+	testSingleThreaded();
+
+	vector<uint32_t> producerNums(kNumProducers);
+	vector<pthread_t> threads;
+	for (uint32_t i=0; i < kNumConsumers; i++) {
+		pthread_t thread;
+		pthread_create(&thread, NULL, &consumer, NULL);
+		threads.push_back(thread);
+	}
+	for (uint32_t i=0; i < kNumProducers; i++) {
+		producerNums[i] = i;
+		pthread_t thread;
+		pthread_create(&thread, NULL, &producer, &producerNums[i]);
+		threads.push_back(thread);
+	}
+	for (uint32_t i=0; i < threads.size(); i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	// Everything pushed came out exactly once
+	for (uint32_t i=0; i < timesSeen.size(); i++) {
+		assert(timesSeen[i] == 1);
+	}
+	assert(queue.getNumPushed() == kNumProducers * kItemsPerProducer);
+
+	cout << "All tests seem to have passed (the queue was full " << queue.getNumFull() << " times)" << endl;
+	return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ *  TestMultiplyComplex.cpp
+ *  Convolvotron
+ *
+ *  Created by Seth Nickell on 10/17/09.
+ *  Copyright 2009 Meatscience. All rights reserved.
+ *
+ */
+
+#include "SSEConvolution.h"
+
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+
+using std::cout;
+using std::endl;
+using std::vector;
+
+static float randomSample() {
+	return (float)rand() / RAND_MAX - 0.5f;
+}
+
+static void multiplyComplexReference(const float *input, const float *filter, float *accumulator, int numComplexNumbers) {
+	for (int i=0; i < numComplexNumbers; i++) {
+		float ar = input[2*i], ai = input[2*i+1];
+		float br = filter[2*i], bi = filter[2*i+1];
+		accumulator[2*i] += ar * br - ai * bi;
+		accumulator[2*i+1] += ar * bi + ai * br;
+	}
+}
+
+// Run a kernel (plus the scalar tail, like Kernel does) against the reference, starting at
+// an odd offset into the buffers so we know unaligned memory is fine too
+static bool testKernel(const char *name, MultiplyComplexFunction multiply, int numComplexNumbers, int offset) {
+	int numFloats = (numComplexNumbers + offset) * 2;
+	vector<float> input(numFloats), filter(numFloats), accumulator(numFloats), expected(numFloats);
+	for (int i=0; i < numFloats; i++) {
+		input[i] = randomSample();
+		filter[i] = randomSample();
+		accumulator[i] = expected[i] = randomSample();
+	}
+
+	float *in = &input[offset * 2], *fil = &filter[offset * 2], *acc = &accumulator[offset * 2];
+
+	int done = multiply(in, fil, acc, numComplexNumbers);
+	assert(done >= 0 && done <= numComplexNumbers);
+	multiplyComplexReference(in + done * 2, fil + done * 2, acc + done * 2, numComplexNumbers - done);
+
+	multiplyComplexReference(&input[offset * 2], &filter[offset * 2], &expected[offset * 2], numComplexNumbers);
+
+	for (int i=0; i < numFloats; i++) {
+		if (fabs(accumulator[i] - expected[i]) > 1e-5) {
+			cout << name << ": mismatch at float " << i << " of " << numComplexNumbers << " complex numbers (offset " << offset << "): ";
+			cout << accumulator[i] << " != " << expected[i] << endl;
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	vector<MultiplyComplexFunction> kernels;
+	kernels.push_back(multiply_complex_SSE3);
+#if SSE_CONVOLUTION_MULTIVERSION
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) kernels.push_back(multiply_complex_AVX2);
+	if (__builtin_cpu_supports("avx512f")) kernels.push_back(multiply_complex_AVX512);
+#endif
+
+	// FreqBlocks are n/2+1 long, so the odd sizes are the ones that matter
+	int sizes[] = {0, 1, 2, 3, 5, 7, 8, 9, 15, 16, 17, 33, 65, 129, 513, 2049};
+	int numSizes = sizeof(sizes) / sizeof(sizes[0]);
+
+	bool passed = true;
+	for (uint32_t k=0; k < kernels.size(); k++) {
+		const char *name = multiply_complex_name(kernels[k]);
+		for (int s=0; s < numSizes; s++) {
+			for (int offset=0; offset < 3; offset++) {
+				passed &= testKernel(name, kernels[k], sizes[s], offset);
+			}
+		}
+		cout << name << (passed ? " passed" : " FAILED") << endl;
+	}
+
+	cout << "Using " << multiply_complex_name(multiply_complex_best()) << endl;
+
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+/*
+ *  TestProgressiveIR.cpp
+ *  Convolvotron
+ *
+ *  Copyright 2026 Meatscience. All rights reserved.
+ *
+ */
+
+#include "TestHelpers.h"
+
+#include <iostream>
+
+using std::cout;
+using std::endl;
+using std::vector;
+using boost::shared_ptr;
+using namespace Convolver;
+
+static const uint32_t kFrameSize = 64;
+static const uint32_t kIRLength = 16384;
+static const uint32_t kPreparedLength = 1024;
+static const uint32_t kNumFrames = 2 * kIRLength / kFrameSize;
+
+static vector<TimeSample> irSignal(kIRLength);
+static vector<TimeSample> inSignal(kNumFrames * kFrameSize);
+
+// Prepares blocksPerFrame more of the IR between callbacks, like the AU's loading thread would
+class PrepareMore : public MonoRunHooks {
+public:
+	PrepareMore(IR &ir, Kernel &loaderKernel, uint32_t blocksPerFrame)
+		: ir(ir), loaderKernel(loaderKernel), blocksPerFrame(blocksPerFrame), preparedByFrame(0) {}
+	void afterFrame(Convolver::Convolver &convolver, uint32_t frame) {
+		if (ir.isPrepared()) return;
+		ir.prepareMore(loaderKernel, blocksPerFrame);
+		preparedByFrame = frame + 1;
+	}
+	IR &ir;
+	Kernel &loaderKernel;
+	uint32_t blocksPerFrame;
+	uint32_t preparedByFrame;
+};
+
+// Starts convolving with only the first kPreparedLength samples prepared
+static bool testPattern(const char *name, shared_ptr<BlockPattern> pattern, Kernel::Scheduler scheduler, uint32_t blocksPerFrame, vector<TimeSample> &reference,
+						bool normalize=false) {
+	Convolver::Convolver convolver(pattern, false);
+	convolver.setScheduler(scheduler);
+
+	Kernel loaderKernel(pattern);
+	vector<const TimeSample *> irs(1, &irSignal[0]);
+	IR ir(loaderKernel, pattern, irs, kIRLength, normalize, "progressive", 0.0f, kPreparedLength);
+	Filter &filter = *ir.getFilters()[0];
+	uint32_t numPreparedAtStart = filter.getNumPreparedBlocks();
+	uint32_t numBlocks = filter.getBlocks().size();
+	setupMono(convolver, ir);
+
+	PrepareMore prepareMore(ir, loaderKernel, blocksPerFrame);
+	vector<TimeSample> outSignal = runMono(convolver, inSignal, kFrameSize, &prepareMore);
+
+	// Normalized on the whole IR, the partitions prepared late have to be scaled the same
+	vector<TimeSample> expected(reference);
+	if (normalize) {
+		float scale = 1.0f / IR::measureGain(irs, kIRLength);
+		for (uint32_t i=0; i < expected.size(); i++) expected[i] *= scale;
+	}
+	float error = worstError(outSignal, expected);
+	bool passed = error < 1e-3f && numPreparedAtStart < numBlocks && ir.isPrepared();
+
+	cout << name << ": error " << error << ", " << numPreparedAtStart << " of " << numBlocks << " partitions prepared up front";
+	cout << ", the rest by frame " << prepareMore.preparedByFrame << (passed ? "" : " FAILED") << endl;
+	return passed;
+}
+
+// Switches to newPattern at switchFrame the way the AU does on a new buffer size: new
+// Filters queued first, then the pattern. The old ones mustn't be touched.
+class Repartition : public MonoRunHooks {
+public:
+	Repartition(IR &ir, shared_ptr<BlockPattern> newPattern, uint32_t switchFrame)
+		: ir(ir), newPattern(newPattern), switchFrame(switchFrame) {}
+	bool beforeFrame(Convolver::Convolver &convolver, uint32_t frame, const TimeSample *input) {
+		if (frame != switchFrame) return true;
+		Kernel kernel(newPattern);
+		newIR = ir.repartitioned(kernel, newPattern);
+		setupMono(convolver, *newIR);
+		convolver.setBlockPattern(newPattern);
+		return true;
+	}
+	IR &ir;
+	shared_ptr<BlockPattern> newPattern;
+	uint32_t switchFrame;
+	shared_ptr<IR> newIR;
+};
+
+static bool testRepartition(const char *name, vector<TimeSample> &reference) {
+	shared_ptr<BlockPattern> pattern(new FixedSizeBlockPattern(kFrameSize));
+	Convolver::Convolver convolver(pattern, false);
+	convolver.setCrossfadeLength(4 * kFrameSize);
+	
+	vector<const TimeSample *> irs(1, &irSignal[0]);
+	IR ir(convolver.getKernel(), pattern, irs, kIRLength, false, "repartitioned", 0.0f, kPreparedLength);
+	Filter &filter = *ir.getFilters()[0];
+	uint32_t numPrepared = filter.getNumPreparedBlocks();
+	setupMono(convolver, ir);
+	
+	uint32_t switchFrame = kNumFrames / 4;
+	Repartition repartition(ir, shared_ptr<BlockPattern>(new DoublingBlockPattern(kFrameSize, 1024)), switchFrame);
+	vector<TimeSample> outSignal = runMono(convolver, inSignal, kFrameSize, &repartition);
+	
+	// Once what went in before the switch has rung out, it's all the new Filters
+	uint32_t settled = switchFrame * kFrameSize + kIRLength;
+	vector<TimeSample> expected = convolveTheSlowWay(inSignal, irSignal, switchFrame * kFrameSize);
+	vector<TimeSample> settledOut(outSignal.begin() + settled, outSignal.end());
+	vector<TimeSample> settledExpected(expected.begin() + settled, expected.end());
+	float error = worstError(settledOut, settledExpected);
+	bool untouched = filter.getBlockPattern() == pattern && filter.getNumPreparedBlocks() == numPrepared;
+	bool passed = error < 1e-3f && untouched && repartition.newIR->isPrepared();
+	
+	cout << name << ": error " << error << " after the switch, old filter " << (untouched ? "untouched" : "modified") << (passed ? "" : " FAILED") << endl;
+	return passed;
+}
+
+int main(int argc, char *argv[]) {
+	for (uint32_t i=0; i < kIRLength; i++) irSignal[i] = randomSample() * expf(-(float)i / 4000.0f);
+	for (uint32_t i=0; i < inSignal.size(); i++) inSignal[i] = randomSample();
+	vector<TimeSample> reference = convolveTheSlowWay(inSignal, irSignal);
+
+	// The FDL needs partition n by frame n, a request's partitions are multiplied when its
+	// level's first input is complete, so the big ones have to keep up faster
+	bool passed = true;
+	passed &= testPattern("fdl", shared_ptr<BlockPattern>(new FixedSizeBlockPattern(kFrameSize)), Kernel::SCHEDULER_FDL, 1, reference);
+	passed &= testPattern("doubling", shared_ptr<BlockPattern>(new DoublingBlockPattern(kFrameSize, 1024)), Kernel::SCHEDULER_FRAME_REQUESTS, 4, reference);
+	passed &= testPattern("fdl normalized", shared_ptr<BlockPattern>(new FixedSizeBlockPattern(kFrameSize)), Kernel::SCHEDULER_FDL, 1, reference, true);
+	passed &= testRepartition("repartitioned", reference);
+	return passed ? 0 : 1;
+}
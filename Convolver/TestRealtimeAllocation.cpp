@@ -0,0 +1,147 @@
+/*
+ *  TestRealtimeAllocation.cpp
+ *  Convolvotron
+ *
+ *  Created by Seth Nickell on 10/18/09.
+ *  Copyright 2009 Meatscience. All rights reserved.
+ *
+ */
+
+#include "Convolver.h"
+
+#include <iostream>
+#include <vector>
+#include <new>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+
+using std::cout;
+using std::endl;
+using std::vector;
+using boost::shared_ptr;
+using namespace Convolver;
+
+// Every operator new in the process goes through here, so while countAllocations is
+// set we know exactly how many times the audio path touched the heap
+static bool countAllocations = false;
+static uint32_t numAllocations = 0;
+
+// Dynamic exception specifications are gone in newer C++
+#if __cplusplus >= 201103L
+#define NEW_THROWS
+#define DELETE_THROWS noexcept
+#else
+#define NEW_THROWS throw(std::bad_alloc)
+#define DELETE_THROWS throw()
+#endif
+
+void *operator new(size_t size) NEW_THROWS {
+	if (countAllocations) numAllocations++;
+	void *memory = malloc(size > 0 ? size : 1);
+	if (memory == NULL) throw std::bad_alloc();
+	return memory;
+}
+
+void *operator new[](size_t size) NEW_THROWS {
+	return operator new(size);
+}
+
+void operator delete(void *memory) DELETE_THROWS {
+	free(memory);
+}
+
+void operator delete[](void *memory) DELETE_THROWS {
+	free(memory);
+}
+
+static const uint32_t kFrameSize = 64;
+static const uint32_t kIRLength = 4096;
+// Long enough for the delay line to fill and everything to settle
+static const uint32_t kWarmUpFrames = 2 * kIRLength / kFrameSize;
+static const uint32_t kMeasuredFrames = 500;
+
+static float randomSample() {
+	return (float)rand() / RAND_MAX - 0.5f;
+}
+
+// Allocations per frame once a Convolver has warmed up, and how many of the blocks
+// couldn't be found in the BlockPool
+static double allocationsPerFrame(shared_ptr<BlockPattern> pattern, Kernel::Scheduler scheduler, uint32_t numChannels, uint32_t numHeadBlocks, float dryGain, uint64_t *poolMisses = NULL, bool spread = false, bool useBackgroundThreads = false) {
+	Convolver::Convolver convolver(pattern, useBackgroundThreads);
+	convolver.setScheduler(scheduler);
+	convolver.setSpreadLargePartitions(spread);
+
+	vector<vector<TimeSample> > irSignals(numChannels, vector<TimeSample>(kIRLength));
+	vector<const TimeSample *> irs;
+	for (uint32_t c=0; c < numChannels; c++) {
+		for (uint32_t i=0; i < kIRLength; i++) irSignals[c][i] = randomSample();
+		irs.push_back(&irSignals[c][0]);
+	}
+	IR ir(convolver.getKernel(), pattern, irs, kIRLength, false);
+	if (numHeadBlocks > 0) ir.setTimeDomainHead(numHeadBlocks);
+
+	bool changeOutChannels = true;
+	uint32_t numOutChannels = numChannels;
+	if (numChannels == 1) {
+		convolver.setupMonoIn(ir.getFilters(), changeOutChannels, numOutChannels);
+	} else {
+		convolver.setupStereoIn(ir.getFilters(), changeOutChannels, numOutChannels, 1.0f);
+	}
+
+	vector<vector<TimeSample> > inSignals(numChannels, vector<TimeSample>(kFrameSize));
+	vector<vector<TimeSample> > outSignals(numOutChannels, vector<TimeSample>(kFrameSize));
+	vector<const TimeSample *> in;
+	vector<TimeSample *> out;
+	for (uint32_t c=0; c < numChannels; c++) in.push_back(&inSignals[c][0]);
+	for (uint32_t c=0; c < numOutChannels; c++) out.push_back(&outSignals[c][0]);
+
+	uint64_t systemAllocationsBefore = 0;
+	for (uint32_t frame=0; frame < kWarmUpFrames + kMeasuredFrames; frame++) {
+		for (uint32_t c=0; c < numChannels; c++) {
+			for (uint32_t i=0; i < kFrameSize; i++) inSignals[c][i] = randomSample();
+		}
+
+		if (frame == kWarmUpFrames) {
+			numAllocations = 0;
+			countAllocations = true;
+			systemAllocationsBefore = BlockPool::getNumSystemAllocations();
+		}
+		convolver.convolve(in, out, kFrameSize, dryGain, 1.0f);
+	}
+	countAllocations = false;
+	if (poolMisses) *poolMisses = BlockPool::getNumSystemAllocations() - systemAllocationsBefore;
+
+	return (double)numAllocations / kMeasuredFrames;
+}
+
+static bool expectNoAllocations(const char *name, double perFrame) {
+	cout << name << ": " << perFrame << " allocations per frame" << (perFrame == 0.0 ? "" : " FAILED") << endl;
+	return perFrame == 0.0;
+}
+
+int main(int argc, char *argv[]) {
+	shared_ptr<BlockPattern> fixed(new FixedSizeBlockPattern(kFrameSize));
+	shared_ptr<BlockPattern> twoSize(new TwoSizeBlockPattern(kFrameSize, kFrameSize * 8, 8));
+
+	bool passed = true;
+	passed &= expectNoAllocations("fdl mono", allocationsPerFrame(fixed, Kernel::SCHEDULER_FDL, 1, 0, 0.0f));
+	passed &= expectNoAllocations("fdl stereo", allocationsPerFrame(fixed, Kernel::SCHEDULER_FDL, 2, 0, 0.0f));
+	passed &= expectNoAllocations("fdl stereo with dry", allocationsPerFrame(fixed, Kernel::SCHEDULER_FDL, 2, 0, 0.5f));
+	passed &= expectNoAllocations("fdl mono with head", allocationsPerFrame(fixed, Kernel::SCHEDULER_FDL, 1, 2, 0.0f));
+
+	// Requests, their spectra and the accumulators all get reused once the rings are big enough
+	uint64_t poolMisses = 0;
+	passed &= expectNoAllocations("frame requests", allocationsPerFrame(twoSize, Kernel::SCHEDULER_FRAME_REQUESTS, 2, 0, 0.0f, &poolMisses));
+	cout << "frame requests: " << poolMisses << " blocks from the system" << (poolMisses == 0 ? "" : " FAILED") << endl;
+	passed &= poolMisses == 0;
+
+	// ...and so does everything a request spread over several frames keeps hold of
+	shared_ptr<BlockPattern> twoSizeWithSlack(new TwoSizeBlockPattern(kFrameSize, kFrameSize * 8, 16));
+	passed &= expectNoAllocations("spread frame requests", allocationsPerFrame(twoSizeWithSlack, Kernel::SCHEDULER_FRAME_REQUESTS, 2, 0, 0.0f, NULL, true));
+
+	// ...and what gets handed to the workers, the input included
+	passed &= expectNoAllocations("threaded frame requests", allocationsPerFrame(twoSizeWithSlack, Kernel::SCHEDULER_FRAME_REQUESTS, 2, 0, 0.0f, NULL, false, true));
+
+	return passed ? 0 : 1;
+}
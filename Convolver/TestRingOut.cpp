@@ -0,0 +1,81 @@
+/*
+ *  TestRingOut.cpp
+ *  Convolvotron
+ *
+ *  Copyright 2026 Meatscience. All rights reserved.
+ *
+ */
+
+#include "TestHelpers.h"
+
+#include <iostream>
+
+using std::cout;
+using std::endl;
+using std::vector;
+using boost::shared_ptr;
+using namespace Convolver;
+
+static const uint32_t kFrameSize = 64;
+static const uint32_t kIRLength = 8192;
+static const uint32_t kNumFrames = 8 * kIRLength / kFrameSize;
+
+static vector<TimeSample> irSignal(kIRLength);
+static vector<TimeSample> inSignal(kNumFrames * kFrameSize);
+
+static bool isSilent(const TimeSample *frame) {
+	for (uint32_t i=0; i < kFrameSize; i++) {
+		if (frame[i] != 0.0f) return false;
+	}
+	return true;
+}
+
+// Drives the Convolver like the AU does: silent callbacks are skipped once the tail's rung out
+class SkipSilence : public MonoRunHooks {
+public:
+	SkipSilence() : numSkipped(0) {}
+	bool beforeFrame(Convolver::Convolver &convolver, uint32_t frame, const TimeSample *input) {
+		if (isSilent(input) && !convolver.isRingingOut()) {
+			numSkipped++;
+			return false;
+		}
+		return true;
+	}
+	uint32_t numSkipped;
+};
+
+static bool testPattern(const char *name, shared_ptr<BlockPattern> pattern, Kernel::Scheduler scheduler, vector<TimeSample> &reference) {
+	MonoConvolver mono(pattern, irSignal);
+	mono.convolver.setScheduler(scheduler);
+	mono.setup();
+
+	SkipSilence skipSilence;
+	vector<TimeSample> output = mono.run(inSignal, kFrameSize, &skipSilence);
+
+	// Whatever the tail had left below the threshold is all that's missing
+	float error = worstError(output, reference);
+	bool passed = error < 1e-4f && skipSilence.numSkipped > 0;
+
+	cout << name << ": error " << error << ", skipped " << skipSilence.numSkipped << " of " << kNumFrames << " callbacks";
+	cout << (passed ? "" : " FAILED") << endl;
+	return passed;
+}
+
+int main(int argc, char *argv[]) {
+	// Decays well below -96dB before the end, so there's a tail to stop early on
+	for (uint32_t i=0; i < kIRLength; i++) irSignal[i] = randomSample() * expf(-(float)i / 500.0f);
+
+	// A burst, a gap longer than the tail, a burst, then a gap shorter than it
+	for (uint32_t i=0; i < inSignal.size(); i++) {
+		uint32_t frame = i / kFrameSize;
+		bool sound = frame < kNumFrames / 8 || (frame >= kNumFrames / 2 && frame < kNumFrames / 2 + 20) || (frame >= kNumFrames / 2 + 40 && frame < kNumFrames / 2 + 60);
+		inSignal[i] = sound ? randomSample() : 0.0f;
+	}
+
+	vector<TimeSample> reference = convolveTheSlowWay(inSignal, irSignal);
+
+	bool passed = true;
+	passed &= testPattern("doubling", shared_ptr<BlockPattern>(new DoublingBlockPattern(kFrameSize, 1024)), Kernel::SCHEDULER_FRAME_REQUESTS, reference);
+	passed &= testPattern("fdl", shared_ptr<BlockPattern>(new FixedSizeBlockPattern(kFrameSize)), Kernel::SCHEDULER_FDL, reference);
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,80 @@
+/*
+ *  TestSchedule.cpp
+ *  Convolvotron
+ *
+ *  Created by Seth Nickell on 10/18/09.
+ *  Copyright 2009 Meatscience. All rights reserved.
+ *
+ */
+
+#include "ConvolverSchedule.h"
+
+#include <iostream>
+#include <set>
+#include <stdint.h>
+#include <assert.h>
+
+using std::cout;
+using std::endl;
+using std::set;
+using std::pair;
+using namespace Convolver;
+
+// (blockNum, output frame) for every partition due on frameNum, the slow way: partition i
+// starts a request every time the frame number is a multiple of its size, and the request
+// is due on its last frame
+static set<pair<uint32_t, FrameNum> > dueTheSlowWay(BlockPattern &pattern, uint32_t numBlocks, FrameNum frameNum) {
+	set<pair<uint32_t, FrameNum> > due;
+	uint32_t frameSize = pattern.minimumBlockSize();
+	uint32_t delay = 0;
+	for (uint32_t i=0; i < numBlocks; i++) {
+		uint32_t numFrames = pattern.sizeForTimeBlock(i) / frameSize;
+		if (frameNum + 1 >= numFrames) {
+			FrameNum startFrame = frameNum + 1 - numFrames;
+			if (startFrame % numFrames == 0) due.insert(std::make_pair(i, startFrame + delay));
+		}
+		delay += numFrames;
+	}
+	return due;
+}
+
+static set<pair<uint32_t, FrameNum> > dueFromSchedule(const Schedule &schedule, FrameNum frameNum) {
+	set<pair<uint32_t, FrameNum> > due;
+	const vector<uint32_t> &levels = schedule.levelsDueOn(frameNum);
+	for (uint32_t l=0; l < levels.size(); l++) {
+		const Schedule::Level &level = schedule.getLevel(levels[l]);
+		if (frameNum + 1 < level.numFrames) continue;
+		FrameNum startFrame = frameNum + 1 - level.numFrames;
+		for (uint32_t p=0; p < level.partitions.size(); p++) {
+			due.insert(std::make_pair(level.partitions[p].blockNum, startFrame + level.partitions[p].delay));
+		}
+	}
+	return due;
+}
+
+static bool testPattern(const char *name, BlockPattern &pattern, uint32_t numBlocks) {
+	Schedule schedule(pattern, numBlocks);
+	for (FrameNum frame=0; frame < 4 * schedule.getPeriod() + 3; frame++) {
+		if (dueFromSchedule(schedule, frame) != dueTheSlowWay(pattern, numBlocks, frame)) {
+			cout << name << ": " << numBlocks << " partitions disagree on frame " << frame << " FAILED" << endl;
+			return false;
+		}
+	}
+	cout << name << ": " << numBlocks << " partitions, period " << schedule.getPeriod() << " passed" << endl;
+	return true;
+}
+
+int main(int argc, char *argv[]) {
+	FixedSizeBlockPattern fixed(64);
+	TwoSizeBlockPattern twoSize(64, 512, 8);
+	DoublingBlockPattern doubling(64, 8192);
+
+	bool passed = true;
+	uint32_t lengths[] = {1, 3, 8, 9, 17, 40};
+	for (uint32_t i=0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+		passed &= testPattern("fixed", fixed, lengths[i]);
+		passed &= testPattern("two size", twoSize, lengths[i]);
+		passed &= testPattern("doubling", doubling, lengths[i]);
+	}
+	return passed ? 0 : 1;
+}
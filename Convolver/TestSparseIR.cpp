@@ -0,0 +1,88 @@
+/*
+ *  TestSparseIR.cpp
+ *  Convolvotron
+ *
+ *  Copyright 2026 Meatscience. All rights reserved.
+ *
+ */
+
+#include "TestHelpers.h"
+
+#include <iostream>
+
+using std::cout;
+using std::endl;
+using std::vector;
+using boost::shared_ptr;
+using namespace Convolver;
+
+static const uint32_t kFrameSize = 64;
+static const uint32_t kPreDelay = 3000;
+static const uint32_t kIRLength = 16384;
+static const uint32_t kNumFrames = 2 * kIRLength / kFrameSize;
+
+static vector<TimeSample> irSignal(kIRLength);
+static vector<TimeSample> inSignal(kNumFrames * kFrameSize);
+
+static bool testPattern(const char *name, shared_ptr<BlockPattern> pattern, Kernel::Scheduler scheduler, vector<TimeSample> &reference, bool dark) {
+	MonoConvolver mono(pattern, irSignal);
+	mono.convolver.setScheduler(scheduler);
+
+	// numBins is every bin of every non-empty partition, numBinsKept the ones the MACs touch
+	Filter &filter = *mono.ir.getFilters()[0];
+	uint32_t numBlocks = filter.getBlocks().size();
+	uint32_t numEmpty = 0, numBinsKept = 0, numBins = 0;
+	for (uint32_t i=0; i < numBlocks; i++) {
+		if (filter.isBlockEmpty(i)) {
+			numEmpty++;
+			continue;
+		}
+		numBinsKept += filter.getBlocks()[i]->getNumBins();
+		numBins += filter.getBlocks()[i]->size();
+	}
+
+	mono.setup();
+	vector<TimeSample> output = mono.run(inSignal, kFrameSize);
+
+	float error = worstError(output, reference);
+	bool passed = error < 1e-3f && numEmpty > 0;
+	// The tail's high end dies away first, so a good part of its bins should go
+	if (dark) passed &= numBinsKept < numBins * 3 / 4;
+
+	cout << name << ": error " << error << ", " << numEmpty << " of " << numBlocks << " partitions empty";
+	cout << ", " << numBinsKept << " of " << numBins << " bins multiplied";
+	cout << (passed ? "" : " FAILED") << endl;
+	return passed;
+}
+
+static bool testPatterns(const char *name, bool dark) {
+	vector<TimeSample> reference = convolveTheSlowWay(inSignal, irSignal);
+	cout << name << ":" << endl;
+	bool passed = true;
+	passed &= testPattern("doubling", shared_ptr<BlockPattern>(new DoublingBlockPattern(kFrameSize, 1024)), Kernel::SCHEDULER_FRAME_REQUESTS, reference, dark);
+	passed &= testPattern("two size", shared_ptr<BlockPattern>(new TwoSizeBlockPattern(kFrameSize, 1024, 32)), Kernel::SCHEDULER_FRAME_REQUESTS, reference, dark);
+	passed &= testPattern("fdl", shared_ptr<BlockPattern>(new FixedSizeBlockPattern(kFrameSize)), Kernel::SCHEDULER_FDL, reference, dark);
+	return passed;
+}
+
+int main(int argc, char *argv[]) {
+	for (uint32_t i=0; i < inSignal.size(); i++) inSignal[i] = randomSample();
+	
+	// Pre-delay, then a tail that's died away to nothing long before the end
+	for (uint32_t i=kPreDelay; i < kIRLength; i++) irSignal[i] = randomSample() * expf(-(float)(i - kPreDelay) / 400.0f);
+	bool passed = testPatterns("bright", false);
+	
+	// Same again through a steep lowpass that closes down as it decays, like a dark hall
+	float state[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+	for (uint32_t i=kPreDelay; i < kIRLength; i++) {
+		float cutoff = 0.05f + 0.95f * expf(-(float)(i - kPreDelay) / 300.0f);
+		float sample = irSignal[i];
+		for (uint32_t pole=0; pole < 4; pole++) {
+			state[pole] += cutoff * (sample - state[pole]);
+			sample = state[pole];
+		}
+		irSignal[i] = sample;
+	}
+	passed &= testPatterns("dark", true);
+	return passed ? 0 : 1;
+}
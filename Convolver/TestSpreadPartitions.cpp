@@ -0,0 +1,105 @@
+/*
+ *  TestSpreadPartitions.cpp
+ *  Convolvotron
+ *
+ *  Copyright 2026 Meatscience. All rights reserved.
+ *
+ */
+
+#include "TestHelpers.h"
+
+#include <iostream>
+#include <sys/time.h>
+
+using std::cout;
+using std::endl;
+using std::vector;
+using boost::shared_ptr;
+using namespace Convolver;
+
+static const uint32_t kFrameSize = 64;
+static const uint32_t kIRLength = 65536;
+static const uint32_t kNumFrames = 2 * kIRLength / kFrameSize;
+
+static vector<TimeSample> irSignal(kIRLength);
+static vector<TimeSample> inSignal(kNumFrames * kFrameSize);
+
+static double secondsNow() {
+	timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec + now.tv_usec / 1e6;
+}
+
+// Counts the MACs and times each callback
+class MeasureCallbacks : public MonoRunHooks {
+public:
+	MeasureCallbacks() : callbackMACs(kNumFrames), callbackSeconds(kNumFrames), macsBefore(0), start(0.0) {}
+	bool beforeFrame(Convolver::Convolver &convolver, uint32_t frame, const TimeSample *input) {
+		macsBefore = convolver.getKernel().getNumMACs();
+		start = secondsNow();
+		return true;
+	}
+	void afterFrame(Convolver::Convolver &convolver, uint32_t frame) {
+		callbackSeconds[frame] = secondsNow() - start;
+		callbackMACs[frame] = convolver.getKernel().getNumMACs() - macsBefore;
+	}
+	vector<uint64_t> callbackMACs;
+	vector<double> callbackSeconds;
+private:
+	uint64_t macsBefore;
+	double start;
+};
+
+// Runs the whole input through a mono Convolver without threads
+static vector<TimeSample> run(shared_ptr<BlockPattern> pattern, bool spread, MeasureCallbacks &measure) {
+	MonoConvolver mono(pattern, irSignal);
+	mono.convolver.setSpreadLargePartitions(spread);
+	mono.setup();
+
+	return mono.run(inSignal, kFrameSize, &measure);
+}
+
+// The busiest callback, past the first time round the IR while everything's warming up
+static uint64_t worstMACs(vector<uint64_t> callbackMACs) {
+	callbackMACs.erase(callbackMACs.begin(), callbackMACs.begin() + kIRLength / kFrameSize);
+	return *std::max_element(callbackMACs.begin(), callbackMACs.end());
+}
+
+// Same for the clock, ignoring the odd callback the OS took away from us
+static double worstSeconds(vector<double> callbackSeconds) {
+	callbackSeconds.erase(callbackSeconds.begin(), callbackSeconds.begin() + kIRLength / kFrameSize);
+	std::sort(callbackSeconds.begin(), callbackSeconds.end());
+	return callbackSeconds[callbackSeconds.size() - 1 - callbackSeconds.size() / 200];
+}
+
+static bool testPattern(const char *name, shared_ptr<BlockPattern> pattern, bool expectFlatter) {
+	MeasureCallbacks wholeMeasure, spreadMeasure;
+	vector<TimeSample> whole = run(pattern, false, wholeMeasure);
+	vector<TimeSample> spread = run(pattern, true, spreadMeasure);
+
+	// Only the order of the arithmetic's changed
+	float error = worstError(spread, whole);
+	bool passed = error < 1e-3f;
+
+	// The clock's only reported, a busy machine makes it too noisy to test against
+	uint64_t wholeWorst = worstMACs(wholeMeasure.callbackMACs), spreadWorst = worstMACs(spreadMeasure.callbackMACs);
+	if (expectFlatter) passed &= spreadWorst < wholeWorst;
+
+	cout << name << ": error " << error << ", busiest callback " << wholeWorst << " -> " << spreadWorst << " MACs";
+	cout << ", slowest " << worstSeconds(wholeMeasure.callbackSeconds) * 1e6 << "us -> " << worstSeconds(spreadMeasure.callbackSeconds) * 1e6 << "us";
+	cout << (passed ? "" : " FAILED") << endl;
+	return passed;
+}
+
+int main(int argc, char *argv[]) {
+	for (uint32_t i=0; i < kIRLength; i++) irSignal[i] = randomSample() / 64.0f;
+	for (uint32_t i=0; i < inSignal.size(); i++) inSignal[i] = randomSample();
+
+	bool passed = true;
+	// The small blocks cover twice the big size, so the big ones have half their length to spare
+	passed &= testPattern("two size with slack", shared_ptr<BlockPattern>(new TwoSizeBlockPattern(kFrameSize, 4096, 128)), true);
+	// Barely any slack, but it should still come out the same
+	passed &= testPattern("doubling", shared_ptr<BlockPattern>(new DoublingBlockPattern(kFrameSize, 4096)), false);
+	passed &= testPattern("three size", shared_ptr<BlockPattern>(new ThreeSizeBlockPattern(kFrameSize, 512, 4096, 16, 15)), false);
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,187 @@
+/*
+ *  TestWorkerPool.cpp
+ *  Convolvotron
+ *
+ *  Created by Seth Nickell on 10/18/09.
+ *  Copyright 2009 Meatscience. All rights reserved.
+ *
+ */
+
+#include "Convolver.h"
+
+#include <iostream>
+#include <vector>
+#include <stdint.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include <assert.h>
+
+using std::cout;
+using std::endl;
+using std::vector;
+using boost::shared_ptr;
+using namespace Convolver;
+
+// Lots of plugin instances, each with its own "audio thread", all feeding the one pool
+static const uint32_t kNumInstances = 8;
+static const uint32_t kNumHostThreads = 4;
+static const uint32_t kFrameSize = 64;
+static const uint32_t kIRLength = 8192;
+static const uint32_t kNumFrames = 3 * kIRLength / kFrameSize;
+
+static vector<vector<TimeSample> > irSignals(2, vector<TimeSample>(kIRLength));
+static vector<vector<TimeSample> > inSignals(2, vector<TimeSample>(kNumFrames * kFrameSize));
+
+static float randomSample() {
+	return (float)rand() / RAND_MAX - 0.5f;
+}
+
+static shared_ptr<BlockPattern> makePattern() {
+	return shared_ptr<BlockPattern>(new DoublingBlockPattern(kFrameSize, 1024));
+}
+
+// Runs the whole input through a stereo Convolver, returning what came out of each channel
+static vector<vector<TimeSample> > run(bool useBackgroundThreads, bool skipLateWork=false, float sampleRate=44100.0f, Kernel::LatePolicy latePolicy=Kernel::LATE_WAIT) {
+	shared_ptr<BlockPattern> pattern = makePattern();
+	Convolver::Convolver convolver(pattern, useBackgroundThreads);
+	convolver.setSampleRate(sampleRate);
+	convolver.setSkipLateWork(skipLateWork);
+	convolver.setLatePolicy(latePolicy);
+
+	vector<const TimeSample *> irs;
+	irs.push_back(&irSignals[0][0]);
+	irs.push_back(&irSignals[1][0]);
+	IR ir(convolver.getKernel(), pattern, irs, kIRLength, false);
+
+	bool changeOutChannels = true;
+	uint32_t numOutChannels = 2;
+	convolver.setupStereoIn(ir.getFilters(), changeOutChannels, numOutChannels, 1.0f);
+
+	vector<vector<TimeSample> > outSignals(2, vector<TimeSample>(kNumFrames * kFrameSize));
+	for (uint32_t frame=0; frame < kNumFrames; frame++) {
+		vector<const TimeSample *> in;
+		vector<TimeSample *> out;
+		for (uint32_t c=0; c < 2; c++) {
+			in.push_back(&inSignals[c][frame * kFrameSize]);
+			out.push_back(&outSignals[c][frame * kFrameSize]);
+		}
+		convolver.convolve(in, out, kFrameSize, 0.0f, 1.0f);
+	}
+
+	return outSignals;
+}
+
+// Channel 0 through a bare Kernel, with the accumulators held (as if by a worker) over
+// every third callback, so the audio thread can never get at them then. How many
+// partitions came out late.
+static uint64_t runWithBusyAccumulators(vector<TimeSample> &output) {
+	shared_ptr<BlockPattern> pattern = makePattern();
+	Kernel kernel(pattern);
+	State state(kernel, pattern);
+	Filter filter(kernel, pattern, &irSignals[0][0], kIRLength);
+	state.reserveAccumulators(*pattern, filter);
+
+	uint64_t lateBefore = state.getNumLatePartitions();
+	output.resize(kNumFrames * kFrameSize);
+	for (uint32_t frame=0; frame < kNumFrames; frame++) {
+		const TimeSample *in = &inSignals[0][frame * kFrameSize];
+		shared_ptr<TimeBlock> input(new TimeBlock(in, in + kFrameSize));
+		bool busy = frame % 3 == 0;
+		if (busy) state.lockAccumulators("runWithBusyAccumulators()");
+		shared_ptr<TimeBlock> result = kernel.convolve(input, filter, state);
+		if (busy) state.unlockAccumulators("runWithBusyAccumulators()");
+		std::copy(result->begin(), result->end(), output.begin() + frame * kFrameSize);
+	}
+	return state.getNumLatePartitions() - lateBefore;
+}
+
+static vector<vector<TimeSample> > reference;
+static volatile int32_t numMismatches = 0;
+
+static void *hostThread(void *arguments) {
+	uint32_t numInstances = *(uint32_t *)arguments;
+	for (uint32_t i=0; i < numInstances; i++) {
+		vector<vector<TimeSample> > output = run(true);
+		for (uint32_t c=0; c < 2; c++) {
+			for (uint32_t j=0; j < output[c].size(); j++) {
+				if (fabs(output[c][j] - reference[c][j]) > 1e-3) {
+					__sync_add_and_fetch(&numMismatches, 1);
+					break;
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char *argv[]) {
+	for (uint32_t c=0; c < 2; c++) {
+		for (uint32_t i=0; i < kIRLength; i++) irSignals[c][i] = randomSample() / 32.0f;
+		for (uint32_t i=0; i < inSignals[c].size(); i++) inSignals[c][i] = randomSample();
+	}
+
+	reference = run(false);
+
+	uint32_t numInstancesPerThread = kNumInstances / kNumHostThreads;
+	vector<pthread_t> threads(kNumHostThreads);
+	for (uint32_t i=0; i < kNumHostThreads; i++) {
+		int result = pthread_create(&threads[i], NULL, &hostThread, &numInstancesPerThread);
+		assert(result == 0);
+	}
+	for (uint32_t i=0; i < kNumHostThreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	// One tier for each level but the first, which stays on the audio thread
+	Kernel kernel(makePattern());
+	uint32_t numTiers = WorkerPool::get().getNumTiers();
+	bool tiersPassed = numTiers == kernel.getPartitionSizes().size() - 1;
+	cout << kNumInstances << " instances on " << numTiers << " tiers of " << WorkerPool::get().getNumWorkers() << " workers: ";
+	cout << numMismatches << " mismatched channels" << (numMismatches == 0 && tiersPassed ? "" : " FAILED") << endl;
+	bool passed = numMismatches == 0 && tiersPassed;
+
+	// At a gigahertz every deadline's already gone by the time a worker sees it, so every
+	// job should get skipped, and pop() should carry on without them rather than hang
+	uint64_t skippedBefore = WorkerPool::get().getNumSkipped();
+	run(true, true, 1e9f);
+	uint64_t numSkipped = WorkerPool::get().getNumSkipped() - skippedBefore;
+	cout << "hopelessly late: " << numSkipped << " jobs skipped" << (numSkipped > 0 ? "" : " FAILED") << endl;
+	passed &= numSkipped > 0;
+
+	// Nobody waits on the workers, and however late they are what comes out is still sane:
+	// no worse than the input through the whole IR, and bang on for a dropped partition's
+	// first frames (the smallest partitions are done on the audio thread)
+	Kernel::LatePolicy policies[] = { Kernel::LATE_DROP, Kernel::LATE_MIX_LATE };
+	const char *policyNames[] = { "drop", "mix late" };
+	for (int p=0; p < 2; p++) {
+		uint64_t lateBefore = State::getTotalLatePartitions();
+		vector<vector<TimeSample> > output = run(true, false, 44100.0f, policies[p]);
+		uint64_t numLate = State::getTotalLatePartitions() - lateBefore;
+		
+		bool sane = true;
+		for (uint32_t c=0; c < 2; c++) {
+			for (uint32_t j=0; j < output[c].size(); j++) {
+				if (!(fabs(output[c][j]) < 10.0f)) sane = false;
+			}
+			for (uint32_t j=0; j < kFrameSize; j++) {
+				if (fabs(output[c][j] - reference[c][j]) > 1e-3) sane = false;
+			}
+		}
+		cout << policyNames[p] << ": " << numLate << " late partitions" << (sane ? "" : " FAILED") << endl;
+		passed &= sane;
+	}
+
+	// A partition that can't get at its accumulator waits for the next callback rather
+	// than being left out, and every partition past the first has a frame to spare
+	vector<TimeSample> busyOutput;
+	uint64_t numBusyLate = runWithBusyAccumulators(busyOutput);
+	uint32_t numBusyMismatches = 0;
+	for (uint32_t j=0; j < busyOutput.size(); j++) {
+		if (fabs(busyOutput[j] - reference[0][j]) > 1e-3) numBusyMismatches++;
+	}
+	cout << "busy accumulators: " << numBusyLate << " late partitions, " << numBusyMismatches << " mismatched samples" << (numBusyLate == 0 && numBusyMismatches == 0 ? "" : " FAILED") << endl;
+	passed &= numBusyLate == 0 && numBusyMismatches == 0;
+
+	return passed ? 0 : 1;
+}
@@ -38,6 +38,13 @@ void kiss_fftri(kiss_fftr_cfg cfg,const kiss_fft_cpx *freqdata,kiss_fft_scalar *
  output timedata has nfft scalar points
 */
 
+void kiss_fftr_scratch(kiss_fftr_cfg cfg,const kiss_fft_scalar *timedata,kiss_fft_cpx *freqdata,kiss_fft_cpx *scratch);
+void kiss_fftri_scratch(kiss_fftr_cfg cfg,const kiss_fft_cpx *freqdata,kiss_fft_scalar *timedata,kiss_fft_cpx *scratch);
+/*
+ Same as above, but the working space is the caller's scratch (nfft/2 complex points)
+ instead of the one inside cfg, so one cfg can be used from several threads at once
+*/
+
 #define kiss_fftr_free free
 
 #ifdef __cplusplus
@@ -12,6 +12,9 @@
 #include <list>
 #include <algorithm>
 #include <math.h>
+#include <time.h>
+#include <string.h>
+#include <stdlib.h>
 
 #include <sndfile.h>
 
@@ -105,14 +108,16 @@ char *resample(const char *filename, uint32_t target_rate) {
 int main(int argc, char *argv[]) {
 	uint32_t sampleSize = SAMPLE_SIZE;
 		
-	if (argc != 4) {
-		std::cerr << "Proper usage:\n" << std::endl << argv[0] << " signalFile irFile outputFile.wav" << std::endl << std::endl;
+	if (argc < 4 || argc > 6) {
+		std::cerr << "Proper usage:\n" << std::endl << argv[0] << " signalFile irFile outputFile.wav [requests|fdl] [numHeadBlocks]" << std::endl << std::endl;
 		return 2;
 	}
 	
 	const char *signalFilename = argv[1];
 	const char *irFilename = argv[2];
 	const char *outFilename = argv[3];
+	bool useFDL = argc >= 5 && strcmp(argv[4], "fdl") == 0;
+	uint32_t numHeadBlocks = argc == 6 ? atoi(argv[5]) : 0;
 	
 	
 	// Read the signals to be convolved
@@ -159,8 +164,14 @@ int main(int argc, char *argv[]) {
 	uint32_t big = small * 4; // 4096
 	uint32_t numSmall = 4;
 	// Choose the block pattern we'll use (e.g. 1024, 2048 4096, 4096, 4096, 4096, ...)
-	//shared_ptr<Convolver::BlockPattern> pattern(new Convolver::FixedSizeBlockPattern (sampleSize));	
-	shared_ptr<Convolver::BlockPattern> pattern(new Convolver::TwoSizeBlockPattern(small, big, numSmall));
+	shared_ptr<Convolver::BlockPattern> pattern;
+	if (useFDL) {
+		// The FDL wants every partition to be the same size
+		pattern.reset(new Convolver::FixedSizeBlockPattern(sampleSize));
+		convolver.setScheduler(Convolver::Kernel::SCHEDULER_FDL);
+	} else {
+		pattern.reset(new Convolver::TwoSizeBlockPattern(small, big, numSmall));
+	}
 	
 	
 	// Each channel has a state to it
@@ -170,11 +181,14 @@ int main(int argc, char *argv[]) {
 	Convolver::Filter filter(convolver, pattern, irBuffer, irBufferSize);
 	float gain = filter.measureGain();
 	filter.modify_Scale(1.0f / gain);
+	if (numHeadBlocks > 0) filter.setTimeDomainHead(numHeadBlocks);
+	state.reserveAccumulators(*pattern, filter);
 	
 	int outputBufferSize = signalBufferSize + irBufferSize + sampleSize;
 	float *outputBuffer = new float[outputBufferSize];
 	
 	// Do the Convolution in sampleSize blocks
+	clock_t startedAt = clock();
 	for(int i=0; i < signalBufferSize + irBufferSize; i += sampleSize) {
 	  float *result;
 		
@@ -195,6 +209,9 @@ int main(int argc, char *argv[]) {
 	  std::copy(output->begin(), output->end(), &outputBuffer[i]);		  
 	}
 	
+	double secondsTaken = (double)(clock() - startedAt) / CLOCKS_PER_SEC;
+	cout << (useFDL ? "FDL" : "FrameRequests") << " scheduler took " << secondsTaken << "s of CPU" << endl;
+	
 	//normalize_signal(outputBuffer, outputBufferSize);
 	
 	sf_count_t num_written = sf_writef_float(outFile, outputBuffer, outputBufferSize);
@@ -16,6 +16,7 @@
 #include <iostream>
 #include <stdio.h>
 #include <time.h>
+#include <sys/time.h>
 #include <signal.h>
 
 // Used only for converting channel num to string
@@ -23,6 +24,7 @@
 
 
 #include "Convolver.h"
+#include "ConvolverTuner.h"
 
 using boost::shared_ptr;
 
@@ -38,6 +40,28 @@ Float32 Convolvotron::peak = 0.0f;
 uint32_t blipInterval = 30; // 10 seconds
 #endif
 
+// What we plan the partitioning around until we've seen an IR
+static const Float32 kDefaultTunerIRSeconds = 5.0;
+
+// Host buffers this small get a time domain FIR for the start of the IR
+static const uint32_t kMaxTimeDomainHeadFrameSize = 64;
+static const uint32_t kMaxTimeDomainHeadTaps = 512;
+
+// IRs from files get cut off where what's left of their energy decay is this far down
+static const float kIRTruncateDecibels = -90.0f;
+
+// How much of an IR from a file gets prepared before we start convolving with it, and how
+// many more partitions of each channel get prepared at a time after that
+static const Float64 kIRPreparedSeconds = 1.0;
+static const uint32_t kIRBlocksPerStep = 8;
+
+// The render thread takes every finished pattern each callback, so at most the one being
+// worked on and the one requested after it can be waiting
+static const uint32_t kReadyBlockPatternsCapacity = 4;
+
+// How often the repartitioning thread looks for work if it misses a wakeup
+static const long kRepartitionPollNanoseconds = 10000000;
+
 
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 
@@ -49,7 +73,9 @@ COMPONENT_ENTRY(Convolvotron)
 //~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
 Convolvotron::Convolvotron(AudioUnit component)
 	: AUEffectBase(component), auConvolver(), 
-	  irFilename(), irLoadingThread(NULL), irLoadingStatus(), tailTime(0.0f)
+	  irFilename(), irLoadingThread(NULL), irLoadingStatus(), requestedFrameSize(0),
+	  readyBlockPatterns(kReadyBlockPatternsCapacity), stopRepartitioning(false), tailTime(0.0f),
+	  frameSize(0), waitingForBlockPattern(false), pendingFrameSize(0)
 {
 	#if DEBUG
 	cout << "Convolvotron::Convolvotron()" << endl;
@@ -78,34 +104,122 @@ Convolvotron::Convolvotron(AudioUnit component)
 	
 	pthread_mutex_init(&filtersMutex, NULL);
 	
+	pthread_mutex_init(&repartitionMutex, NULL);
+	pthread_cond_init(&repartitionRequested, NULL);
+	// Default priority, the render thread's rendering dry till we're done anyway
+	int result = pthread_create(&repartitionThread, NULL, &repartitionEntry, this);
+	assert(result == 0);
 }
 
-void Convolvotron::setFrameSize(uint32_t frameSize) {
-	if (this->frameSize != frameSize) {
+// On the render thread: false means there's no block pattern for this frame size yet, and
+// the callback should go out dry. Never blocks, the repartitioning thread does the work.
+bool Convolvotron::setFrameSize(uint32_t frameSize) {
+	// If the host changed its mind while we waited, the newest is the one ir's partitioned for
+	ReadyBlockPattern ready;
+	bool gotBlockPattern = false;
+	while (readyBlockPatterns.pop(ready)) gotBlockPattern = true;
+	if (gotBlockPattern) {
+		auConvolver->setBlockPattern(ready.second);
+		this->frameSize = ready.first;
+		if (ready.first == pendingFrameSize) waitingForBlockPattern = false;
+	}
+	
+	if (!waitingForBlockPattern && this->frameSize == frameSize) return true;
+	
+	if (!waitingForBlockPattern || pendingFrameSize != frameSize) {
 		#if DEBUG
-		cout << endl << "Convolvotron::setFrameSize() changing frameSize from " << this->frameSize << " to " << frameSize << endl << endl;
+		cout << endl << "Convolvotron::setFrameSize() asking to change frameSize from " << this->frameSize << " to " << frameSize << endl << endl;
 		#endif
 		
-		this->frameSize = frameSize;
-
-		shared_ptr<Convolver::BlockPattern> blockPattern;
-		if (frameSize > 1024 && frameSize < 2048) {
-			blockPattern.reset(new Convolver::TwoSizeBlockPattern(frameSize, frameSize*2, 2));		
-		} else if (frameSize > 512 && frameSize <= 1024) {
-			blockPattern.reset(new Convolver::TwoSizeBlockPattern(frameSize, frameSize*4, 4));
-		} else if (frameSize <= 512) {
-			blockPattern.reset(new Convolver::TwoSizeBlockPattern(frameSize, frameSize*8, 8));		
+		pendingFrameSize = frameSize;
+		waitingForBlockPattern = true;
+		__sync_lock_test_and_set(&requestedFrameSize, frameSize);
+		
+		// Same as Releaser::release(), the timed wait covers us if we miss
+		if (pthread_mutex_trylock(&repartitionMutex) == 0) {
+			pthread_cond_signal(&repartitionRequested);
+			pthread_mutex_unlock(&repartitionMutex);
 		} else {
-			// We're >= 2048
-			blockPattern.reset(new Convolver::FixedSizeBlockPattern(frameSize));
+			pthread_cond_signal(&repartitionRequested);
+		}
+	}
+	return false;
+}
+
+void *Convolvotron::repartitionEntry(void *arguments) {
+	((Convolvotron *)arguments)->repartitionLoop();
+	return NULL;
+}
+
+void Convolvotron::repartitionLoop() {
+	pthread_mutex_lock(&repartitionMutex);
+	while (!stopRepartitioning) {
+		uint32_t frameSize = __sync_lock_test_and_set(&requestedFrameSize, 0);
+		if (frameSize > 0) {
+			repartitionFor(frameSize);
+			continue;
 		}
 		
-		assert(blockPattern != NULL);
-		
-		auConvolver->setBlockPattern(blockPattern);
-		ir->setBlockPattern(auConvolver->getKernel(), blockPattern);
-		filenameToIRCache.clear();	
+		timeval now;
+		gettimeofday(&now, NULL);
+		long nanoseconds = now.tv_usec * 1000 + kRepartitionPollNanoseconds;
+		timespec until = { now.tv_sec + nanoseconds / 1000000000, nanoseconds % 1000000000 };
+		pthread_cond_timedwait(&repartitionRequested, &repartitionMutex, &until);
+	}
+	pthread_mutex_unlock(&repartitionMutex);
+}
+
+// With repartitionMutex held, so Initialize() can't swap the convolver out from under us
+void Convolvotron::repartitionFor(uint32_t frameSize) {
+	shared_ptr<Convolver::BlockPattern> blockPattern = chooseBlockPattern(frameSize);
+	
+	assert(blockPattern != NULL);
+	
+	// The live setup's still convolving with ir's Filters, so the new pattern gets new ones.
+	// They're queued before the render thread takes the pattern, so they go live together.
+	Convolver::Kernel kernel(blockPattern);
+	pthread_mutex_lock(&this->filtersMutex); {
+		irBlockPattern = blockPattern;
+		if (ir != NULL) {
+			ir = ir->repartitioned(kernel, blockPattern);
+			ir->setTimeDomainHead(numHeadBlocksFor(blockPattern));
+			auConvolver->setFilters(ir->getFilters(), 1.0f);
+		}
+		filenameToIRCache.clear();
+	} pthread_mutex_unlock(&this->filtersMutex);
+	
+	if (!readyBlockPatterns.push(ReadyBlockPattern(frameSize, blockPattern))) {
+		cerr << "Convolvotron::repartitionFor(): no room to hand back the pattern for frameSize " << frameSize << endl;
+	}
+}
+
+// Let the Tuner cost out the candidate partitionings on this machine. We usually don't
+// know the IR yet, so plan for the last one we loaded or a typical hall.
+shared_ptr<Convolver::BlockPattern> Convolvotron::chooseBlockPattern(uint32_t frameSize) {
+	Float32 irSeconds = tailTime > 0.0 ? tailTime : kDefaultTunerIRSeconds;
+	uint32_t irLength = irSeconds * GetSampleRate();
+	
+	Convolver::TunerEstimate estimate = Convolver::Tuner::getSharedTuner().choose(frameSize, irLength, GetNumberOfChannels(), GetSampleRate());
+	
+	#if DEBUG
+	cout << "Convolvotron::chooseBlockPattern(): " << estimate.blockPattern->toString() << " should take " << estimate.cpuPercent << "% cpu and ";
+	cout << estimate.memoryBytes / 1024 << "KB for a " << irSeconds << "s IR" << endl;
+	#endif
+	
+	return estimate.blockPattern;
+}
+
+// At tiny host buffers the smallest FFT partitions are mostly overhead, so do the
+// leading run of them as a time domain FIR instead
+uint32_t Convolvotron::numHeadBlocksFor(shared_ptr<Convolver::BlockPattern> blockPattern) {
+	uint32_t smallSize = blockPattern->minimumBlockSize();
+	if (smallSize > kMaxTimeDomainHeadFrameSize) return 0;
+	
+	uint32_t numHeadBlocks = 0;
+	while (blockPattern->sizeForTimeBlock(numHeadBlocks) == smallSize && (numHeadBlocks + 1) * smallSize <= kMaxTimeDomainHeadTaps) {
+		numHeadBlocks++;
 	}
+	return numHeadBlocks;
 }
 
 ComponentResult	Convolvotron::Initialize()
@@ -115,6 +229,13 @@ ComponentResult	Convolvotron::Initialize()
 	// Do this pre-emptively, because ableton likes to send lots of crazy calls
 	cancelIRLoadingThread();
 	
+	// Anything the repartitioning thread was doing was for the convolver we're replacing
+	pthread_mutex_lock(&repartitionMutex);
+	requestedFrameSize = 0;
+	ReadyBlockPattern stale;
+	while (readyBlockPatterns.pop(stale)) {}
+	waitingForBlockPattern = false;
+	
 	UInt32 maxFrameSize = GetMaxFramesPerSlice();
 	this->frameSize = maxFrameSize;
 	
@@ -127,25 +248,20 @@ ComponentResult	Convolvotron::Initialize()
 #endif
 	
 	// Delete our caches
-	ir = boost::shared_ptr<Convolver::IR>();
-	filenameToIRCache.clear();	
+	pthread_mutex_lock(&this->filtersMutex); {
+		ir = boost::shared_ptr<Convolver::IR>();
+		filenameToIRCache.clear();	
+	} pthread_mutex_unlock(&this->filtersMutex);
 	
 	
 	#if DEBUG
 	cout << "Convolvolvotron::Initialize(): maxFramesPerSlice=" << maxFrameSize << ", sampleRate=" << sampleRate << endl;
 	#endif
 	
-	shared_ptr<Convolver::BlockPattern> blockPattern;
-	if (maxFrameSize > 1024 && maxFrameSize < 2048) {
-		blockPattern.reset(new Convolver::TwoSizeBlockPattern(maxFrameSize, maxFrameSize*2, 2));		
-	} else if (maxFrameSize > 512 && maxFrameSize <= 1024) {
-		blockPattern.reset(new Convolver::TwoSizeBlockPattern(maxFrameSize, maxFrameSize*4, 4));
-	} else if (maxFrameSize <= 512) {
-		blockPattern.reset(new Convolver::TwoSizeBlockPattern(maxFrameSize, maxFrameSize*8, 8));		
-	} else {
-		// We're >= 2048
-		blockPattern.reset(new Convolver::FixedSizeBlockPattern(maxFrameSize));
-	}
+	// Measured once per process, then choosing for whatever buffer size the host
+	// switches to doesn't hold up the render thread's dry spell with benchmarks
+	Convolver::Tuner::getSharedTuner().benchmarkFrameSizes(maxFrameSize);
+	shared_ptr<Convolver::BlockPattern> blockPattern = chooseBlockPattern(maxFrameSize);
 	
 	assert(blockPattern != NULL);
 	
@@ -156,6 +272,11 @@ ComponentResult	Convolvotron::Initialize()
 	
 	shared_ptr<Convolver::AUConvolver> auConvolver(new Convolver::AUConvolver(*this, blockPattern));
 	this->auConvolver = auConvolver;
+	pthread_mutex_lock(&this->filtersMutex); {
+		irBlockPattern = blockPattern;
+	} pthread_mutex_unlock(&this->filtersMutex);
+	
+	pthread_mutex_unlock(&repartitionMutex);
 		
 	
 	if(result == noErr ) {	
@@ -199,6 +320,14 @@ Convolvotron::~Convolvotron () {
 	cout << endl << "Convolvotron::~Convolvotron()" << endl;
 	#endif
 	
+	pthread_mutex_lock(&repartitionMutex); {
+		stopRepartitioning = true;
+		pthread_cond_signal(&repartitionRequested);
+	} pthread_mutex_unlock(&repartitionMutex);
+	pthread_join(repartitionThread, NULL);
+	pthread_cond_destroy(&repartitionRequested);
+	pthread_mutex_destroy(&repartitionMutex);
+	
 	pthread_mutex_destroy(&filtersMutex);
 	
 	#if AU_DEBUG_DISPATCHER
@@ -234,11 +363,9 @@ OSStatus	Convolvotron::ProcessBufferLists(AudioUnitRenderActionFlags &	ioActionF
 	}
 #endif
 	
-	// FIXME: we should pop remaining state out so we "ring out"
-	if (silentInput) return noErr;
-	
-	// This should only change frame size if its different
-	this->setFrameSize(inFramesToProcess);
+	// Keep going through silence until the tail's rung out, it's nearly free. Once it
+	// has, the states just wait where they are for the input to come back.
+	if (silentInput && !auConvolver->isRingingOut()) return noErr;
 	
 	Float32 wetDryMix = GetParameter( kParam_WetDry ) / 100.0;
 	Float32 outGain = pow(10.0, GetParameter(kParam_OutputGain) / 20.0);
@@ -247,8 +374,15 @@ OSStatus	Convolvotron::ProcessBufferLists(AudioUnitRenderActionFlags &	ioActionF
 	Float32 dryGain = outGain * sqrt(1.0 - wetDryMix);
 	Float32 wetGain = outGain * sqrt(wetDryMix);
 	
-	ioSilence = silentInput;
-	auConvolver->convolve(inBuffer, outBuffer, inFramesToProcess, dryGain, wetGain);
+	// Silent input that gets this far is still ringing out
+	ioSilence = false;
+	
+	// The host changed its buffer size, go out dry till we're partitioned for it
+	if (this->setFrameSize(inFramesToProcess)) {
+		auConvolver->convolve(inBuffer, outBuffer, inFramesToProcess, dryGain, wetGain);
+	} else {
+		renderDry(inBuffer, outBuffer, inFramesToProcess, dryGain);
+	}
 	if (!ioSilence)
 		ioActionFlags &= ~kAudioUnitRenderAction_OutputIsSilence;
 	
@@ -341,6 +475,18 @@ OSStatus	Convolvotron::ProcessBufferLists(AudioUnitRenderActionFlags &	ioActionF
 	return noErr;
 }
 
+void Convolvotron::renderDry(const AudioBufferList &inBuffer, AudioBufferList &outBuffer, UInt32 inFramesToProcess, Float32 dryGain) {
+	for (uint32_t i=0; i < outBuffer.mNumberBuffers; i++) {
+		AudioSampleType *output = (AudioSampleType *)outBuffer.mBuffers[i].mData;
+		if (i < inBuffer.mNumberBuffers) {
+			const AudioSampleType *input = (const AudioSampleType *)inBuffer.mBuffers[i].mData;
+			for (uint32_t j=0; j < inFramesToProcess; j++) output[j] = input[j] * dryGain;
+		} else {
+			memset(output, 0, inFramesToProcess * sizeof(AudioSampleType));
+		}
+	}
+}
+
 void Convolvotron::LoadUnitIR() {
 	#if DEBUG
 	cout << "Convolvotron::LoadUnitIR()" << endl;
@@ -348,8 +494,14 @@ void Convolvotron::LoadUnitIR() {
 	
 	irFilename = "";
 	
+	shared_ptr<Convolver::BlockPattern> blockPattern;
+	pthread_mutex_lock(&this->filtersMutex); {
+		blockPattern = irBlockPattern;
+	} pthread_mutex_unlock(&this->filtersMutex);
+	
 	// FIXME: right now, we gotta normalize, or else no frequency response = CRASH
-	shared_ptr<Convolver::IR> unitIR(new Convolver::UnitIR(auConvolver->getKernel(), auConvolver->getBlockPattern()));
+	Convolver::Kernel kernel(blockPattern);
+	shared_ptr<Convolver::IR> unitIR(new Convolver::UnitIR(kernel, blockPattern));
 	
 	std::string filename = "";
 	SetIR(filename, unitIR);
@@ -413,6 +565,16 @@ void Convolvotron::SetIR(std::string &filename, boost::shared_ptr<Convolver::IR>
 		
 		this->irFilename = filename;
 		
+		// Made before the last buffer size change got to it, or cached from before it. A
+		// cached one may still be live, so it's never re-partitioned in place.
+		if (ir->getFilters()[0]->getBlockPattern() != irBlockPattern) {
+			Convolver::Kernel kernel(irBlockPattern);
+			ir = ir->repartitioned(kernel, irBlockPattern);
+		}
+		
+		// Only a new IR needs its head, one from the cache has it for its pattern already
+		uint32_t numHeadBlocks = numHeadBlocksFor(irBlockPattern);
+		if (ir->getFilters()[0]->getNumHeadBlocks() != numHeadBlocks) ir->setTimeDomainHead(numHeadBlocks);
 		this->ir = ir;
 		
 		// FIXME: we don't set stereo separation yet
@@ -438,13 +600,17 @@ void Convolvotron::LoadIR(std::string &filename, bool inBackground) {
 	assert(filename != "");
 	
 	// Check if we already have this filename loaded into memory
-	std::map<std::string, boost::shared_ptr<Convolver::IR> >::iterator cacheIter = filenameToIRCache.find(filename);
-	if (cacheIter != filenameToIRCache.end()) {
+	shared_ptr<Convolver::IR> cachedIR;
+	pthread_mutex_lock(&this->filtersMutex); {
+		std::map<std::string, boost::shared_ptr<Convolver::IR> >::iterator cacheIter = filenameToIRCache.find(filename);
+		if (cacheIter != filenameToIRCache.end()) cachedIR = cacheIter->second;
+	} pthread_mutex_unlock(&this->filtersMutex);
+	if (cachedIR != NULL) {
 		// We do! no need to use background loading
 		#if DEBUG
 		cout << "Convolvotron::LoadIR(): " << filename << "found in cache, loading" << endl;
 		#endif			
-		SetIR(filename, cacheIter->second);
+		SetIR(filename, cachedIR);
 		return;
 	}
 	
@@ -586,18 +752,41 @@ void Convolvotron::LoadIR(std::string &filename, bool inBackground) {
 		uint32_t slashLocation = filename.find_last_of("/");
 		std::string shortName = slashLocation+1 < filename.size() ? filename.substr(slashLocation+1) : filename;
 				
-		shared_ptr<Convolver::IR> irPtr(new Convolver::IR(auConvolver->getKernel(), auConvolver->getBlockPattern(), 
-														  channels, loadedFrames, normalize, shortName));
+		// Our own FFTs, the audio thread's using the AU's. SetIR() catches us up if the
+		// buffer size changes before we get there.
+		shared_ptr<Convolver::BlockPattern> blockPattern;
+		pthread_mutex_lock(&this->filtersMutex); {
+			blockPattern = irBlockPattern;
+		} pthread_mutex_unlock(&this->filtersMutex);
+		Convolver::Kernel loaderKernel(blockPattern);
+		uint32_t preparedLength = (uint32_t)(kIRPreparedSeconds * kGraphSampleRate);
+		shared_ptr<Convolver::IR> irPtr(new Convolver::IR(loaderKernel, blockPattern, 
+														  channels, loadedFrames, normalize, shortName, kIRTruncateDecibels, preparedLength));
 		
 		delete[] data;
 		delete bufList;
+		ExtAudioFileDispose(xafref);
 
 		SetIR(filename, irPtr);
 		
-		// We've loaded a new file, add it to the cache
-		filenameToIRCache[filename] = ir;
+		// We're convolving with the start of it already, the rest gets published a few
+		// partitions at a time, well before the audio thread gets to them. Never cancelled
+		// halfway through a step, with filtersMutex held.
+		bool moreToPrepare = !irPtr->isPrepared();
+		while (moreToPrepare) {
+			int cancelState;
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelState);
+			pthread_mutex_lock(&this->filtersMutex); {
+				moreToPrepare = irPtr->prepareMore(loaderKernel, kIRBlocksPerStep);
+			} pthread_mutex_unlock(&this->filtersMutex);
+			pthread_setcancelstate(cancelState, NULL);
+			pthread_testcancel();
+		}
 		
-		ExtAudioFileDispose(xafref);
+		// We've loaded a new file, add it to the cache, now there's all of it
+		pthread_mutex_lock(&this->filtersMutex); {
+			filenameToIRCache[filename] = irPtr;
+		} pthread_mutex_unlock(&this->filtersMutex);
 	}
 	
 	if (false) { // FIXME: do this if an exception was thrown
@@ -892,8 +1081,11 @@ if (inScope == kAudioUnitScope_Global) {
 				IRInfo *outInfo = (IRInfo *)outData;
 				
 				IRInfo info;
-				info.seconds = (float)getMonoIR()->getNumSamples() / GetSampleRate();
-				info.numChannels = ir->getFilters().size();
+				pthread_mutex_lock(&this->filtersMutex); {
+					info.seconds = (float)ir->getOriginalLength() / GetSampleRate();
+					info.trimmedSeconds = (float)ir->getLength() / GetSampleRate();
+					info.numChannels = ir->getFilters().size();
+				} pthread_mutex_unlock(&this->filtersMutex);
 				
 				*outInfo = info;
 				
@@ -142,9 +142,27 @@ protected:
 	
 	pthread_mutex_t filtersMutex;
 	
+	// What ir's partitioned for, under filtersMutex, SetIR() repartitions a copy of anything
+	// that isn't. The convolver only catches up when the render thread takes it from
+	// readyBlockPatterns.
+	boost::shared_ptr<Convolver::BlockPattern> irBlockPattern;
+	
 	std::string irFilename;
 	pthread_t irLoadingThread;
 	IRLoadingStatus irLoadingStatus;
+	
+	// A new host buffer size needs a BlockPattern from the Tuner and the IR re-partitioned for
+	// it, far too much for the render thread. It leaves the size in requestedFrameSize and
+	// renders dry, the repartitioning thread does the work and hands back the pattern along
+	// with the frame size it was chosen for.
+	typedef std::pair<uint32_t, boost::shared_ptr<Convolver::BlockPattern> > ReadyBlockPattern;
+	volatile uint32_t requestedFrameSize;
+	Convolver::LockFreeQueue<ReadyBlockPattern> readyBlockPatterns;
+	pthread_t repartitionThread;
+	// Held while the repartitioning thread's at work
+	pthread_mutex_t repartitionMutex;
+	pthread_cond_t repartitionRequested;
+	volatile bool stopRepartitioning;
 
 	Float64 tailTime;
 	
@@ -152,7 +170,16 @@ protected:
 	
 private:
 	uint32_t frameSize;
-	void setFrameSize(uint32_t frameSize);
+	// Only the render thread's
+	bool waitingForBlockPattern;
+	uint32_t pendingFrameSize;
+	bool setFrameSize(uint32_t frameSize);
+	void renderDry(const AudioBufferList &inBuffer, AudioBufferList &outBuffer, UInt32 inFramesToProcess, Float32 dryGain);
+	static void *repartitionEntry(void *arguments);
+	void repartitionLoop();
+	void repartitionFor(uint32_t frameSize);
+	boost::shared_ptr<Convolver::BlockPattern> chooseBlockPattern(uint32_t frameSize);
+	uint32_t numHeadBlocksFor(boost::shared_ptr<Convolver::BlockPattern> blockPattern);
 	void LoadUnitIR();
 	boost::shared_ptr<Convolver::Filter> getMonoIR();
 	void cancelIRLoadingThread();
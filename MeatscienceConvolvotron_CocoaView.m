@@ -446,6 +446,9 @@ void ParameterListenerDispatcher (void *inRefCon, void *inObject, const AudioUni
 	} else {
 		string = [NSString stringWithFormat: @"%d-channel, %3.1f seconds", info.numChannels, info.seconds];
 	}
+	if (info.trimmedSeconds < info.seconds - 0.05) {
+		string = [string stringByAppendingFormat: @" (%3.1f audible)", info.trimmedSeconds];
+	}
 	[fileInfoTextField setStringValue: string];
 }
 